@@ -1,187 +1,9575 @@
 #include <iostream>
 #include <vector>
+#include <deque>
 #include <unordered_map>
-#include <unordered_set>
 #include <queue>
 #include <algorithm>
+#include <string_view>
+#include <cstdint>
+#include <cstring>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <random>
+#include <string>
+#include <shared_mutex>
+#include <cmath>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define BOOKREC_X86_SIMD 1
+#endif
 
 using namespace std;
 
-// Node representing a book
-struct BookNode
+// Id returned for names that have not been interned
+const uint32_t kInvalidId = UINT32_MAX;
+
+// Read-only view over one sorted adjacency row
+struct IdSpan
+{
+    const uint32_t *first = nullptr;
+    size_t count = 0;
+
+    const uint32_t *begin() const { return first; }
+    const uint32_t *end() const { return first + count; }
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    uint32_t operator[](size_t i) const { return first[i]; }
+
+    bool contains(uint32_t id) const
+    {
+        return binary_search(begin(), end(), id);
+    }
+};
+
+// Count the ids two sorted rows have in common
+size_t intersectionSize(IdSpan a, IdSpan b)
+{
+    if (a.size() > b.size())
+    {
+        swap(a, b);
+    }
+
+    size_t common = 0;
+    if (a.size() * 16 < b.size())
+    {
+        // Very unequal rows: binary search the short row's ids in the long row
+        const uint32_t *from = b.begin();
+        for (uint32_t id : a)
+        {
+            from = lower_bound(from, b.end(), id);
+            if (from == b.end())
+            {
+                break;
+            }
+            if (*from == id)
+            {
+                common++;
+            }
+        }
+        return common;
+    }
+
+    const uint32_t *i = a.begin();
+    const uint32_t *j = b.begin();
+    while (i != a.end() && j != b.end())
+    {
+        if (*i < *j)
+        {
+            ++i;
+        }
+        else if (*j < *i)
+        {
+            ++j;
+        }
+        else
+        {
+            common++;
+            ++i;
+            ++j;
+        }
+    }
+    return common;
+}
+
+// Stable 64-bit hash of a name, eight bytes at a time. Defined here rather
+// than taken from std::hash so the value is the same in every build.
+uint64_t hashName(string_view name)
+{
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ (name.size() * 0xff51afd7ed558ccdULL);
+    size_t i = 0;
+    for (; i + 8 <= name.size(); i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, name.data() + i, 8);
+        h = (h ^ word) * 0xbf58476d1ce4e5b9ULL;
+        h ^= h >> 29;
+    }
+    uint64_t tail = 0;
+    for (size_t shift = 0; i < name.size(); ++i, shift += 8)
+    {
+        tail |= (uint64_t)(unsigned char)name[i] << shift;
+    }
+    h = (h ^ tail) * 0x94d049bb133111ebULL;
+    h ^= h >> 32;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 29;
+    return h;
+}
+
+// Bump allocator for strings that live as long as the arena. Strings are
+// packed into large blocks that never move, so views into them stay valid,
+// and a name costs no heap node of its own.
+class StringArena
+{
+private:
+    static constexpr size_t kBlockSize = 1 << 16;
+    vector<unique_ptr<char[]>> blocks;
+    char *cursor = nullptr; // free space of the current block
+    size_t left = 0;
+
+public:
+    string_view copy(string_view text)
+    {
+        if (text.size() > left)
+        {
+            if (text.size() > kBlockSize / 4)
+            {
+                // Long strings get a block to themselves; the current one stays open
+                blocks.emplace_back(new char[text.size()]);
+                memcpy(blocks.back().get(), text.data(), text.size());
+                return string_view(blocks.back().get(), text.size());
+            }
+            blocks.emplace_back(new char[kBlockSize]);
+            cursor = blocks.back().get();
+            left = kBlockSize;
+        }
+        memcpy(cursor, text.data(), text.size());
+        string_view stored(cursor, text.size());
+        cursor += text.size();
+        left -= text.size();
+        return stored;
+    }
+
+    void clear()
+    {
+        blocks.clear();
+        cursor = nullptr;
+        left = 0;
+    }
+};
+
+// Maps names to dense ids so every name is stored exactly once. Lookups use
+// an open-addressing table of (hash tag, id) words, so a probe usually
+// costs one cache miss for the slot and one for the string compare. The
+// table and the first names can also live in a mapped snapshot file; they
+// are only copied out (slots) or never (names) once new names are added.
+class StringInterner
+{
+private:
+    // Names [0, mappedCount) come from a snapshot's offsets and blob, the
+    // rest from names
+    const uint64_t *mappedOffsets = nullptr;
+    const char *mappedBlob = nullptr;
+    size_t mappedCount = 0;
+    StringArena nameStorage;
+    vector<string_view> names; // into nameStorage
+
+    vector<uint64_t> ownedSlots; // (upper hash bits << 32) | (id + 1); 0 = empty
+    const uint64_t *slots = nullptr; // ownedSlots or a mapped snapshot's table
+    size_t slotCount = 0;
+    size_t mask = 0;
+
+    static uint64_t slotFor(uint64_t hash, uint32_t id)
+    {
+        return (hash & 0xffffffff00000000ULL) | ((uint64_t)id + 1);
+    }
+
+    void rehash(size_t capacity)
+    {
+        ownedSlots.assign(capacity, 0);
+        slots = ownedSlots.data();
+        slotCount = capacity;
+        mask = capacity - 1;
+        for (uint32_t id = 0; id < size(); ++id)
+        {
+            uint64_t hash = hashName(name(id));
+            size_t i = hash & mask;
+            while (ownedSlots[i] != 0)
+            {
+                i = (i + 1) & mask;
+            }
+            ownedSlots[i] = slotFor(hash, id);
+        }
+    }
+
+    // Slot holding the name, or the empty slot where it would go
+    size_t probe(string_view wanted, uint64_t hash) const
+    {
+        size_t i = hash & mask;
+        uint64_t tag = hash & 0xffffffff00000000ULL;
+        while (slots[i] != 0)
+        {
+            if ((slots[i] & 0xffffffff00000000ULL) == tag && name((uint32_t)slots[i] - 1) == wanted)
+            {
+                return i;
+            }
+            i = (i + 1) & mask;
+        }
+        return i;
+    }
+
+public:
+    StringInterner() = default;
+    StringInterner(const StringInterner &) = delete; // slots may point into ownedSlots
+    StringInterner &operator=(const StringInterner &) = delete;
+
+    // Id of an interned name, or kInvalidId
+    uint32_t find(string_view wanted) const
+    {
+        if (slotCount == 0)
+        {
+            return kInvalidId;
+        }
+        uint64_t slot = slots[probe(wanted, hashName(wanted))];
+        return slot == 0 ? kInvalidId : (uint32_t)slot - 1;
+    }
+
+    // Id of a name, interning it if needed
+    uint32_t intern(string_view wanted, bool &inserted)
+    {
+        if ((size() + 1) * 2 > slotCount)
+        {
+            rehash(max<size_t>(16, slotCount * 2));
+        }
+        else if (slots != ownedSlots.data())
+        {
+            ownedSlots.assign(slots, slots + slotCount); // first write after mapping
+            slots = ownedSlots.data();
+        }
+
+        uint64_t hash = hashName(wanted);
+        size_t i = probe(wanted, hash);
+        if (slots[i] != 0)
+        {
+            inserted = false;
+            return (uint32_t)slots[i] - 1;
+        }
+
+        uint32_t id = (uint32_t)size();
+        names.push_back(nameStorage.copy(wanted));
+        ownedSlots[i] = slotFor(hash, id);
+        inserted = true;
+        return id;
+    }
+
+    string_view name(uint32_t id) const
+    {
+        if (id < mappedCount)
+        {
+            return string_view(mappedBlob + mappedOffsets[id], mappedOffsets[id + 1] - mappedOffsets[id]);
+        }
+        return names[id - mappedCount];
+    }
+
+    size_t size() const
+    {
+        return mappedCount + names.size();
+    }
+
+    // Replace the contents with tables stored elsewhere: count + 1 name
+    // offsets into blob, and a power-of-two slot table as built here
+    void view(const uint64_t *offsets, const char *blob, size_t count, const uint64_t *table, size_t tableSize)
+    {
+        mappedOffsets = offsets;
+        mappedBlob = blob;
+        mappedCount = count;
+        names.clear();
+        nameStorage.clear();
+        ownedSlots.clear();
+        slots = table;
+        slotCount = tableSize;
+        mask = tableSize - 1;
+    }
+
+    // Raw lookup table, for writing snapshots
+    const uint64_t *slotArray() const
+    {
+        return slots;
+    }
+
+    size_t slotArraySize() const
+    {
+        return slotCount;
+    }
+};
+
+// Compressed sparse row adjacency: the neighbors of node i are the sorted
+// range [offsets[i], offsets[i + 1]) of one edge numbering, with the
+// neighbor ids kept in pages of consecutive nodes. A merge rebuilds only
+// the pages that gain edges and shares the others with the adjacency it was
+// merged from, so publishing a few reads copies the offsets and a few pages
+// instead of the whole graph. Pages hold about kPageEdges edges, so a
+// low-degree direction gets wide pages and a high-degree one narrow ones.
+class CsrAdjacency
+{
+public:
+    static constexpr uint32_t kMaxPageBits = 8;
+    static constexpr size_t kPageEdges = 1024;
+
+private:
+    // A page's neighbor ids: edge first + i is neighbors[i]
+    struct PageRef
+    {
+        const uint32_t *neighbors;
+        uint64_t first;
+    };
+
+    vector<uint64_t> ownedOffsets;
+    const uint64_t *offsets = nullptr; // nodeCount() + 1 row starts
+    vector<PageRef> refs;
+    vector<shared_ptr<const vector<uint32_t>>> pages; // owners; empty for a mapped file's pages
+    uint32_t pageBits = kMaxPageBits;
+    size_t nodes = 0;
+
+    // Widest page size keeping the average page within kPageEdges edges
+    static uint32_t pageBitsFor(size_t nodes, size_t edges)
+    {
+        uint32_t bits = kMaxPageBits;
+        while (bits > 0 && (edges << bits) > kPageEdges * max<size_t>(nodes, 1))
+        {
+            bits--;
+        }
+        return bits;
+    }
+
+public:
+    CsrAdjacency() = default;
+    CsrAdjacency(CsrAdjacency &&) = default;
+    CsrAdjacency &operator=(CsrAdjacency &&) = default;
+    CsrAdjacency(const CsrAdjacency &) = delete;
+    CsrAdjacency &operator=(const CsrAdjacency &) = delete;
+
+    // Adjacency over flat arrays owned by someone else, e.g. a mapped file
+    static CsrAdjacency view(const uint64_t *offsets, const uint32_t *neighbors, size_t nodes)
+    {
+        CsrAdjacency adjacency;
+        adjacency.offsets = offsets;
+        adjacency.nodes = nodes;
+        adjacency.pageBits = pageBitsFor(nodes, offsets[nodes]);
+        for (size_t first = 0; first < nodes; first += adjacency.pageNodes())
+        {
+            adjacency.refs.push_back(PageRef{neighbors + offsets[first], offsets[first]});
+            adjacency.pages.push_back(make_shared<const vector<uint32_t>>());
+        }
+        return adjacency;
+    }
+
+    size_t nodeCount() const
+    {
+        return nodes;
+    }
+
+    size_t edgeCount() const
+    {
+        return nodes == 0 ? 0 : offsets[nodes];
+    }
+
+    // Page i holds nodes [i << pageShift(), (i + 1) << pageShift())
+    uint32_t pageShift() const
+    {
+        return pageBits;
+    }
+
+    size_t pageNodes() const
+    {
+        return size_t(1) << pageBits;
+    }
+
+    size_t pageCount() const
+    {
+        return refs.size();
+    }
+
+    // Nodes in a page; the last one may be partial
+    size_t pageSize(size_t page) const
+    {
+        return min(pageNodes(), nodes - (page << pageBits));
+    }
+
+    // Identity of a page: equal in two adjacencies exactly when one shares
+    // the page with the other
+    const void *pageId(size_t page) const
+    {
+        return pages[page].get();
+    }
+
+    // Neighbors of a node; nodes added after the last merge have none yet
+    IdSpan row(uint32_t node) const
+    {
+        if (node >= nodes)
+        {
+            return IdSpan{};
+        }
+        const PageRef &page = refs[node >> pageBits];
+        return IdSpan{page.neighbors + (offsets[node] - page.first), (size_t)(offsets[node + 1] - offsets[node])};
+    }
+
+    // Copy with extra edges merged in; edges must be sorted by (node,
+    // neighbor), unique, and not already present. Pages without new edges
+    // or new nodes are shared, not copied. The page size stays put until
+    // the average degree moves 4x from the one it was picked for, and then
+    // every page is rebuilt at the new size.
+    CsrAdjacency mergedWith(const vector<pair<uint32_t, uint32_t>> &edges, size_t newNodeCount) const
+    {
+        CsrAdjacency merged;
+        merged.nodes = max(newNodeCount, nodeCount());
+        uint32_t bits = pageBitsFor(merged.nodes, edgeCount() + edges.size());
+        bool repage = refs.empty() || bits + 2 <= pageBits || pageBits + 2 <= bits;
+        merged.pageBits = repage ? bits : pageBits;
+        size_t width = merged.pageNodes();
+        vector<uint64_t> &mergedOffsets = merged.ownedOffsets;
+        mergedOffsets.resize(merged.nodes + 1);
+        mergedOffsets[0] = 0;
+        merged.refs.reserve((merged.nodes + width - 1) >> merged.pageBits);
+        merged.pages.reserve(merged.refs.capacity());
+
+        size_t e = 0;
+        for (size_t first = 0; first < merged.nodes; first += width)
+        {
+            size_t index = first >> merged.pageBits;
+            size_t last = min(first + width, merged.nodes);
+            size_t begin = e;
+            while (e < edges.size() && edges[e].first < last)
+            {
+                e++;
+            }
+            if (!repage && begin == e && index < refs.size() && pageSize(index) == last - first)
+            {
+                uint64_t shift = mergedOffsets[first] - offsets[first];
+                for (size_t node = first; node < last; ++node)
+                {
+                    mergedOffsets[node + 1] = offsets[node + 1] + shift;
+                }
+                merged.refs.push_back(PageRef{refs[index].neighbors, refs[index].first + shift});
+                merged.pages.push_back(pages[index]);
+                continue;
+            }
+
+            shared_ptr<vector<uint32_t>> page = make_shared<vector<uint32_t>>();
+            vector<uint32_t> &mergedNeighbors = *page;
+            size_t existingEdges = 0;
+            for (size_t node = first; node < last; ++node)
+            {
+                existingEdges += row((uint32_t)node).size();
+            }
+            mergedNeighbors.reserve(existingEdges + e - begin);
+            for (size_t node = first; node < last; ++node)
+            {
+                IdSpan existing = row((uint32_t)node);
+                size_t added = begin;
+                while (added < e && edges[added].first == node)
+                {
+                    added++;
+                }
+
+                const uint32_t *i = existing.begin();
+                while (i != existing.end() || begin < added)
+                {
+                    if (begin == added || (i != existing.end() && *i < edges[begin].second))
+                    {
+                        mergedNeighbors.push_back(*i++);
+                    }
+                    else
+                    {
+                        mergedNeighbors.push_back(edges[begin++].second);
+                    }
+                }
+                mergedOffsets[node + 1] = mergedOffsets[first] + mergedNeighbors.size();
+            }
+            merged.refs.push_back(PageRef{mergedNeighbors.data(), mergedOffsets[first]});
+            merged.pages.push_back(move(page));
+        }
+        merged.offsets = mergedOffsets.data();
+        return merged;
+    }
+
+    // Pass the flat arrays view() reads to write(data, bytes), in pieces:
+    // nodeCount() + 1 row starts, then edgeCount() neighbor ids
+    template <typename Write>
+    bool writeOffsets(const Write &write) const
+    {
+        uint64_t none = 0;
+        return nodes == 0 ? write(&none, sizeof(none)) : write(offsets, (nodes + 1) * sizeof(uint64_t));
+    }
+
+    template <typename Write>
+    bool writeNeighbors(const Write &write) const
+    {
+        for (size_t index = 0; index < refs.size(); ++index)
+        {
+            size_t first = index << pageBits;
+            size_t count = offsets[first + pageSize(index)] - offsets[first];
+            if (count > 0 && !write(refs[index].neighbors, count * sizeof(uint32_t)))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+// Count of set bits in (a[i] & b[i]) over n words
+typedef size_t (*AndPopcountFn)(const uint64_t *a, const uint64_t *b, size_t n);
+
+size_t andPopcountScalar(const uint64_t *a, const uint64_t *b, size_t n)
+{
+    size_t count = 0;
+    for (size_t i = 0; i < n; ++i)
+    {
+        count += __builtin_popcountll(a[i] & b[i]);
+    }
+    return count;
+}
+
+#ifdef BOOKREC_X86_SIMD
+// AVX2 has no vector popcount: count nibbles through a shuffle lookup
+// table and sum the bytes of each lane with SAD
+__attribute__((target("avx2"))) size_t andPopcountAvx2(const uint64_t *a, const uint64_t *b, size_t n)
+{
+    const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                            0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i lowNibbles = _mm256_set1_epi8(0x0f);
+    __m256i total = _mm256_setzero_si256();
+
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        __m256i words = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(a + i)),
+                                         _mm256_loadu_si256((const __m256i *)(b + i)));
+        __m256i low = _mm256_shuffle_epi8(lookup, _mm256_and_si256(words, lowNibbles));
+        __m256i high = _mm256_shuffle_epi8(lookup, _mm256_and_si256(_mm256_srli_epi16(words, 4), lowNibbles));
+        total = _mm256_add_epi64(total, _mm256_sad_epu8(_mm256_add_epi8(low, high), _mm256_setzero_si256()));
+    }
+
+    size_t count = (size_t)_mm256_extract_epi64(total, 0) + (size_t)_mm256_extract_epi64(total, 1) +
+                   (size_t)_mm256_extract_epi64(total, 2) + (size_t)_mm256_extract_epi64(total, 3);
+    for (; i < n; ++i)
+    {
+        count += __builtin_popcountll(a[i] & b[i]);
+    }
+    return count;
+}
+
+__attribute__((target("avx512f,avx512vpopcntdq"))) size_t andPopcountAvx512(const uint64_t *a, const uint64_t *b, size_t n)
+{
+    __m512i total = _mm512_setzero_si512();
+
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m512i words = _mm512_and_si512(_mm512_loadu_si512(a + i), _mm512_loadu_si512(b + i));
+        total = _mm512_add_epi64(total, _mm512_popcnt_epi64(words));
+    }
+
+    uint64_t lanes[8];
+    _mm512_storeu_si512(lanes, total);
+    size_t count = 0;
+    for (uint64_t lane : lanes)
+    {
+        count += lane;
+    }
+    for (; i < n; ++i)
+    {
+        count += __builtin_popcountll(a[i] & b[i]);
+    }
+    return count;
+}
+#endif
+
+// Every AND + popcount kernel this CPU can run, by name, widest first
+vector<pair<const char *, AndPopcountFn>> andPopcountKernels()
+{
+    vector<pair<const char *, AndPopcountFn>> kernels;
+#ifdef BOOKREC_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512vpopcntdq"))
+    {
+        kernels.push_back({"avx512", andPopcountAvx512});
+    }
+    if (__builtin_cpu_supports("avx2"))
+    {
+        kernels.push_back({"avx2", andPopcountAvx2});
+    }
+#endif
+    kernels.push_back({"scalar", andPopcountScalar});
+    return kernels;
+}
+
+// Pick the widest AND + popcount kernel this CPU supports
+AndPopcountFn selectAndPopcount()
+{
+    return andPopcountKernels().front().second;
+}
+
+const AndPopcountFn andPopcount = selectAndPopcount();
+
+// Dot products of query (factors floats) with panels of 16 vectors each,
+// into scores (16 per panel). A panel stores its vectors transposed:
+// factor i of vector l at panel[i * 16 + l], so a kernel multiplies each
+// query float into 16 vectors at once and needs no horizontal sums. The
+// vector kernels round differently, so scores may differ from the scalar
+// kernel's in the last bits.
+typedef void (*DotPanelsFn)(const float *query, const float *panels, size_t count, size_t factors, float *scores);
+
+void dotPanelsScalar(const float *query, const float *panels, size_t count, size_t factors, float *scores)
+{
+    for (size_t p = 0; p < count; ++p)
+    {
+        const float *panel = panels + p * factors * 16;
+        float sums[16] = {};
+        for (size_t i = 0; i < factors; ++i)
+        {
+            for (size_t lane = 0; lane < 16; ++lane)
+            {
+                sums[lane] += query[i] * panel[i * 16 + lane];
+            }
+        }
+        memcpy(scores + p * 16, sums, sizeof(sums));
+    }
+}
+
+#ifdef BOOKREC_X86_SIMD
+__attribute__((target("avx2,fma"))) void dotPanelsAvx2(const float *query, const float *panels, size_t count,
+                                                       size_t factors, float *scores)
+{
+    for (size_t p = 0; p < count; ++p)
+    {
+        const float *panel = panels + p * factors * 16;
+        __m256 low = _mm256_setzero_ps();
+        __m256 high = _mm256_setzero_ps();
+        for (size_t i = 0; i < factors; ++i)
+        {
+            __m256 weight = _mm256_set1_ps(query[i]);
+            low = _mm256_fmadd_ps(weight, _mm256_load_ps(panel + i * 16), low);
+            high = _mm256_fmadd_ps(weight, _mm256_load_ps(panel + i * 16 + 8), high);
+        }
+        _mm256_storeu_ps(scores + p * 16, low);
+        _mm256_storeu_ps(scores + p * 16 + 8, high);
+    }
+}
+
+__attribute__((target("avx512f"))) void dotPanelsAvx512(const float *query, const float *panels, size_t count,
+                                                        size_t factors, float *scores)
+{
+    for (size_t p = 0; p < count; ++p)
+    {
+        const float *panel = panels + p * factors * 16;
+        __m512 sums = _mm512_setzero_ps();
+        for (size_t i = 0; i < factors; ++i)
+        {
+            sums = _mm512_fmadd_ps(_mm512_set1_ps(query[i]), _mm512_load_ps(panel + i * 16), sums);
+        }
+        _mm512_storeu_ps(scores + p * 16, sums);
+    }
+}
+#endif
+
+// Every dot product kernel this CPU can run, by name, widest first
+vector<pair<const char *, DotPanelsFn>> dotPanelsKernels()
+{
+    vector<pair<const char *, DotPanelsFn>> kernels;
+#ifdef BOOKREC_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+    {
+        kernels.push_back({"avx512", dotPanelsAvx512});
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+    {
+        kernels.push_back({"avx2", dotPanelsAvx2});
+    }
+#endif
+    kernels.push_back({"scalar", dotPanelsScalar});
+    return kernels;
+}
+
+// Pick the widest dot product kernel this CPU supports
+DotPanelsFn selectDotPanels()
+{
+    return dotPanelsKernels().front().second;
+}
+
+const DotPanelsFn dotPanels = selectDotPanels();
+
+// Pairwise intersection kernel. Heavy readers also get a packed bitset over
+// book ids; each pair then takes the cheapest of AND + popcount over two
+// bitsets, probing one bitset with the other user's list, or merging the
+// two sorted lists. Bitsets are kept in pages matching the user->books
+// adjacency's, and a page is rebuilt only when its adjacency page is. A
+// page's bitsets cover the books there were when it was built, which are
+// all the books its users have read.
+class JaccardKernel
+{
+private:
+    // Bitsets built here; a mapped snapshot's pages have none
+    struct Page
+    {
+        vector<uint32_t> slots;
+        vector<uint64_t> bits;
+    };
+
+    // Arrays read by queries: a built page's vectors, or a mapped snapshot
+    // file, whose slots index the file's bitset array
+    struct PageRef
+    {
+        const uint32_t *slots; // by user in the page, kInvalidId for users without a bitset
+        const uint64_t *bits;
+        size_t words; // per bitset
+    };
+
+    struct PageOrigin
+    {
+        shared_ptr<const Page> owner;
+        const void *source; // adjacency page the bitsets were built from
+        size_t dense;       // users with a bitset
+    };
+
+    const CsrAdjacency *userBooks = nullptr;
+    vector<PageRef> refs;
+    vector<PageOrigin> origins;
+    uint32_t pageBits = 0;
+    size_t userCount = 0;
+    size_t wordsPerSet = 0; // for the books at the last build
+
+    const PageRef &refOf(uint32_t user) const
+    {
+        return refs[user >> pageBits];
+    }
+
+    uint32_t slotOf(uint32_t user) const
+    {
+        return refOf(user).slots[user & ((1u << pageBits) - 1)];
+    }
+
+    const uint64_t *bitset(uint32_t user) const
+    {
+        const PageRef &page = refOf(user);
+        return page.bits + (size_t)slotOf(user) * page.words;
+    }
+
+    static size_t probe(const uint64_t *bits, size_t words, IdSpan books)
+    {
+        size_t common = 0;
+        for (uint32_t book : books)
+        {
+            common += (book >> 6) < words && ((bits[book >> 6] >> (book & 63)) & 1);
+        }
+        return common;
+    }
+
+public:
+    // Build bitsets over a user->books adjacency with book ids below books.
+    // A user is dense when its bitset is no larger than its id list, so
+    // memory stays within the CSR. Pages whose adjacency page source
+    // shares with the one previous was built over are shared with
+    // previous, which must still be alive.
+    void build(const CsrAdjacency &source, size_t books, const JaccardKernel *previous = nullptr)
+    {
+        userBooks = &source;
+        userCount = source.nodeCount();
+        pageBits = source.pageShift();
+        wordsPerSet = (books + 63) / 64;
+        refs.clear();
+        origins.clear();
+        refs.reserve(source.pageCount());
+        origins.reserve(source.pageCount());
+        for (size_t index = 0; index < source.pageCount(); ++index)
+        {
+            if (previous && index < previous->origins.size() && previous->origins[index].source == source.pageId(index))
+            {
+                refs.push_back(previous->refs[index]);
+                origins.push_back(previous->origins[index]);
+                continue;
+            }
+
+            shared_ptr<Page> page = make_shared<Page>();
+            size_t first = index << pageBits;
+            size_t last = first + source.pageSize(index);
+            size_t dense = 0;
+            page->slots.assign(last - first, kInvalidId);
+            for (size_t user = first; user < last; ++user)
+            {
+                IdSpan row = source.row((uint32_t)user);
+                if (row.size() * 32 >= books && !row.empty())
+                {
+                    page->slots[user - first] = (uint32_t)dense++;
+                    page->bits.resize(dense * wordsPerSet, 0);
+                    uint64_t *bits = page->bits.data() + (dense - 1) * wordsPerSet;
+                    for (uint32_t book : row)
+                    {
+                        bits[book >> 6] |= uint64_t(1) << (book & 63);
+                    }
+                }
+            }
+            refs.push_back(PageRef{page->slots.data(), page->bits.data(), wordsPerSet});
+            origins.push_back(PageOrigin{move(page), source.pageId(index), dense});
+        }
+    }
+
+    // Use bitsets stored elsewhere (a mapped snapshot) as laid out by
+    // writeSlots() and writeBitsets()
+    void view(const CsrAdjacency &source, size_t books, const uint32_t *slots, const uint64_t *sets)
+    {
+        userBooks = &source;
+        userCount = source.nodeCount();
+        pageBits = source.pageShift();
+        wordsPerSet = (books + 63) / 64;
+        refs.clear();
+        origins.clear();
+        for (size_t index = 0; index < source.pageCount(); ++index)
+        {
+            size_t first = index << pageBits;
+            size_t last = first + source.pageSize(index);
+            size_t dense = 0;
+            for (size_t user = first; user < last; ++user)
+            {
+                dense += slots[user] != kInvalidId;
+            }
+            refs.push_back(PageRef{slots + first, sets, wordsPerSet});
+            origins.push_back(PageOrigin{nullptr, source.pageId(index), dense});
+        }
+    }
+
+    size_t denseUsers() const
+    {
+        size_t dense = 0;
+        for (const PageOrigin &origin : origins)
+        {
+            dense += origin.dense;
+        }
+        return dense;
+    }
+
+    size_t words() const
+    {
+        return wordsPerSet;
+    }
+
+    // Pass the flat arrays view() reads to write(data, bytes), in pieces:
+    // a slot per user numbering the dense users in id order, then their
+    // bitsets of words() words each
+    template <typename Write>
+    bool writeSlots(const Write &write) const
+    {
+        uint32_t slots[size_t(1) << CsrAdjacency::kMaxPageBits];
+        uint32_t dense = 0;
+        for (size_t index = 0; index < refs.size(); ++index)
+        {
+            size_t count = userBooks->pageSize(index);
+            for (size_t i = 0; i < count; ++i)
+            {
+                slots[i] = refs[index].slots[i] == kInvalidId ? kInvalidId : dense++;
+            }
+            if (!write(slots, count * sizeof(uint32_t)))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    template <typename Write>
+    bool writeBitsets(const Write &write) const
+    {
+        vector<uint64_t> bits(wordsPerSet);
+        for (uint32_t user = 0; user < userCount; ++user)
+        {
+            if (!isDense(user))
+            {
+                continue;
+            }
+            size_t words = refOf(user).words;
+            copy(bitset(user), bitset(user) + words, bits.begin());
+            fill(bits.begin() + words, bits.end(), 0);
+            if (!write(bits.data(), bits.size() * sizeof(uint64_t)))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool isDense(uint32_t user) const
+    {
+        return user < userCount && slotOf(user) != kInvalidId;
+    }
+
+    // Ways of counting a pair's common books
+    enum PairPath
+    {
+        kBitsetAnd,   // AND + popcount over both bitsets
+        kBitsetProbe, // the other user's list looked up in one bitset
+        kListMerge,   // intersectionSize over both lists
+        kPairPathCount
+    };
+
+    // The cheapest path for a pair
+    PairPath pathFor(uint32_t a, uint32_t b) const
+    {
+        bool denseA = isDense(a);
+        bool denseB = isDense(b);
+        if (denseA && denseB &&
+            min(refOf(a).words, refOf(b).words) <= userBooks->row(a).size() + userBooks->row(b).size())
+        {
+            return kBitsetAnd;
+        }
+        return denseA || denseB ? kBitsetProbe : kListMerge;
+    }
+
+    // Common books of a pair by the given path and popcount kernel, so
+    // checks can force each one. kBitsetAnd needs both users dense,
+    // kBitsetProbe one of them.
+    size_t intersectionBy(PairPath path, uint32_t a, uint32_t b, AndPopcountFn popcount) const
+    {
+        IdSpan booksA = userBooks->row(a);
+        IdSpan booksB = userBooks->row(b);
+        switch (path)
+        {
+        case kBitsetAnd:
+            return popcount(bitset(a), bitset(b), min(refOf(a).words, refOf(b).words));
+        case kBitsetProbe:
+            if (isDense(a) && (!isDense(b) || booksB.size() <= booksA.size()))
+            {
+                return probe(bitset(a), refOf(a).words, booksB);
+            }
+            return probe(bitset(b), refOf(b).words, booksA);
+        default:
+            return intersectionSize(booksA, booksB);
+        }
+    }
+
+    size_t intersection(uint32_t a, uint32_t b) const
+    {
+        return intersectionBy(pathFor(a, b), a, b, andPopcount);
+    }
+
+    double jaccard(uint32_t a, uint32_t b) const
+    {
+        double commonBooks = intersection(a, b);
+        double totalBooks = userBooks->row(a).size() + userBooks->row(b).size() - commonBooks;
+        return commonBooks / totalBooks;
+    }
+};
+
+// Immutable, versioned view of the user/book graph. Queries hold a
+// shared_ptr to the snapshot they started on while writers publish
+// replacements (RCU-style); an old snapshot is freed when its last
+// in-flight query drops it. Both directions and the bitset kernel are
+// always built from the same set of reads.
+class GraphSnapshot
+{
+public:
+    CsrAdjacency userBooks;   // booksRead, by user id
+    CsrAdjacency bookReaders; // readers, by book id
+    JaccardKernel kernel;
+    size_t userCount = 0;
+    size_t bookCount = 0;
+    uint64_t version = 0;
+    shared_ptr<const void> backing; // keeps a mapped snapshot file alive
+
+private:
+    mutable once_flag weightsBuilt;
+    mutable vector<double> idf;        // by book id
+    mutable vector<double> userWeight; // summed idf of the user's books
+
+    void buildWeights() const
+    {
+        idf.resize(bookCount);
+        for (uint32_t book = 0; book < bookCount; ++book)
+        {
+            idf[book] = log(1.0 + (double)userCount / max<size_t>(1, readers(book).size()));
+        }
+        userWeight.resize(userCount);
+        for (uint32_t user = 0; user < userCount; ++user)
+        {
+            double weight = 0;
+            for (uint32_t book : booksRead(user))
+            {
+                weight += idf[book];
+            }
+            userWeight[user] = weight;
+        }
+    }
+
+public:
+    GraphSnapshot() = default;
+    GraphSnapshot(const GraphSnapshot &) = delete; // kernel points into userBooks
+    GraphSnapshot &operator=(const GraphSnapshot &) = delete;
+
+    IdSpan booksRead(uint32_t user) const
+    {
+        return userBooks.row(user);
+    }
+
+    IdSpan readers(uint32_t book) const
+    {
+        return bookReaders.row(book);
+    }
+
+    size_t users() const
+    {
+        return userCount;
+    }
+
+    size_t books() const
+    {
+        return bookCount;
+    }
+
+    size_t reads() const
+    {
+        return userBooks.edgeCount();
+    }
+
+    // Inverse document frequency of each book, log(1 + users / readers),
+    // and its sum over each user's books. Built on first use, once per
+    // snapshot, in O(reads).
+    const double *bookIdf() const
+    {
+        call_once(weightsBuilt, [this]
+                  { buildWeights(); });
+        return idf.data();
+    }
+
+    const double *userIdfWeight() const
+    {
+        bookIdf();
+        return userWeight.data();
+    }
+};
+
+// Id list that keeps its first kInline ids in place and moves to the heap
+// only when it outgrows them. Most users add a handful of reads between
+// two snapshots, so their lists never allocate.
+class SmallIdVector
+{
+private:
+    static constexpr uint32_t kInline = 4;
+    uint32_t count = 0;
+    uint32_t capacity = kInline;
+    union
+    {
+        uint32_t local[kInline];
+        uint32_t *heap;
+    };
+
+public:
+    SmallIdVector()
+    {
+    }
+
+    SmallIdVector(SmallIdVector &&other) noexcept : count(other.count), capacity(other.capacity)
+    {
+        memcpy(local, other.local, sizeof(local)); // the ids, or the heap pointer
+        other.count = 0;
+        other.capacity = kInline;
+    }
+
+    SmallIdVector(const SmallIdVector &) = delete;
+    SmallIdVector &operator=(const SmallIdVector &) = delete;
+    SmallIdVector &operator=(SmallIdVector &&) = delete;
+
+    ~SmallIdVector()
+    {
+        if (capacity > kInline)
+        {
+            delete[] heap;
+        }
+    }
+
+    const uint32_t *data() const
+    {
+        return capacity > kInline ? heap : local;
+    }
+
+    size_t size() const
+    {
+        return count;
+    }
+
+    size_t capacityBytes() const
+    {
+        return capacity > kInline ? capacity * sizeof(uint32_t) : 0;
+    }
+
+    IdSpan span() const
+    {
+        return IdSpan{data(), count};
+    }
+
+    void push_back(uint32_t id)
+    {
+        if (count == capacity)
+        {
+            uint32_t *grown = new uint32_t[capacity * 2];
+            memcpy(grown, data(), count * sizeof(uint32_t));
+            if (capacity > kInline)
+            {
+                delete[] heap;
+            }
+            heap = grown;
+            capacity *= 2;
+        }
+        (capacity > kInline ? heap : local)[count++] = id;
+    }
+
+    // Forget the ids but keep a heap buffer for the next ones
+    void clear()
+    {
+        count = 0;
+    }
+
+    // Forget the ids and give a heap buffer back
+    void reset()
+    {
+        if (capacity > kInline)
+        {
+            delete[] heap;
+        }
+        count = 0;
+        capacity = kInline;
+    }
+};
+
+// Writer side of the user/book bipartite graph over interned ids. New reads
+// go to a small delta buffer; publish() folds it into a new GraphSnapshot
+// in one pass and swaps it in atomically. Writer methods must be
+// serialized by the caller, snapshot() may be called from any thread.
+//
+// The delta buffer is a pool of per-user lists that is emptied, not freed,
+// by a publish, so steady-state ingest reuses the same memory.
+class BipartiteGraph
+{
+private:
+    shared_ptr<const GraphSnapshot> published;
+    vector<uint32_t> pendingSlot;       // by user id: list holding the user's unpublished reads, or kInvalidId
+    vector<uint32_t> pendingUsers;      // user of each list in use
+    vector<SmallIdVector> pendingLists; // unpublished reads in arrival order; [pendingUsers.size(), end) are spare
+    size_t pendingCount = 0;
+    size_t userCount = 0;
+    size_t bookCount = 0;
+    chrono::steady_clock::time_point oldestPending;
+    chrono::milliseconds maxStaleness{100};
+
+    // Reads buffered before a publish is forced
+    static constexpr size_t kMinPublishBatch = 4096;
+
+    // Spilled lists larger than this are freed by a publish, not kept
+    static constexpr size_t kMaxRetainedBytes = 4096;
+
+    IdSpan pendingList(uint32_t user) const
+    {
+        if (user >= pendingSlot.size() || pendingSlot[user] == kInvalidId)
+        {
+            return IdSpan{};
+        }
+        return pendingLists[pendingSlot[user]].span();
+    }
+
+    void clearPending()
+    {
+        for (uint32_t user : pendingUsers)
+        {
+            SmallIdVector &list = pendingLists[pendingSlot[user]];
+            if (list.capacityBytes() > kMaxRetainedBytes)
+            {
+                list.reset();
+            }
+            else
+            {
+                list.clear();
+            }
+            pendingSlot[user] = kInvalidId;
+        }
+        pendingUsers.clear();
+        pendingCount = 0;
+    }
+
+public:
+    BipartiteGraph() : published(make_shared<GraphSnapshot>())
+    {
+    }
+
+    // Latest published snapshot
+    shared_ptr<const GraphSnapshot> snapshot() const
+    {
+        return atomic_load(&published);
+    }
+
+    // Writer-side view of the latest snapshot, without the atomic load;
+    // only valid while the caller is the one that publishes
+    const GraphSnapshot &current() const
+    {
+        return *published;
+    }
+
+    // Call visit(user, book) for every buffered read
+    template <typename Visit>
+    void forEachPending(Visit visit) const
+    {
+        for (size_t slot = 0; slot < pendingUsers.size(); ++slot)
+        {
+            for (uint32_t book : pendingLists[slot].span())
+            {
+                visit(pendingUsers[slot], book);
+            }
+        }
+    }
+
+    // Buffered reads of a user, in arrival order
+    IdSpan pendingReads(uint32_t user) const
+    {
+        return pendingList(user);
+    }
+
+    // Drop the delta buffer and continue from the given snapshot
+    void reset(shared_ptr<const GraphSnapshot> snapshot)
+    {
+        userCount = snapshot->users();
+        bookCount = snapshot->books();
+        clearPending();
+        atomic_store(&published, move(snapshot));
+    }
+
+    void resize(size_t users, size_t books)
+    {
+        userCount = max(userCount, users);
+        bookCount = max(bookCount, books);
+    }
+
+    // How long a buffered read may wait before an addRead publishes it
+    void setMaxStaleness(chrono::milliseconds staleness)
+    {
+        maxStaleness = staleness;
+    }
+
+    bool hasRead(uint32_t user, uint32_t book) const
+    {
+        if (published->booksRead(user).contains(book))
+        {
+            return true;
+        }
+        IdSpan pending = pendingList(user);
+        return find(pending.begin(), pending.end(), book) != pending.end();
+    }
+
+    // Buffer a new read; returns false if it was already recorded
+    bool addRead(uint32_t user, uint32_t book)
+    {
+        if (hasRead(user, book))
+        {
+            return false;
+        }
+
+        if (pendingCount == 0)
+        {
+            oldestPending = chrono::steady_clock::now();
+        }
+        if (user >= pendingSlot.size())
+        {
+            pendingSlot.resize(max<size_t>(user + 1, userCount), kInvalidId);
+        }
+        if (pendingSlot[user] == kInvalidId)
+        {
+            pendingSlot[user] = (uint32_t)pendingUsers.size();
+            pendingUsers.push_back(user);
+            if (pendingLists.size() < pendingUsers.size())
+            {
+                pendingLists.emplace_back();
+            }
+        }
+        pendingLists[pendingSlot[user]].push_back(book);
+        pendingCount++;
+        return true;
+    }
+
+    // Whether the buffer is large enough, or its oldest read has waited
+    // long enough, that the next snapshot should be published now
+    bool publishDue() const
+    {
+        return pendingCount > 0 && (pendingCount >= max(kMinPublishBatch, published->reads() / 8) ||
+                                    chrono::steady_clock::now() - oldestPending >= maxStaleness);
+    }
+
+    size_t pending() const
+    {
+        return pendingCount;
+    }
+
+    // Users known, published or not
+    size_t users() const
+    {
+        return userCount;
+    }
+
+    // Sort (node, neighbor) edges and drop duplicates. Large batches use a
+    // counting sort on the node id so building CSR stays linear.
+    static void sortEdges(vector<pair<uint32_t, uint32_t>> &edges, size_t nodeCount)
+    {
+        if (edges.size() * 4 < nodeCount)
+        {
+            sort(edges.begin(), edges.end());
+        }
+        else
+        {
+            vector<size_t> starts(nodeCount + 1, 0);
+            for (const auto &edge : edges)
+            {
+                starts[edge.first + 1]++;
+            }
+            for (size_t node = 0; node < nodeCount; ++node)
+            {
+                starts[node + 1] += starts[node];
+            }
+
+            vector<pair<uint32_t, uint32_t>> sorted(edges.size());
+            vector<size_t> next(starts.begin(), starts.end() - 1);
+            for (const auto &edge : edges)
+            {
+                sorted[next[edge.first]++] = edge;
+            }
+            for (size_t node = 0; node < nodeCount; ++node)
+            {
+                sort(sorted.begin() + starts[node], sorted.begin() + starts[node + 1]);
+            }
+            edges.swap(sorted);
+        }
+        edges.erase(unique(edges.begin(), edges.end()), edges.end());
+    }
+
+private:
+    // Swap in a snapshot of the published reads plus edges, which must be
+    // sorted, unique and not yet published
+    void publishEdges(vector<pair<uint32_t, uint32_t>> &edges)
+    {
+        shared_ptr<GraphSnapshot> next = make_shared<GraphSnapshot>();
+        next->userBooks = published->userBooks.mergedWith(edges, userCount);
+
+        for (auto &edge : edges)
+        {
+            swap(edge.first, edge.second);
+        }
+        sortEdges(edges, bookCount);
+        next->bookReaders = published->bookReaders.mergedWith(edges, bookCount);
+        for (auto &edge : edges)
+        {
+            swap(edge.first, edge.second);
+        }
+
+        next->userCount = userCount;
+        next->bookCount = bookCount;
+        next->version = published->version + 1;
+        next->kernel.build(next->userBooks, bookCount, &published->kernel);
+
+        atomic_store(&published, shared_ptr<const GraphSnapshot>(move(next)));
+        clearPending();
+    }
+
+    void appendPending(vector<pair<uint32_t, uint32_t>> &edges) const
+    {
+        forEachPending([&edges](uint32_t user, uint32_t book)
+                       { edges.push_back({user, book}); });
+    }
+
+public:
+    // Build a snapshot of the published reads plus the delta buffer and swap
+    // it in. Returns false when there was nothing new to publish.
+    bool publish()
+    {
+        if (pendingCount == 0 && published->users() == userCount && published->books() == bookCount)
+        {
+            return false;
+        }
+
+        vector<pair<uint32_t, uint32_t>> edges;
+        edges.reserve(pendingCount);
+        appendPending(edges);
+        sortEdges(edges, userCount);
+        publishEdges(edges);
+        return true;
+    }
+
+    // Bulk path: publish a large batch of (user, book) reads, in any order
+    // and possibly repeated, together with the delta buffer in one pass.
+    // On return edges holds every read that was added, ordered by book;
+    // returns how many of them came from the batch.
+    size_t publishReads(vector<pair<uint32_t, uint32_t>> &edges)
+    {
+        size_t alreadyPending = pendingCount;
+        appendPending(edges);
+        sortEdges(edges, userCount);
+        edges.erase(remove_if(edges.begin(), edges.end(), [this](const pair<uint32_t, uint32_t> &edge)
+                              { return published->booksRead(edge.first).contains(edge.second); }),
+                    edges.end());
+        publishEdges(edges);
+        return edges.size() - alreadyPending;
+    }
+};
+
+// Bounded top-k selection over (score, id) pairs in O(n log k). Higher
+// scores rank first and equal scores fall back to the lower id, so results
+// do not depend on hash or insertion order.
+template <typename Score>
+class TopKSelector
+{
+public:
+    typedef pair<Score, uint32_t> Entry;
+
+private:
+    size_t capacity = 0;
+    vector<Entry> heap; // worst kept entry at heap.front()
+
+    static bool ranksBefore(const Entry &a, const Entry &b)
+    {
+        return a.first > b.first || (a.first == b.first && a.second < b.second);
+    }
+
+public:
+    // Start a new selection keeping at most k entries
+    void reset(size_t k)
+    {
+        capacity = k;
+        heap.clear();
+    }
+
+    void push(Score score, uint32_t id)
+    {
+        Entry entry{score, id};
+        if (heap.size() < capacity)
+        {
+            heap.push_back(entry);
+            push_heap(heap.begin(), heap.end(), ranksBefore);
+        }
+        else if (capacity > 0 && ranksBefore(entry, heap.front()))
+        {
+            pop_heap(heap.begin(), heap.end(), ranksBefore);
+            heap.back() = entry;
+            push_heap(heap.begin(), heap.end(), ranksBefore);
+        }
+    }
+
+    // Kept entries, best first; the selector must be reset before reuse
+    const vector<Entry> &sorted()
+    {
+        sort_heap(heap.begin(), heap.end(), ranksBefore);
+        return heap;
+    }
+};
+
+// Per-query buffers, reused across queries so a query touches only the
+// target's 2-hop neighborhood. Each batch worker owns one.
+struct QueryScratch
+{
+    vector<uint32_t> overlap;    // shared books, or walk segments spent, by user id; zero between queries
+    vector<double> weightedOverlap; // summed idf of the shared books, by user id; zero between queries
+    vector<uint32_t> touched;    // users with a non-zero overlap
+    vector<uint32_t> candidates; // LSH candidates for the approximate engine
+    vector<uint32_t> seen;       // candidate dedup marks, by user id
+    uint32_t seenMark = 0;
+    vector<uint32_t> bookVotes;  // similar users who read each book; zero between queries
+    vector<uint32_t> votedBooks; // books with a non-zero vote
+    vector<double> bookScores;   // item-based scores; zero between queries
+    vector<float> bookDots;      // embedding scores, by book id
+    vector<float> foldedUser;    // embedding of a user newer than the model
+    vector<uint32_t> results;    // recommended book ids, best first
+    TopKSelector<double> nearestUsers;
+    vector<TopKSelector<double>::Entry> cachedNeighbors; // copy of a cache hit
+    TopKSelector<uint32_t> topBooks;
+    TopKSelector<double> scoredBooks;
+
+    // Bytes reserved by the growable buffers, to spot queries that allocate
+    size_t capacity() const
+    {
+        return (overlap.capacity() + touched.capacity() + candidates.capacity() + seen.capacity() +
+                bookVotes.capacity() + votedBooks.capacity() + results.capacity()) * sizeof(uint32_t) +
+               (bookScores.capacity() + weightedOverlap.capacity()) * sizeof(double) +
+               (bookDots.capacity() + foldedUser.capacity()) * sizeof(float) +
+               cachedNeighbors.capacity() * sizeof(TopKSelector<double>::Entry);
+    }
+};
+
+// Engines that can answer kNNRecommendBooks
+enum class RecommendEngine
+{
+    ExactKnn,  // exact Jaccard over every user sharing a book with the target
+    MinHashKnn, // LSH candidates re-ranked by exact Jaccard
+    ItemBased,  // sums of precomputed book neighbor lists; ignores k
+    RandomWalk, // personalized PageRank by Monte Carlo walks; ignores k
+    Embedding   // dot products of ALS user and book vectors; ignores k
+};
+
+// User similarity the kNN engines rank neighbors by
+enum class SimilarityMetric
+{
+    Jaccard,   // shared books / books in either set
+    Cosine,    // shared books / sqrt(product of set sizes)
+    Overlap,   // shared books / size of the smaller set
+    IdfJaccard // Jaccard with each book weighted by its idf, so blockbusters count less
+};
+
+// Similarity policies. Each scores a pair from the (possibly weighted) size
+// of the intersection and of the two sets; kWeighted selects idf weights
+// over plain counts. score() is 0 rather than NaN when a set is empty,
+// and branch-free so the scoring loop compiles to straight-line code.
+struct JaccardSimilarity
+{
+    static constexpr bool kWeighted = false;
+
+    static double score(double common, double a, double b)
+    {
+        double either = a + b - common;
+        return common / (either + (either == 0));
+    }
+};
+
+struct CosineSimilarity
+{
+    static constexpr bool kWeighted = false;
+
+    static double score(double common, double a, double b)
+    {
+        double norm = sqrt(a * b);
+        return common / (norm + (norm == 0));
+    }
+};
+
+struct OverlapSimilarity
+{
+    static constexpr bool kWeighted = false;
+
+    static double score(double common, double a, double b)
+    {
+        double smaller = min(a, b);
+        return common / (smaller + (smaller == 0));
+    }
+};
+
+struct IdfJaccardSimilarity
+{
+    static constexpr bool kWeighted = true;
+
+    static double score(double common, double a, double b)
+    {
+        return JaccardSimilarity::score(common, a, b);
+    }
+};
+
+// Approximate kNN settings: numHashes MinHash functions split into numBands
+// LSH bands of numHashes / numBands rows. More bands find more candidates
+// (higher recall, slower); more rows per band make buckets more selective.
+struct MinHashOptions
+{
+    size_t numHashes = 64;
+    size_t numBands = 16;
+};
+
+// Recall of the approximate neighbors against exact kNN on a user sample
+struct RecallReport
+{
+    size_t usersSampled = 0;
+    double recall = 0;            // fraction of exact top-k neighbors also found
+    double exactMicros = 0;       // mean neighbor search time, exact
+    double approximateMicros = 0; // mean neighbor search time, MinHash
+};
+
+// MinHash signatures of users' reading sets, banded into LSH buckets.
+// Signatures are updated in place on every read; bucket membership of
+// users whose signature changed is fixed up lazily before the next query.
+class MinHashIndex
+{
+private:
+    size_t numHashes = 0;
+    size_t numBands = 0;
+    size_t rowsPerBand = 0;
+    vector<uint64_t> seeds;
+    vector<uint32_t> signatures; // numHashes per user, UINT32_MAX while empty
+    vector<uint64_t> bandKeys;   // numBands per user, bucket the user is filed under
+    vector<uint32_t> bandSlots;  // numBands per user, the user's index in that bucket
+    vector<uint8_t> dirty;       // by user id
+    vector<uint32_t> dirtyUsers;
+    vector<unordered_map<uint64_t, vector<uint32_t>>> buckets; // per band
+
+    static uint64_t mix(uint64_t x)
+    {
+        x ^= x >> 30;
+        x *= 0xbf58476d1ce4e5b9ULL;
+        x ^= x >> 27;
+        x *= 0x94d049bb133111ebULL;
+        x ^= x >> 31;
+        return x;
+    }
+
+    uint32_t *signature(uint32_t user)
+    {
+        return signatures.data() + (size_t)user * numHashes;
+    }
+
+    uint64_t bandKey(uint32_t user, size_t band)
+    {
+        const uint32_t *rows = signature(user) + band * rowsPerBand;
+        uint64_t key = band;
+        for (size_t r = 0; r < rowsPerBand; ++r)
+        {
+            key = mix(key ^ rows[r]);
+        }
+        return key;
+    }
+
+public:
+    bool enabled() const
+    {
+        return numHashes > 0;
+    }
+
+    // Move users whose signature changed to their new buckets. A user
+    // leaves its old bucket by swapping the bucket's last member into its
+    // slot, so popular buckets cost no more to leave than small ones.
+    void refreshBuckets()
+    {
+        for (uint32_t user : dirtyUsers)
+        {
+            for (size_t band = 0; band < numBands; ++band)
+            {
+                size_t index = (size_t)user * numBands + band;
+                uint64_t key = bandKey(user, band) | 1; // zero marks "not filed"
+                uint64_t &filed = bandKeys[index];
+                if (filed == key)
+                {
+                    continue;
+                }
+                if (filed != 0)
+                {
+                    auto bucket = buckets[band].find(filed);
+                    vector<uint32_t> &members = bucket->second;
+                    uint32_t moved = members.back();
+                    members[bandSlots[index]] = moved;
+                    bandSlots[(size_t)moved * numBands + band] = bandSlots[index];
+                    members.pop_back();
+                    if (members.empty())
+                    {
+                        buckets[band].erase(bucket);
+                    }
+                }
+
+                filed = key;
+                vector<uint32_t> &members = buckets[band][filed];
+                bandSlots[index] = (uint32_t)members.size();
+                members.push_back(user);
+            }
+            dirty[user] = 0;
+        }
+        dirtyUsers.clear();
+    }
+
+    // Reset with new parameters; numBands is clamped to [1, numHashes] and
+    // numHashes rounded down to a multiple of it
+    void configure(const MinHashOptions &options)
+    {
+        numBands = max<size_t>(1, min(options.numBands, max<size_t>(1, options.numHashes)));
+        rowsPerBand = max<size_t>(1, options.numHashes / numBands);
+        numHashes = rowsPerBand * numBands;
+
+        seeds.resize(numHashes);
+        for (size_t i = 0; i < numHashes; ++i)
+        {
+            seeds[i] = mix(0x9e3779b97f4a7c15ULL * (i + 1));
+        }
+
+        signatures.clear();
+        bandKeys.clear();
+        bandSlots.clear();
+        dirty.clear();
+        dirtyUsers.clear();
+        buckets.assign(numBands, {});
+    }
+
+    void resize(size_t users)
+    {
+        if (users > dirty.size())
+        {
+            signatures.resize(users * numHashes, UINT32_MAX);
+            bandKeys.resize(users * numBands, 0);
+            bandSlots.resize(users * numBands, 0);
+            dirty.resize(users, 0);
+        }
+    }
+
+    // Fold one new read into the user's signature
+    void addRead(uint32_t user, uint32_t book)
+    {
+        resize(user + 1);
+        uint32_t *sig = signature(user);
+        bool changed = false;
+        for (size_t i = 0; i < numHashes; ++i)
+        {
+            uint32_t h = (uint32_t)(mix(book ^ seeds[i]) >> 32);
+            if (h < sig[i])
+            {
+                sig[i] = h;
+                changed = true;
+            }
+        }
+        if (changed && !dirty[user])
+        {
+            dirty[user] = 1;
+            dirtyUsers.push_back(user);
+        }
+    }
+
+    // Users sharing at least one LSH bucket with the target, into
+    // scratch.candidates. Buckets must have been refreshed.
+    void candidates(uint32_t target, QueryScratch &scratch) const
+    {
+        vector<uint32_t> &out = scratch.candidates;
+        out.clear();
+        if (target >= dirty.size() || bandKeys[(size_t)target * numBands] == 0)
+        {
+            return; // target has read nothing yet
+        }
+
+        scratch.seen.resize(dirty.size(), 0);
+        if (++scratch.seenMark == 0)
+        {
+            fill(scratch.seen.begin(), scratch.seen.end(), 0);
+            scratch.seenMark = 1;
+        }
+        scratch.seen[target] = scratch.seenMark;
+        for (size_t band = 0; band < numBands; ++band)
+        {
+            auto it = buckets[band].find(bandKeys[(size_t)target * numBands + band]);
+            if (it == buckets[band].end())
+            {
+                continue;
+            }
+            for (uint32_t user : it->second)
+            {
+                if (scratch.seen[user] != scratch.seenMark)
+                {
+                    scratch.seen[user] = scratch.seenMark;
+                    out.push_back(user);
+                }
+            }
+        }
+    }
+};
+
+// Item-item co-occurrence settings. Each book keeps exact counts for at
+// most 2 * maxNeighbors co-read books; past that it is cut back to its
+// maxNeighbors highest counts, so memory stays bounded however popular a
+// title gets. Reads by users who already have maxBooksPerUser books only
+// count towards popularity: their pairs are quadratic in the user's
+// history and say little about any single title.
+struct CooccurrenceOptions
+{
+    size_t maxNeighbors = 100;
+    size_t maxBooksPerUser = 500;
+};
+
+// One entry of a book's precomputed neighbor list
+struct BookNeighbor
+{
+    uint32_t book;
+    float score; // cosine: co-readers / sqrt(readers(a) * readers(b))
+};
+
+// Sparse book x book co-occurrence counts, updated on every read against
+// the books the reader already had. Neighbor lists are rebuilt lazily for
+// books whose counts changed, when the graph publishes.
+class CooccurrenceIndex
+{
+private:
+    // Co-readers of a book pair
+    struct CoRead
+    {
+        uint32_t book;
+        uint32_t count;
+    };
+
+    size_t maxNeighbors = 0;
+    size_t maxBooksPerUser = 0;
+    vector<uint32_t> readerCounts;              // by book id
+    vector<vector<CoRead>> counts;              // sorted by book, by book id
+    vector<vector<BookNeighbor>> neighborLists; // best first, by book id
+    vector<uint8_t> dirty;                      // by book id
+    vector<uint32_t> dirtyBooks;
+    vector<uint32_t> pruneScratch;
+
+    void resize(size_t books)
+    {
+        if (books > readerCounts.size())
+        {
+            readerCounts.resize(books, 0);
+            counts.resize(books);
+            neighborLists.resize(books);
+            dirty.resize(books, 0);
+        }
+    }
+
+    void markDirty(uint32_t book)
+    {
+        if (!dirty[book])
+        {
+            dirty[book] = 1;
+            dirtyBooks.push_back(book);
+        }
+    }
+
+    // Drop a book's counts down to its maxNeighbors highest; among equal
+    // counts the lower book ids stay
+    void prune(uint32_t book)
+    {
+        vector<CoRead> &row = counts[book];
+        pruneScratch.clear();
+        for (const CoRead &entry : row)
+        {
+            pruneScratch.push_back(entry.count);
+        }
+        nth_element(pruneScratch.begin(), pruneScratch.begin() + (maxNeighbors - 1), pruneScratch.end(),
+                    greater<uint32_t>());
+        uint32_t cutoff = pruneScratch[maxNeighbors - 1];
+        size_t tiesKept = maxNeighbors - count_if(pruneScratch.begin(), pruneScratch.end(), [cutoff](uint32_t v)
+                                                  { return v > cutoff; });
+        row.erase(remove_if(row.begin(), row.end(), [cutoff, &tiesKept](const CoRead &entry)
+                            {
+                                if (entry.count == cutoff && tiesKept > 0)
+                                {
+                                    tiesKept--;
+                                    return false;
+                                }
+                                return entry.count <= cutoff;
+                            }),
+                  row.end());
+    }
+
+    // Rows are short sorted arrays: a binary search and, for a new pair, a
+    // small memmove beat a hash table and keep refreshes sequential
+    void bump(uint32_t book, uint32_t other)
+    {
+        vector<CoRead> &row = counts[book];
+        auto it = lower_bound(row.begin(), row.end(), other, [](const CoRead &entry, uint32_t id)
+                              { return entry.book < id; });
+        if (it != row.end() && it->book == other)
+        {
+            it->count++;
+        }
+        else
+        {
+            row.insert(it, CoRead{other, 1});
+            if (row.size() > 2 * maxNeighbors)
+            {
+                prune(book);
+            }
+        }
+        markDirty(book);
+    }
+
+    void pairWith(uint32_t book, IdSpan others)
+    {
+        for (uint32_t other : others)
+        {
+            bump(book, other);
+            bump(other, book);
+        }
+    }
+
+public:
+    bool enabled() const
+    {
+        return maxNeighbors > 0;
+    }
+
+    // Reset with new settings; maxNeighbors is at least 1
+    void configure(const CooccurrenceOptions &options)
+    {
+        maxNeighbors = max<size_t>(1, options.maxNeighbors);
+        maxBooksPerUser = options.maxBooksPerUser;
+        readerCounts.clear();
+        counts.clear();
+        neighborLists.clear();
+        dirty.clear();
+        dirtyBooks.clear();
+    }
+
+    // Count a new read of book by a user who had already read the books in
+    // earlier and alsoEarlier. Those reads must have been counted before.
+    void addRead(uint32_t book, IdSpan earlier, IdSpan alsoEarlier = IdSpan{})
+    {
+        resize(book + 1);
+        readerCounts[book]++;
+        markDirty(book);
+        if (earlier.size() + alsoEarlier.size() < maxBooksPerUser)
+        {
+            pairWith(book, earlier);
+            pairWith(book, alsoEarlier);
+        }
+    }
+
+    // Rebuild the neighbor lists of books whose counts changed. Scores use
+    // the reader counts of the moment, so lists of untouched books drift
+    // slightly as their neighbors gain readers; ranking drift is small.
+    void refreshNeighbors()
+    {
+        vector<BookNeighbor> scored;
+        auto ranksBefore = [](const BookNeighbor &a, const BookNeighbor &b)
+        {
+            return a.score > b.score || (a.score == b.score && a.book < b.book);
+        };
+        for (uint32_t book : dirtyBooks)
+        {
+            scored.clear();
+            double readers = readerCounts[book];
+            for (const CoRead &entry : counts[book])
+            {
+                scored.push_back({entry.book, (float)(entry.count / sqrt(readers * readerCounts[entry.book]))});
+            }
+            size_t kept = min(maxNeighbors, scored.size());
+            partial_sort(scored.begin(), scored.begin() + kept, scored.end(), ranksBefore);
+            neighborLists[book].assign(scored.begin(), scored.begin() + kept);
+            dirty[book] = 0;
+        }
+        dirtyBooks.clear();
+    }
+
+    // Neighbors of a book, best first, as of the last refresh
+    const vector<BookNeighbor> &neighbors(uint32_t book) const
+    {
+        static const vector<BookNeighbor> none;
+        return book < neighborLists.size() ? neighborLists[book] : none;
+    }
+};
+
+// Personalized PageRank settings. A query runs walksPerQuery random walks
+// from the target, stepping user -> book -> user and returning to the
+// target after each step with probability restart; unread books are
+// ranked by how often the walks visit them.
+struct RandomWalkOptions
+{
+    size_t walksPerQuery = 1000;
+    double restart = 0.3;
+    size_t maxSteps = 32;       // per walk, whatever restart says
+    size_t segmentsPerUser = 4; // precomputed walk pieces stored per user
+    size_t segmentLength = 4;   // steps per piece
+    uint64_t seed = 42;
+};
+
+// Precomputed random walk segments for Monte Carlo personalized PageRank.
+// Each user owns segmentsPerUser segments of segmentLength (book, next
+// user) steps drawn on the published graph. A query stitches its walks
+// together from them, so a step is one sequential read instead of two
+// random lookups into the adjacency, and a query touches at most
+// walksPerQuery * maxSteps steps. A query spends each segment at most
+// once and steps through the adjacency past that, so the walks stay
+// independent samples and more walks mean less variance. Users whose
+// reads change get new segments when the change is published.
+class RandomWalkIndex
+{
+private:
+    RandomWalkOptions options;
+    vector<uint32_t> steps; // per user, per segment: book, next user, ...; kInvalidId after a dead end
+    size_t userCount = 0;
+    bool on = false;
+
+    size_t stride() const
+    {
+        return options.segmentsPerUser * options.segmentLength * 2;
+    }
+
+public:
+    // splitmix64: the walks' random source, cheap enough to draw per step
+    static uint64_t next(uint64_t &state)
+    {
+        uint64_t x = (state += 0x9e3779b97f4a7c15ULL);
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+        return x ^ (x >> 31);
+    }
+
+    bool enabled() const
+    {
+        return on;
+    }
+
+    const RandomWalkOptions &settings() const
+    {
+        return options;
+    }
+
+    void configure(const RandomWalkOptions &settings)
+    {
+        options = settings;
+        options.segmentsPerUser = max<size_t>(1, options.segmentsPerUser);
+        options.segmentLength = max<size_t>(1, options.segmentLength);
+        options.restart = min(max(options.restart, 0.0), 1.0);
+        steps.clear();
+        userCount = 0;
+        on = true;
+    }
+
+    void resize(size_t users)
+    {
+        if (users > userCount)
+        {
+            steps.resize(users * stride(), kInvalidId);
+            userCount = users;
+        }
+    }
+
+    // Draw the user's segments on the snapshot. Different users may be
+    // drawn concurrently once resize() has made room.
+    void draw(const GraphSnapshot &snapshot, uint32_t user)
+    {
+        uint32_t *segment = steps.data() + user * stride();
+        for (size_t s = 0; s < options.segmentsPerUser; ++s)
+        {
+            uint64_t state = options.seed ^ (((uint64_t)user * options.segmentsPerUser + s) * 0xff51afd7ed558ccdULL);
+            uint32_t at = user;
+            for (size_t i = 0; i < options.segmentLength; ++i, segment += 2)
+            {
+                IdSpan books = snapshot.booksRead(at);
+                if (at == kInvalidId || books.empty())
+                {
+                    segment[0] = segment[1] = at = kInvalidId;
+                    continue;
+                }
+                uint32_t book = books[next(state) % books.size()];
+                IdSpan readers = snapshot.readers(book);
+                at = readers[next(state) % readers.size()];
+                segment[0] = book;
+                segment[1] = at;
+            }
+        }
+    }
+
+    // A segment of the user as (book, next user) pairs, or nullptr for
+    // users added since the last draw
+    const uint32_t *segment(uint32_t user, size_t index) const
+    {
+        if (user >= userCount)
+        {
+            return nullptr;
+        }
+        return steps.data() + user * stride() + index * options.segmentLength * 2;
+    }
+};
+
+// Neighbor cache counters, cumulative since the cache was configured
+struct NeighborCacheStats
+{
+    uint64_t hits = 0;
+    uint64_t misses = 0;    // includes stale entries
+    uint64_t stale = 0;     // entries found but invalidated by newer reads
+    uint64_t evictions = 0;
+    size_t entries = 0;
+    size_t bytes = 0;       // approximate
+};
+
+// Top-k neighbor lists of recently queried users, for exact kNN. Each
+// entry records the snapshot version it was computed on. Before a publish,
+// every user with new reads and every book such a user has read is stamped
+// with the coming version, so an entry stays exact while its user and all
+// of its books are unstamped since: exactly the users an addRead(u, b) can
+// affect, u and everyone sharing a book with u. Checking costs one stamp
+// per book of the user instead of a similarity pass. Entries are spread
+// over shards that each evict with CLOCK past their share of the budget.
+class NeighborCache
+{
+public:
+    typedef TopKSelector<double>::Entry Neighbor;
+
+private:
+    struct Slot
+    {
+        uint32_t user = kInvalidId; // kInvalidId while free
+        uint64_t version = 0;
+        size_t k = 0;
+        bool referenced = false;
+        vector<Neighbor> neighbors;
+    };
+
+    struct Shard
+    {
+        mutex lock;
+        vector<Slot> slots;
+        vector<size_t> freeSlots;
+        unordered_map<uint32_t, size_t> index; // slot of each cached user
+        size_t hand = 0;                       // CLOCK position
+        size_t bytes = 0;
+    };
+
+    static constexpr size_t kShards = 16;
+
+    // Configuration, the shards' existence and the stamps are guarded by
+    // stampLock: queries share it, stamping and reconfiguring take it alone
+    mutable shared_mutex stampLock;
+    size_t budget = 0;
+    unique_ptr<Shard[]> shards;
+    vector<uint64_t> userStamps; // version of the user's last change
+    vector<uint64_t> bookStamps; // version of the last change by any reader
+    uint64_t minVersion = 0;     // entries from older snapshots are unusable
+
+    mutable atomic<uint64_t> hits{0};
+    mutable atomic<uint64_t> misses{0};
+    mutable atomic<uint64_t> stale{0};
+    atomic<uint64_t> evictions{0};
+
+    static size_t footprint(const Slot &slot)
+    {
+        return sizeof(Slot) + slot.neighbors.capacity() * sizeof(Neighbor) + 32; // 32: index node
+    }
+
+    Shard &shardFor(uint32_t user) const
+    {
+        return shards[user % kShards];
+    }
+
+    // Whether an entry is still exact on the snapshot; caller holds stampLock
+    bool fresh(const Slot &slot, const GraphSnapshot &snapshot) const
+    {
+        if (slot.version < minVersion || slot.version > snapshot.version ||
+            (slot.user < userStamps.size() && userStamps[slot.user] > slot.version))
+        {
+            return false;
+        }
+        for (uint32_t book : snapshot.booksRead(slot.user))
+        {
+            if (book < bookStamps.size() && bookStamps[book] > slot.version)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void release(Shard &shard, size_t index)
+    {
+        Slot &slot = shard.slots[index];
+        shard.bytes -= footprint(slot);
+        shard.index.erase(slot.user);
+        slot.user = kInvalidId;
+        vector<Neighbor>().swap(slot.neighbors);
+        shard.freeSlots.push_back(index);
+    }
+
+    // Evict with CLOCK until the shard fits its budget, sparing one slot
+    void evict(Shard &shard, size_t keep)
+    {
+        size_t shardBudget = budget / kShards;
+        size_t steps = 2 * shard.slots.size();
+        while (shard.bytes > shardBudget && steps-- > 0)
+        {
+            size_t index = shard.hand;
+            shard.hand = (shard.hand + 1) % shard.slots.size();
+            Slot &slot = shard.slots[index];
+            if (index == keep || slot.user == kInvalidId)
+            {
+                continue;
+            }
+            if (slot.referenced)
+            {
+                slot.referenced = false;
+                continue;
+            }
+            release(shard, index);
+            evictions.fetch_add(1, memory_order_relaxed);
+        }
+    }
+
+public:
+    bool enabled() const
+    {
+        shared_lock<shared_mutex> guard(stampLock);
+        return shards != nullptr;
+    }
+
+    // Drop every entry and set a new budget; 0 turns the cache off.
+    // Snapshots older than firstVersion can no longer fill the cache.
+    void configure(size_t budgetBytes, uint64_t firstVersion)
+    {
+        unique_lock<shared_mutex> guard(stampLock);
+        budget = budgetBytes;
+        shards.reset(budgetBytes > 0 ? new Shard[kShards] : nullptr);
+        userStamps.clear();
+        bookStamps.clear();
+        minVersion = firstVersion;
+        hits = 0;
+        misses = 0;
+        stale = 0;
+        evictions = 0;
+    }
+
+    size_t budgetBytes() const
+    {
+        shared_lock<shared_mutex> guard(stampLock);
+        return budget;
+    }
+
+    // Stamp the reads forEachRead lists, which become visible in the
+    // snapshot after current. Must run before that snapshot is published.
+    template <typename ForEachRead>
+    void stamp(const GraphSnapshot &current, ForEachRead forEachRead)
+    {
+        unique_lock<shared_mutex> guard(stampLock);
+        if (!shards)
+        {
+            return;
+        }
+        uint64_t version = current.version + 1;
+        userStamps.resize(max(userStamps.size(), current.users()), 0);
+        bookStamps.resize(max(bookStamps.size(), current.books()), 0);
+        forEachRead([this, &current, version](uint32_t user, uint32_t book)
+                    {
+                        if (user >= userStamps.size())
+                        {
+                            userStamps.resize(user + 1, 0);
+                        }
+                        if (book >= bookStamps.size())
+                        {
+                            bookStamps.resize(book + 1, 0);
+                        }
+                        bookStamps[book] = version;
+                        if (userStamps[user] != version)
+                        {
+                            userStamps[user] = version;
+                            for (uint32_t read : current.booksRead(user))
+                            {
+                                bookStamps[read] = version;
+                            }
+                        }
+                    });
+    }
+
+    // Copy the user's k nearest neighbors into out if a fresh entry for at
+    // least k is cached. A top-k prefix of a longer list is exact because
+    // the selection order is total.
+    bool lookup(const GraphSnapshot &snapshot, uint32_t user, size_t k, vector<Neighbor> &out) const
+    {
+        shared_lock<shared_mutex> guard(stampLock);
+        if (!shards)
+        {
+            return false;
+        }
+        Shard &shard = shardFor(user);
+        lock_guard<mutex> shardGuard(shard.lock);
+        auto it = shard.index.find(user);
+        if (it != shard.index.end())
+        {
+            Slot &slot = shard.slots[it->second];
+            if (slot.k >= k && fresh(slot, snapshot))
+            {
+                slot.referenced = true;
+                out.assign(slot.neighbors.begin(), slot.neighbors.begin() + min(k, slot.neighbors.size()));
+                hits.fetch_add(1, memory_order_relaxed);
+                return true;
+            }
+            stale.fetch_add(slot.k >= k, memory_order_relaxed);
+        }
+        misses.fetch_add(1, memory_order_relaxed);
+        return false;
+    }
+
+    // Remember a freshly computed list, replacing an older or shorter one
+    void store(const GraphSnapshot &snapshot, uint32_t user, size_t k, const vector<Neighbor> &neighbors)
+    {
+        shared_lock<shared_mutex> guard(stampLock);
+        if (!shards || snapshot.version < minVersion)
+        {
+            return;
+        }
+        Shard &shard = shardFor(user);
+        lock_guard<mutex> shardGuard(shard.lock);
+        size_t index;
+        auto it = shard.index.find(user);
+        if (it != shard.index.end())
+        {
+            index = it->second;
+            Slot &existing = shard.slots[index];
+            if (existing.version > snapshot.version || (existing.version == snapshot.version && existing.k >= k))
+            {
+                return;
+            }
+            shard.bytes -= footprint(existing);
+        }
+        else
+        {
+            if (shard.freeSlots.empty())
+            {
+                shard.freeSlots.push_back(shard.slots.size());
+                shard.slots.emplace_back();
+            }
+            index = shard.freeSlots.back();
+            shard.freeSlots.pop_back();
+            shard.index[user] = index;
+        }
+
+        Slot &slot = shard.slots[index];
+        slot.user = user;
+        slot.version = snapshot.version;
+        slot.k = k;
+        slot.referenced = true;
+        slot.neighbors.assign(neighbors.begin(), neighbors.end());
+        shard.bytes += footprint(slot);
+        evict(shard, index);
+    }
+
+    NeighborCacheStats stats() const
+    {
+        shared_lock<shared_mutex> guard(stampLock);
+        NeighborCacheStats report;
+        report.hits = hits;
+        report.misses = misses;
+        report.stale = stale;
+        report.evictions = evictions;
+        for (size_t i = 0; shards && i < kShards; ++i)
+        {
+            lock_guard<mutex> shardGuard(shards[i].lock);
+            report.entries += shards[i].index.size();
+            report.bytes += shards[i].bytes;
+        }
+        return report;
+    }
+};
+
+// Hot-path instrumentation: per-phase query time, event counters and
+// per-API latency histograms. Counters live in one block per thread and
+// are summed only when stats are read. Build with -DBOOKREC_NO_STATS to
+// compile all of it out; stats() then reports only the neighbor cache.
+#ifndef BOOKREC_NO_STATS
+#define BOOKREC_STATS 1
+#endif
+
+// Phases of a query
+enum StatPhase
+{
+    kPhaseSimilarity, // finding users who share books and counting overlaps
+    kPhaseUserSelect, // Jaccard scoring and top-k user selection
+    kPhaseBookCount,  // counting the neighbors' books
+    kPhaseBookSelect, // top books selection
+    kPhaseWalk,       // random walks of the PageRank engine
+    kPhaseEmbedding,  // fold-in and dot product scan of the embedding engine
+    kStatPhaseCount
+};
+
+enum StatCounter
+{
+    kStatQueries,          // recommendation queries, batch members included
+    kStatCandidateUsers,   // users with a non-zero overlap, scored by Jaccard
+    kStatReaderVisits,     // reader list entries walked
+    kStatIntersections,    // pairwise kernel intersections
+    kStatCandidateBooks,   // books voted for by the neighbors
+    kStatScratchGrowths,   // queries that had to grow their scratch buffers
+    kStatWalkSteps,        // random walk steps taken
+    kStatCounterCount
+};
+
+// Public calls with a latency histogram
+enum StatApi
+{
+    kApiRecommend,
+    kApiRecommendBatch,
+    kApiAddRead,
+    kApiPublish,
+    kApiLoad,
+    kStatApiCount
+};
+
+const char *const kStatPhaseNames[kStatPhaseCount] = {"similarity", "user_select", "book_count", "book_select", "walk",
+                                                      "embedding"};
+const char *const kStatCounterNames[kStatCounterCount] = {"queries", "candidate_users", "reader_visits",
+                                                         "intersections", "candidate_books", "scratch_growths",
+                                                         "walk_steps"};
+const char *const kStatApiNames[kStatApiCount] = {"recommend", "recommend_batch", "add_read", "publish", "load"};
+
+// Bucket i counts calls shorter than 2^i ns; the last also takes longer ones
+const size_t kLatencyBuckets = 40;
+
+struct LatencyHistogram
+{
+    uint64_t buckets[kLatencyBuckets] = {};
+    uint64_t count = 0;
+    uint64_t sumNanos = 0;
+
+    static size_t bucketFor(uint64_t nanos)
+    {
+        size_t bucket = nanos == 0 ? 0 : 64 - __builtin_clzll(nanos);
+        return min(bucket, kLatencyBuckets - 1);
+    }
+
+    // Upper bound, in seconds, of the bucket holding the q-quantile
+    double quantile(double q) const
+    {
+        uint64_t rank = (uint64_t)ceil(q * count);
+        uint64_t seen = 0;
+        for (size_t i = 0; i < kLatencyBuckets; ++i)
+        {
+            seen += buckets[i];
+            if (seen >= rank && seen > 0)
+            {
+                return ldexp(1.0, (int)i) * 1e-9;
+            }
+        }
+        return 0;
+    }
+};
+
+// Instrumentation totals since the process started
+struct StatsReport
+{
+    bool enabled = false; // false when built with BOOKREC_NO_STATS
+    uint64_t phaseNanos[kStatPhaseCount] = {};
+    uint64_t counters[kStatCounterCount] = {};
+    LatencyHistogram apis[kStatApiCount];
+    NeighborCacheStats neighborCache;
+
+    // Prometheus text exposition format
+    string prometheus() const
+    {
+        ostringstream out;
+        out << "# HELP bookrec_phase_seconds_total Time spent in each kNN query phase.\n"
+            << "# TYPE bookrec_phase_seconds_total counter\n";
+        for (size_t i = 0; i < kStatPhaseCount; ++i)
+        {
+            out << "bookrec_phase_seconds_total{phase=\"" << kStatPhaseNames[i] << "\"} " << phaseNanos[i] * 1e-9 << "\n";
+        }
+        out << "# HELP bookrec_events_total Hot path event counts.\n"
+            << "# TYPE bookrec_events_total counter\n";
+        for (size_t i = 0; i < kStatCounterCount; ++i)
+        {
+            out << "bookrec_events_total{event=\"" << kStatCounterNames[i] << "\"} " << counters[i] << "\n";
+        }
+        out << "# HELP bookrec_api_latency_seconds Latency of public calls.\n"
+            << "# TYPE bookrec_api_latency_seconds histogram\n";
+        for (size_t api = 0; api < kStatApiCount; ++api)
+        {
+            const LatencyHistogram &histogram = apis[api];
+            uint64_t cumulative = 0;
+            for (size_t i = 0; i + 1 < kLatencyBuckets; ++i)
+            {
+                cumulative += histogram.buckets[i];
+                out << "bookrec_api_latency_seconds_bucket{api=\"" << kStatApiNames[api] << "\",le=\""
+                    << ldexp(1.0, (int)i) * 1e-9 << "\"} " << cumulative << "\n";
+            }
+            out << "bookrec_api_latency_seconds_bucket{api=\"" << kStatApiNames[api] << "\",le=\"+Inf\"} "
+                << histogram.count << "\n"
+                << "bookrec_api_latency_seconds_sum{api=\"" << kStatApiNames[api] << "\"} " << histogram.sumNanos * 1e-9 << "\n"
+                << "bookrec_api_latency_seconds_count{api=\"" << kStatApiNames[api] << "\"} " << histogram.count << "\n";
+        }
+        out << "# TYPE bookrec_neighbor_cache_hits_total counter\n"
+            << "bookrec_neighbor_cache_hits_total " << neighborCache.hits << "\n"
+            << "# TYPE bookrec_neighbor_cache_misses_total counter\n"
+            << "bookrec_neighbor_cache_misses_total " << neighborCache.misses << "\n"
+            << "# TYPE bookrec_neighbor_cache_evictions_total counter\n"
+            << "bookrec_neighbor_cache_evictions_total " << neighborCache.evictions << "\n"
+            << "# TYPE bookrec_neighbor_cache_bytes gauge\n"
+            << "bookrec_neighbor_cache_bytes " << neighborCache.bytes << "\n";
+        return out.str();
+    }
+
+    string json() const
+    {
+        ostringstream out;
+        out << "{\"enabled\": " << (enabled ? "true" : "false") << ", \"phaseSeconds\": {";
+        for (size_t i = 0; i < kStatPhaseCount; ++i)
+        {
+            out << (i ? ", " : "") << "\"" << kStatPhaseNames[i] << "\": " << phaseNanos[i] * 1e-9;
+        }
+        out << "}, \"events\": {";
+        for (size_t i = 0; i < kStatCounterCount; ++i)
+        {
+            out << (i ? ", " : "") << "\"" << kStatCounterNames[i] << "\": " << counters[i];
+        }
+        out << "}, \"apis\": {";
+        for (size_t api = 0; api < kStatApiCount; ++api)
+        {
+            const LatencyHistogram &histogram = apis[api];
+            out << (api ? ", " : "") << "\"" << kStatApiNames[api] << "\": {\"count\": " << histogram.count
+                << ", \"sumSeconds\": " << histogram.sumNanos * 1e-9 << ", \"p50Seconds\": " << histogram.quantile(0.5)
+                << ", \"p99Seconds\": " << histogram.quantile(0.99) << ", \"p999Seconds\": " << histogram.quantile(0.999)
+                << "}";
+        }
+        out << "}, \"neighborCache\": {\"hits\": " << neighborCache.hits << ", \"misses\": " << neighborCache.misses
+            << ", \"stale\": " << neighborCache.stale << ", \"evictions\": " << neighborCache.evictions
+            << ", \"entries\": " << neighborCache.entries << ", \"bytes\": " << neighborCache.bytes << "}}";
+        return out.str();
+    }
+};
+
+#ifdef BOOKREC_STATS
+// One thread's counters. Only the owning thread writes them, with a
+// relaxed load and store rather than a locked add; readers sum them with
+// relaxed loads at any time.
+class StatsBlock
+{
+private:
+    atomic<uint64_t> phaseNanos[kStatPhaseCount];
+    atomic<uint64_t> counters[kStatCounterCount];
+    atomic<uint64_t> buckets[kStatApiCount][kLatencyBuckets];
+    atomic<uint64_t> apiNanos[kStatApiCount];
+
+    static void bump(atomic<uint64_t> &cell, uint64_t by)
+    {
+        cell.store(cell.load(memory_order_relaxed) + by, memory_order_relaxed);
+    }
+
+public:
+    StatsBlock()
+    {
+        for (auto &cell : phaseNanos)
+        {
+            cell.store(0, memory_order_relaxed);
+        }
+        for (auto &cell : counters)
+        {
+            cell.store(0, memory_order_relaxed);
+        }
+        for (auto &api : buckets)
+        {
+            for (auto &cell : api)
+            {
+                cell.store(0, memory_order_relaxed);
+            }
+        }
+        for (auto &cell : apiNanos)
+        {
+            cell.store(0, memory_order_relaxed);
+        }
+    }
+
+    void addPhase(StatPhase phase, uint64_t nanos)
+    {
+        bump(phaseNanos[phase], nanos);
+    }
+
+    void count(StatCounter counter, uint64_t by)
+    {
+        bump(counters[counter], by);
+    }
+
+    void recordLatency(StatApi api, uint64_t nanos)
+    {
+        bump(buckets[api][LatencyHistogram::bucketFor(nanos)], 1);
+        bump(apiNanos[api], nanos);
+    }
+
+    void addTo(StatsReport &report) const
+    {
+        for (size_t i = 0; i < kStatPhaseCount; ++i)
+        {
+            report.phaseNanos[i] += phaseNanos[i].load(memory_order_relaxed);
+        }
+        for (size_t i = 0; i < kStatCounterCount; ++i)
+        {
+            report.counters[i] += counters[i].load(memory_order_relaxed);
+        }
+        for (size_t api = 0; api < kStatApiCount; ++api)
+        {
+            LatencyHistogram &histogram = report.apis[api];
+            for (size_t i = 0; i < kLatencyBuckets; ++i)
+            {
+                uint64_t calls = buckets[api][i].load(memory_order_relaxed);
+                histogram.buckets[i] += calls;
+                histogram.count += calls;
+            }
+            histogram.sumNanos += apiNanos[api].load(memory_order_relaxed);
+        }
+    }
+};
+
+// Every live thread's block; blocks of exited threads are folded into
+// a retired total so their counts are kept
+class StatsRegistry
+{
+private:
+    mutex lock;
+    vector<const StatsBlock *> live;
+    StatsReport retired;
+
+public:
+    static StatsRegistry &instance()
+    {
+        static StatsRegistry registry;
+        return registry;
+    }
+
+    void add(const StatsBlock *block)
+    {
+        lock_guard<mutex> guard(lock);
+        live.push_back(block);
+    }
+
+    void retire(const StatsBlock *block)
+    {
+        lock_guard<mutex> guard(lock);
+        block->addTo(retired);
+        live.erase(find(live.begin(), live.end(), block));
+    }
+
+    StatsReport collect()
+    {
+        lock_guard<mutex> guard(lock);
+        StatsReport report = retired;
+        for (const StatsBlock *block : live)
+        {
+            block->addTo(report);
+        }
+        report.enabled = true;
+        return report;
+    }
+};
+
+// Registers the calling thread's block on first use
+struct ThreadStats
+{
+    StatsBlock block;
+
+    ThreadStats()
+    {
+        StatsRegistry::instance().add(&block);
+    }
+
+    ~ThreadStats()
+    {
+        StatsRegistry::instance().retire(&block);
+    }
+};
+
+inline StatsBlock &threadStats()
+{
+    static thread_local ThreadStats stats;
+    return stats.block;
+}
+#endif
+
+inline void statCount(StatCounter counter, uint64_t by = 1)
+{
+#ifdef BOOKREC_STATS
+    threadStats().count(counter, by);
+#else
+    (void)counter;
+    (void)by;
+#endif
+}
+
+inline StatsReport collectStats()
+{
+#ifdef BOOKREC_STATS
+    return StatsRegistry::instance().collect();
+#else
+    return StatsReport();
+#endif
+}
+
+// Splits a query into phases: lap(phase) charges the time since
+// construction, restart() or the previous lap to phase
+class PhaseTimer
+{
+#ifdef BOOKREC_STATS
+private:
+    chrono::steady_clock::time_point last = chrono::steady_clock::now();
+
+public:
+    void restart()
+    {
+        last = chrono::steady_clock::now();
+    }
+
+    void lap(StatPhase phase)
+    {
+        auto now = chrono::steady_clock::now();
+        threadStats().addPhase(phase, chrono::duration_cast<chrono::nanoseconds>(now - last).count());
+        last = now;
+    }
+#else
+public:
+    void restart()
+    {
+    }
+
+    void lap(StatPhase)
+    {
+    }
+#endif
+};
+
+// Records the latency of one public call when it goes out of scope
+class ApiTimer
+{
+#ifdef BOOKREC_STATS
+private:
+    StatApi api;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+public:
+    explicit ApiTimer(StatApi timed) : api(timed)
+    {
+    }
+
+    ~ApiTimer()
+    {
+        threadStats().recordLatency(api, chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+    }
+#else
+public:
+    explicit ApiTimer(StatApi)
+    {
+    }
+#endif
+};
+
+// Fixed pool of worker threads, each owning a task deque. A worker pops its
+// own deque from the back and, when it runs dry, steals from the front of
+// the others, so skewed batches (a few heavy users) still balance out.
+// Tasks are submitted and awaited a batch at a time: workers reserve tasks
+// with a CAS on an atomic count and completions are counted on the batch,
+// so the shared stateLock is only taken to publish a batch, to signal its
+// end and to put idle workers to sleep.
+class WorkStealingPool
+{
+public:
+    // Tasks receive the index of the worker running them, for per-worker state
+    typedef function<void(size_t worker)> Task;
+
+private:
+    struct Batch
+    {
+        atomic<size_t> remaining;
+    };
+
+    struct Entry
+    {
+        Task task;
+        Batch *batch = nullptr;
+    };
+
+    struct WorkerQueue
+    {
+        mutex lock;
+        deque<Entry> tasks;
+    };
+
+    vector<unique_ptr<WorkerQueue>> queues;
+    vector<thread> workers;
+    mutex stateLock;
+    condition_variable workAvailable;
+    condition_variable allDone;
+    atomic<size_t> queued{0}; // queued but not yet reserved; only raised under stateLock
+    atomic<size_t> nextQueue{0};
+    bool stopping = false;
+
+    bool popOwn(size_t worker, Entry &entry)
+    {
+        WorkerQueue &queue = *queues[worker];
+        lock_guard<mutex> guard(queue.lock);
+        if (queue.tasks.empty())
+        {
+            return false;
+        }
+        entry = move(queue.tasks.back());
+        queue.tasks.pop_back();
+        return true;
+    }
+
+    bool steal(size_t worker, Entry &entry)
+    {
+        for (size_t i = 1; i < queues.size(); ++i)
+        {
+            WorkerQueue &victim = *queues[(worker + i) % queues.size()];
+            lock_guard<mutex> guard(victim.lock);
+            if (!victim.tasks.empty())
+            {
+                entry = move(victim.tasks.front());
+                victim.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Claim one queued task, without blocking
+    bool reserve()
+    {
+        size_t available = queued.load(memory_order_acquire);
+        while (available > 0)
+        {
+            if (queued.compare_exchange_weak(available, available - 1, memory_order_acq_rel))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void run(size_t worker)
+    {
+        for (;;)
+        {
+            if (!reserve())
+            {
+                unique_lock<mutex> guard(stateLock);
+                workAvailable.wait(guard, [this]
+                                   { return stopping || queued.load(memory_order_acquire) > 0; });
+                if (queued.load(memory_order_acquire) == 0)
+                {
+                    return;
+                }
+                continue;
+            }
+
+            // A task is reserved for us; it is in our deque or someone else's
+            Entry entry;
+            while (!popOwn(worker, entry) && !steal(worker, entry))
+            {
+                this_thread::yield();
+            }
+            entry.task(worker);
+
+            // The batch lives on the submitter's stack: touch it only
+            // before the final decrement releases the submitter
+            if (entry.batch->remaining.fetch_sub(1, memory_order_acq_rel) == 1)
+            {
+                lock_guard<mutex> guard(stateLock);
+                allDone.notify_all();
+            }
+        }
+    }
+
+public:
+    explicit WorkStealingPool(size_t threads)
+    {
+        threads = max<size_t>(1, threads);
+        for (size_t i = 0; i < threads; ++i)
+        {
+            queues.emplace_back(new WorkerQueue);
+        }
+        for (size_t i = 0; i < threads; ++i)
+        {
+            workers.emplace_back(&WorkStealingPool::run, this, i);
+        }
+    }
+
+    ~WorkStealingPool()
+    {
+        {
+            lock_guard<mutex> guard(stateLock);
+            stopping = true;
+        }
+        workAvailable.notify_all();
+        for (thread &worker : workers)
+        {
+            worker.join();
+        }
+    }
+
+    size_t size() const
+    {
+        return workers.size();
+    }
+
+    // Run every task, spread round-robin over the worker deques, and block
+    // until all of them have completed. Tasks are moved out of the vector.
+    void runAll(vector<Task> &tasks)
+    {
+        if (tasks.empty())
+        {
+            return;
+        }
+
+        Batch batch;
+        batch.remaining.store(tasks.size(), memory_order_relaxed);
+        size_t first = nextQueue.fetch_add(tasks.size(), memory_order_relaxed);
+        for (size_t q = 0; q < queues.size() && q < tasks.size(); ++q)
+        {
+            size_t target = (first + q) % queues.size();
+            lock_guard<mutex> guard(queues[target]->lock);
+            for (size_t i = q; i < tasks.size(); i += queues.size())
+            {
+                queues[target]->tasks.push_back(Entry{move(tasks[i]), &batch});
+            }
+        }
+
+        {
+            lock_guard<mutex> guard(stateLock);
+            queued.fetch_add(tasks.size(), memory_order_acq_rel);
+        }
+        if (tasks.size() < workers.size())
+        {
+            for (size_t i = 0; i < tasks.size(); ++i)
+            {
+                workAvailable.notify_one();
+            }
+        }
+        else
+        {
+            workAvailable.notify_all();
+        }
+
+        unique_lock<mutex> guard(stateLock);
+        allDone.wait(guard, [&batch]
+                     { return batch.remaining.load(memory_order_acquire) == 0; });
+    }
+};
+
+// Union-find over a fixed set of nodes that many threads can unite at once
+// without locks. A root is only ever linked below a smaller id, by a CAS
+// on its own parent, so no cycles form and every root is the smallest id
+// of its set. Finds halve the path as they go; losing those races is
+// harmless because parents only ever move closer to the root.
+class ConcurrentUnionFind
+{
+private:
+    unique_ptr<atomic<uint32_t>[]> parent;
+
+public:
+    explicit ConcurrentUnionFind(size_t nodes) : parent(new atomic<uint32_t>[nodes])
+    {
+        for (size_t i = 0; i < nodes; ++i)
+        {
+            parent[i].store((uint32_t)i, memory_order_relaxed);
+        }
+    }
+
+    uint32_t find(uint32_t node)
+    {
+        for (;;)
+        {
+            uint32_t up = parent[node].load(memory_order_relaxed);
+            if (up == node)
+            {
+                return node;
+            }
+            uint32_t above = parent[up].load(memory_order_relaxed);
+            if (above != up)
+            {
+                parent[node].compare_exchange_weak(up, above, memory_order_relaxed);
+            }
+            node = above;
+        }
+    }
+
+    void unite(uint32_t a, uint32_t b)
+    {
+        for (;;)
+        {
+            a = find(a);
+            b = find(b);
+            if (a == b)
+            {
+                return;
+            }
+            if (a < b)
+            {
+                swap(a, b);
+            }
+            uint32_t expected = a;
+            if (parent[a].compare_exchange_strong(expected, b, memory_order_relaxed))
+            {
+                return;
+            }
+        }
+    }
+};
+
+// Connected components of the user/book graph: two users are in the same
+// component when a chain of shared books links them. Components are
+// numbered by user count, largest first; users who have read nothing are
+// components of their own.
+struct ComponentReport
+{
+    vector<uint32_t> userComponent;  // by user id
+    vector<uint32_t> componentUsers; // by component
+    vector<uint32_t> componentBooks; // books read in each component
+    double seconds = 0;
+
+    size_t components() const
+    {
+        return componentUsers.size();
+    }
+};
+
+// Weighted one-mode projection settings. A book with more than maxDegree
+// readers adds no user-user weight: its readers would form a clique of
+// maxDegree^2 pairs that says little about any one of them. Likewise a
+// user with more than maxDegree books adds no book-book weight. Pairs
+// sharing fewer than minWeight books (or readers) are left out, and each
+// row keeps only its maxNeighbors heaviest pairs (0 keeps all), so the
+// output stays within nodes * maxNeighbors edges however dense the graph.
+// Rows are cut independently, so a cut projection need not be symmetric.
+struct ProjectionOptions
+{
+    size_t maxDegree = 1000;
+    uint32_t minWeight = 1;
+    size_t maxNeighbors = 100;
+};
+
+// User-user or book-book projection in CSR form: the neighbors of node i
+// are neighbors[offsets[i] .. offsets[i + 1]), sorted ascending, and each
+// weight is the number of books (or readers) the two nodes share
+struct WeightedProjection
+{
+    vector<uint64_t> offsets{0};
+    vector<uint32_t> neighbors;
+    vector<uint32_t> weights;
+    size_t skippedHubs = 0; // books (or users) left out for exceeding maxDegree
+    size_t cutRows = 0;     // rows cut back to maxNeighbors
+    double seconds = 0;
+
+    size_t nodeCount() const
+    {
+        return offsets.size() - 1;
+    }
+
+    size_t edgeCount() const
+    {
+        return neighbors.size();
+    }
+
+    IdSpan row(uint32_t node) const
+    {
+        return IdSpan{neighbors.data() + offsets[node], (size_t)(offsets[node + 1] - offsets[node])};
+    }
+
+    // Weights of row(node), in the same order
+    const uint32_t *rowWeights(uint32_t node) const
+    {
+        return weights.data() + offsets[node];
+    }
+};
+
+// Read-only view of a whole file, memory-mapped when possible and read
+// into memory otherwise (pipes, special files)
+class MappedFile
+{
+private:
+    const char *bytes = nullptr;
+    size_t length = 0;
+    bool mapped = false;
+    string buffered;
+
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    ~MappedFile()
+    {
+        if (mapped)
+        {
+            munmap((void *)bytes, length);
+        }
+    }
+
+    // advice is passed to madvise: sequential for loaders, normal for
+    // snapshots that are queried in place
+    bool open(const string &path, string &error, int advice = MADV_SEQUENTIAL)
+    {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            error = "Cannot open " + path + ": " + strerror(errno);
+            return false;
+        }
+
+        struct stat info;
+        if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0)
+        {
+            void *view = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (view != MAP_FAILED)
+            {
+                madvise(view, (size_t)info.st_size, advice);
+                bytes = (const char *)view;
+                length = (size_t)info.st_size;
+                mapped = true;
+                ::close(fd);
+                return true;
+            }
+        }
+
+        char chunk[1 << 16];
+        ssize_t got;
+        while ((got = ::read(fd, chunk, sizeof(chunk))) > 0)
+        {
+            buffered.append(chunk, (size_t)got);
+        }
+        ::close(fd);
+        if (got < 0)
+        {
+            error = "Cannot read " + path + ": " + strerror(errno);
+            return false;
+        }
+        bytes = buffered.data();
+        length = buffered.size();
+        return true;
+    }
+
+    string_view contents() const
+    {
+        return string_view(bytes, length);
+    }
+};
+
+// Settings for the bulk loaders
+struct LoadOptions
+{
+    char delimiter = '\t';
+    bool hasHeader = false;     // skip the first line
+    bool createMissing = false; // reads may introduce users and books not loaded yet
+    size_t threads = 0;         // parser threads for reads files; 0 = one per core
+    size_t maxErrors = 100;     // errors kept in the report; all are counted
+};
+
+// One rejected row
+struct LoadError
+{
+    size_t line = 0; // 1-based, 0 for file-level errors
+    string message;
+};
+
+// Outcome of a bulk load
+struct LoadReport
+{
+    size_t rows = 0;       // non-empty data rows seen
+    size_t loaded = 0;     // new users, books or reads recorded
+    size_t duplicates = 0; // rows that were already recorded
+    size_t rejected = 0;   // rows with errors
+    vector<LoadError> errors;
+    double seconds = 0;
+
+    void reject(size_t line, const char *message, size_t maxErrors)
+    {
+        rejected++;
+        if (errors.size() < maxErrors)
+        {
+            errors.push_back({line, message});
+        }
+    }
+};
+
+// Split off the next line of text, without its line terminator
+bool nextLine(string_view &text, string_view &line)
+{
+    if (text.empty())
+    {
+        return false;
+    }
+    size_t end = text.find('\n');
+    line = text.substr(0, end);
+    text.remove_prefix(end == string_view::npos ? text.size() : end + 1);
+    if (!line.empty() && line.back() == '\r')
+    {
+        line.remove_suffix(1);
+    }
+    return true;
+}
+
+// Cut text into about parts pieces that each end at a line boundary
+vector<string_view> splitAtLines(string_view text, size_t parts)
+{
+    vector<string_view> pieces;
+    while (!text.empty())
+    {
+        size_t cut = parts <= 1 ? text.size() : text.size() / parts;
+        size_t end = text.find('\n', cut == 0 ? 0 : cut - 1);
+        end = end == string_view::npos ? text.size() : end + 1;
+        pieces.push_back(text.substr(0, end));
+        text.remove_prefix(end);
+        parts = parts > 1 ? parts - 1 : 1;
+    }
+    return pieces;
+}
+
+// Binary snapshot layout, version 1. A header is followed by sections that
+// each start on a 64-byte boundary, so every array can be used in place
+// from a read-only mapping. Integers are stored in host byte order; the
+// header records it and files from the other byte order are rejected.
+const char kSnapshotMagic[8] = {'B', 'K', 'R', 'S', 'N', 'A', 'P', '\0'};
+const uint32_t kSnapshotFormatVersion = 1;
+const uint32_t kSnapshotByteOrder = 0x01020304;
+const size_t kSnapshotAlignment = 64;
+
+enum SnapshotSectionId
+{
+    kUserNameOffsets,    // uint64_t x (users + 1), into the blob
+    kUserNameBlob,       // concatenated names
+    kUserNameSlots,      // StringInterner lookup table, uint64_t x power of two
+    kBookNameOffsets,
+    kBookNameBlob,
+    kBookNameSlots,
+    kUserBookOffsets,    // CSR booksRead: uint64_t x (users + 1)
+    kUserBookNeighbors,  // uint32_t x reads
+    kBookReaderOffsets,  // CSR readers: uint64_t x (books + 1)
+    kBookReaderNeighbors,
+    kKernelSlots,        // JaccardKernel bitset slot per user, uint32_t
+    kKernelBitsets,      // uint64_t x denseUsers x ceil(books / 64)
+    kSnapshotSectionCount
+};
+
+struct SnapshotSection
+{
+    uint64_t offset = 0;
+    uint64_t size = 0; // bytes
+    uint64_t checksum = 0;
+};
+
+struct SnapshotHeader
+{
+    char magic[8];
+    uint32_t formatVersion = 0;
+    uint32_t byteOrder = 0;
+    uint64_t fileSize = 0;
+    uint64_t graphVersion = 0;
+    uint64_t userCount = 0;
+    uint64_t bookCount = 0;
+    uint64_t readCount = 0;
+    uint64_t denseUsers = 0;
+    uint64_t headerChecksum = 0; // of the header with this field zero
+    SnapshotSection sections[kSnapshotSectionCount];
+};
+
+uint64_t checksumBytes(const void *data, size_t size)
+{
+    return hashName(string_view((const char *)data, size));
+}
+
+// checksumBytes over bytes that arrive in pieces; total is the size of
+// them all
+class ChecksumStream
+{
+private:
+    uint64_t h;
+    unsigned char partial[8];
+    size_t partialBytes = 0;
+
+    void mix(uint64_t word)
+    {
+        h = (h ^ word) * 0xbf58476d1ce4e5b9ULL;
+        h ^= h >> 29;
+    }
+
+public:
+    explicit ChecksumStream(size_t total) : h(0x9e3779b97f4a7c15ULL ^ (total * 0xff51afd7ed558ccdULL))
+    {
+    }
+
+    void add(const void *data, size_t size)
+    {
+        const unsigned char *bytes = (const unsigned char *)data;
+        while (size > 0 && partialBytes > 0)
+        {
+            partial[partialBytes++] = *bytes++;
+            size--;
+            if (partialBytes == 8)
+            {
+                uint64_t word;
+                memcpy(&word, partial, 8);
+                mix(word);
+                partialBytes = 0;
+            }
+        }
+        for (; size >= 8; bytes += 8, size -= 8)
+        {
+            uint64_t word;
+            memcpy(&word, bytes, 8);
+            mix(word);
+        }
+        memcpy(partial + partialBytes, bytes, size);
+        partialBytes += size;
+    }
+
+    uint64_t finish() const
+    {
+        uint64_t tail = 0;
+        for (size_t i = 0; i < partialBytes; ++i)
+        {
+            tail |= (uint64_t)partial[i] << (8 * i);
+        }
+        uint64_t x = (h ^ tail) * 0x94d049bb133111ebULL;
+        x ^= x >> 32;
+        x *= 0xbf58476d1ce4e5b9ULL;
+        x ^= x >> 29;
+        return x;
+    }
+};
+
+uint64_t headerChecksum(SnapshotHeader header)
+{
+    header.headerChecksum = 0;
+    return checksumBytes(&header, sizeof(header));
+}
+
+// Structural checks openSnapshot runs on every open. They read the offset,
+// id and slot arrays once, far cheaper than checksumming the file, and
+// guarantee that no query indexes outside the mapping. They do not catch
+// every bit flip; verified opens also check the section checksums.
+
+// CSR offsets: count + 1 entries from 0 up to edges, never decreasing
+bool offsetsValid(const uint64_t *offsets, size_t count, uint64_t edges)
+{
+    if (offsets[0] != 0 || offsets[count] != edges)
+    {
+        return false;
+    }
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (offsets[i] > offsets[i + 1])
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Every id below limit, or kInvalidId where allowInvalid
+bool idsValid(const uint32_t *ids, size_t count, uint64_t limit, bool allowInvalid = false)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (ids[i] >= limit && !(allowInvalid && ids[i] == kInvalidId))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// StringInterner slots: one occupied slot per name, each naming an id
+// below names, so lookups stay in range and every probe hits an empty slot
+bool nameSlotsValid(const uint64_t *slots, size_t slotCount, size_t names)
+{
+    size_t occupied = 0;
+    for (size_t i = 0; i < slotCount; ++i)
+    {
+        if (slots[i] != 0)
+        {
+            uint32_t id = (uint32_t)slots[i];
+            if (id == 0 || id > names)
+            {
+                return false;
+            }
+            occupied++;
+        }
+    }
+    return occupied == names;
+}
+
+// Writes sections back to back with the padding the layout requires
+class SnapshotWriter
+{
+private:
+    FILE *file;
+    uint64_t position = sizeof(SnapshotHeader);
+
+public:
+    explicit SnapshotWriter(FILE *output) : file(output)
+    {
+    }
+
+    bool write(SnapshotHeader &header, SnapshotSectionId id, const void *data, size_t size)
+    {
+        return write(header, id, size, [data, size](const auto &append)
+                     { return append(data, size); });
+    }
+
+    // A section of size bytes that fill(append) passes in pieces to
+    // append(data, bytes)
+    template <typename Fill>
+    bool write(SnapshotHeader &header, SnapshotSectionId id, size_t size, const Fill &fill)
+    {
+        static const char padding[kSnapshotAlignment] = {};
+        size_t pad = (kSnapshotAlignment - position % kSnapshotAlignment) % kSnapshotAlignment;
+        if (fwrite(padding, 1, pad, file) != pad)
+        {
+            return false;
+        }
+        position += pad;
+        ChecksumStream checksum(size);
+        size_t written = 0;
+        auto append = [this, &checksum, &written](const void *data, size_t bytes)
+        {
+            checksum.add(data, bytes);
+            written += bytes;
+            return bytes == 0 || fwrite(data, 1, bytes, file) == bytes;
+        };
+        if (!fill(append) || written != size)
+        {
+            return false;
+        }
+        header.sections[id] = {position, size, checksum.finish()};
+        position += size;
+        return true;
+    }
+
+    uint64_t size() const
+    {
+        return position;
+    }
+};
+
+// Implicit-feedback matrix factorization, after Hu, Koren and Volinsky.
+// Every (user, book) cell is a preference, 1 for a read and 0 otherwise,
+// weighted by confidence 1 + alpha for reads and 1 for the rest. ALS
+// alternates exact least-squares solves of every user vector and every
+// book vector; each pass costs O(reads * factors^2 + nodes * factors^3).
+struct FactorOptions
+{
+    size_t factors = 32;
+    size_t iterations = 10;
+    double regularization = 0.1;
+    double alpha = 20;
+    uint64_t seed = 42;
+    string checkpointPath; // rewritten after every iteration when set
+    bool resume = true;    // continue the current model up to iterations in all; false starts afresh
+};
+
+// Factor checkpoint layout: a header, then userCount user vectors and
+// bookCount book vectors of factors floats each, unpadded. Host byte
+// order, as in snapshots. The header keeps the user, book and read counts
+// of the snapshot trained on, so training resumes only on the same data.
+const char kFactorMagic[8] = {'B', 'K', 'R', 'F', 'A', 'C', 'T', '\0'};
+const uint32_t kFactorFormatVersion = 2;
+const size_t kMaxFactors = 1024;
+
+struct FactorHeader
+{
+    char magic[8];
+    uint32_t formatVersion = 0;
+    uint32_t byteOrder = 0;
+    uint64_t userCount = 0;
+    uint64_t bookCount = 0;
+    uint64_t readCount = 0;
+    uint64_t factors = 0;
+    uint64_t iterations = 0; // completed
+    double regularization = 0;
+    double alpha = 0;
+    uint64_t dataChecksum = 0;
+    uint64_t headerChecksum = 0; // of the header with this field zero
+};
+
+uint64_t headerChecksum(FactorHeader header)
+{
+    header.headerChecksum = 0;
+    return checksumBytes(&header, sizeof(header));
+}
+
+// Rows of floats in one 64-byte aligned block, each stride floats long:
+// factors rounded up to 16, so every row starts on a cache line and
+// aligned vector loads work anywhere in it. Padding floats stay zero.
+class FactorMatrix
+{
+private:
+    struct Release
+    {
+        void operator()(float *block) const
+        {
+            free(block);
+        }
+    };
+
+    unique_ptr<float, Release> block;
+    size_t count = 0;
+    size_t width = 0;
+
+public:
+    static size_t strideFor(size_t factors)
+    {
+        return (factors + 15) / 16 * 16;
+    }
+
+    // Zeroed rows x strideFor(factors)
+    void assign(size_t rows, size_t factors)
+    {
+        count = rows;
+        width = strideFor(factors);
+        size_t bytes = max<size_t>(64, rows * width * sizeof(float));
+        block.reset((float *)aligned_alloc(64, bytes));
+        if (!block)
+        {
+            throw bad_alloc();
+        }
+        memset(block.get(), 0, bytes);
+    }
+
+    float *row(size_t r)
+    {
+        return block.get() + r * width;
+    }
+
+    const float *row(size_t r) const
+    {
+        return block.get() + r * width;
+    }
+
+    size_t rows() const
+    {
+        return count;
+    }
+
+    size_t stride() const
+    {
+        return width;
+    }
+};
+
+// User and book vectors of an implicit ALS model (see FactorOptions),
+// trained offline on a snapshot. Users newer than the model are folded in
+// at query time: their vector is solved from their reads against the
+// fixed book vectors, as one half-step of ALS. Newer books have no vector
+// and are not recommended until the next training.
+class FactorModel
+{
+private:
+    FactorOptions options;
+    FactorMatrix userFactors;
+    FactorMatrix bookFactors;
+    FactorMatrix bookPanels; // bookFactors transposed in panels of 16, for dotPanels
+    vector<double> bookGram; // sum of y y^T over the book vectors; lower triangle of factors x factors
+    size_t completed = 0;    // iterations
+    size_t trainedReads = 0; // reads of the snapshot trained on
+    bool on = false;
+
+    // Rows per solve task; book rows vary most in cost
+    static constexpr size_t kSolveChunk = 64;
+
+    // Rows per task summing a gram matrix
+    static constexpr size_t kGramChunk = 4096;
+
+    // Add v v^T over rows [begin, end) into the lower triangle of out
+    void addGram(const FactorMatrix &rows, size_t begin, size_t end, double *out) const
+    {
+        size_t f = options.factors;
+        for (size_t r = begin; r < end; ++r)
+        {
+            const float *v = rows.row(r);
+            for (size_t i = 0; i < f; ++i)
+            {
+                double vi = v[i];
+                for (size_t j = 0; j <= i; ++j)
+                {
+                    out[i * f + j] += vi * v[j];
+                }
+            }
+        }
+    }
+
+    // Lower triangle of the gram matrix of all rows, summed per chunk in
+    // parallel
+    template <typename RunChunks>
+    void gram(const FactorMatrix &rows, vector<double> &out, const RunChunks &run) const
+    {
+        size_t f = options.factors;
+        size_t chunks = (rows.rows() + kGramChunk - 1) / kGramChunk;
+        vector<double> partial(chunks * f * f, 0);
+        run(rows.rows(), kGramChunk, [this, &rows, &partial, f](size_t begin, size_t end, size_t)
+            { addGram(rows, begin, end, partial.data() + begin / kGramChunk * f * f); });
+        out.assign(f * f, 0);
+        for (size_t c = 0; c < chunks; ++c)
+        {
+            for (size_t i = 0; i < f * f; ++i)
+            {
+                out[i] += partial[c * f * f + i];
+            }
+        }
+    }
+
+    // Least-squares vector of a row that read items, against the other
+    // side's fixed vectors and their gram matrix G, by Cholesky:
+    // (G + regularization I + alpha sum y y^T) x = (1 + alpha) sum y
+    void solve(IdSpan items, const FactorMatrix &other, const vector<double> &otherGram, float *out) const
+    {
+        static thread_local vector<double> a;
+        static thread_local vector<double> b;
+        size_t f = options.factors;
+        a.assign(otherGram.begin(), otherGram.end());
+        b.assign(f, 0);
+        for (size_t i = 0; i < f; ++i)
+        {
+            a[i * f + i] += options.regularization;
+        }
+        for (uint32_t item : items)
+        {
+            if (item >= other.rows())
+            {
+                continue;
+            }
+            const float *y = other.row(item);
+            for (size_t i = 0; i < f; ++i)
+            {
+                double weighted = options.alpha * y[i];
+                b[i] += (1 + options.alpha) * y[i];
+                for (size_t j = 0; j <= i; ++j)
+                {
+                    a[i * f + j] += weighted * y[j];
+                }
+            }
+        }
+
+        // a = L L^T in the lower triangle, then L z = b and L^T x = z
+        for (size_t j = 0; j < f; ++j)
+        {
+            double diagonal = a[j * f + j];
+            for (size_t k = 0; k < j; ++k)
+            {
+                diagonal -= a[j * f + k] * a[j * f + k];
+            }
+            diagonal = sqrt(max(diagonal, 1e-12));
+            a[j * f + j] = diagonal;
+            for (size_t i = j + 1; i < f; ++i)
+            {
+                double value = a[i * f + j];
+                for (size_t k = 0; k < j; ++k)
+                {
+                    value -= a[i * f + k] * a[j * f + k];
+                }
+                a[i * f + j] = value / diagonal;
+            }
+        }
+        for (size_t i = 0; i < f; ++i)
+        {
+            for (size_t k = 0; k < i; ++k)
+            {
+                b[i] -= a[i * f + k] * b[k];
+            }
+            b[i] /= a[i * f + i];
+        }
+        for (size_t i = f; i-- > 0;)
+        {
+            for (size_t k = i + 1; k < f; ++k)
+            {
+                b[i] -= a[k * f + i] * b[k];
+            }
+            b[i] /= a[i * f + i];
+            out[i] = (float)b[i];
+        }
+    }
+
+    void buildPanels()
+    {
+        size_t f = options.factors;
+        bookPanels.assign((books() + 15) / 16, 16 * f);
+        for (size_t book = 0; book < books(); ++book)
+        {
+            float *panel = bookPanels.row(book / 16);
+            const float *v = bookFactors.row(book);
+            for (size_t i = 0; i < f; ++i)
+            {
+                panel[i * 16 + book % 16] = v[i];
+            }
+        }
+    }
+
+    // Small positive starting values, fixed by the seed and row
+    void randomize(float *v, uint64_t row) const
+    {
+        uint64_t state = options.seed ^ (row * 0xff51afd7ed558ccdULL);
+        double scale = 1.0 / sqrt((double)options.factors);
+        for (size_t i = 0; i < options.factors; ++i)
+        {
+            v[i] = (float)((RandomWalkIndex::next(state) >> 40) * 0x1p-24 * scale);
+        }
+    }
+
+public:
+    bool enabled() const
+    {
+        return on;
+    }
+
+    const FactorOptions &settings() const
+    {
+        return options;
+    }
+
+    size_t iterations() const
+    {
+        return completed;
+    }
+
+    size_t users() const
+    {
+        return userFactors.rows();
+    }
+
+    size_t books() const
+    {
+        return bookFactors.rows();
+    }
+
+    size_t stride() const
+    {
+        return userFactors.stride();
+    }
+
+    // The user's vector, or nullptr for users newer than the model
+    const float *userVector(uint32_t user) const
+    {
+        return user < userFactors.rows() ? userFactors.row(user) : nullptr;
+    }
+
+    // Book vectors in panels of 16, as dotPanels reads them
+    const float *panels() const
+    {
+        return bookPanels.row(0);
+    }
+
+    // Whether the model was trained on a snapshot of this many users,
+    // books and reads; error says what it was trained on when not
+    bool trainedOn(const GraphSnapshot &snapshot, string &error) const
+    {
+        if (on && users() == snapshot.users() && books() == snapshot.books() && trainedReads == snapshot.reads())
+        {
+            return true;
+        }
+        error = "The factor model was trained on " + to_string(users()) + " users, " + to_string(books()) +
+                " books and " + to_string(trainedReads) + " reads, not on this library; train it afresh.";
+        return false;
+    }
+
+    // Start a model for the snapshot's users and books. When warm has the
+    // same number of factors, training resumes from it: its vectors and
+    // completed iterations carry over, and it must have been trained on
+    // the same data, or configure fails. Otherwise vectors start random.
+    bool configure(const FactorOptions &settings, const GraphSnapshot &snapshot, const FactorModel *warm,
+                   string &error)
+    {
+        options = settings;
+        options.factors = min(max<size_t>(1, options.factors), kMaxFactors);
+        bool resume = warm && warm->on && warm->options.factors == options.factors;
+        if (resume && !warm->trainedOn(snapshot, error))
+        {
+            return false;
+        }
+        userFactors.assign(snapshot.users(), options.factors);
+        bookFactors.assign(snapshot.books(), options.factors);
+        for (size_t user = 0; user < users(); ++user)
+        {
+            if (resume)
+            {
+                memcpy(userFactors.row(user), warm->userFactors.row(user), options.factors * sizeof(float));
+            }
+            else
+            {
+                randomize(userFactors.row(user), user);
+            }
+        }
+        for (size_t book = 0; book < books(); ++book)
+        {
+            if (resume)
+            {
+                memcpy(bookFactors.row(book), warm->bookFactors.row(book), options.factors * sizeof(float));
+            }
+            else
+            {
+                randomize(bookFactors.row(book), users() + book);
+            }
+        }
+        completed = resume ? warm->completed : 0;
+        trainedReads = snapshot.reads();
+        bookGram.assign(options.factors * options.factors, 0);
+        addGram(bookFactors, 0, books(), bookGram.data());
+        buildPanels();
+        on = true;
+        return true;
+    }
+
+    // One ALS iteration on the snapshot the model was configured for: all
+    // users against the book vectors, then all books against the new user
+    // vectors. run(count, chunk, body) runs body(begin, end, worker) over
+    // [0, count) in parallel.
+    template <typename RunChunks>
+    void iterate(const GraphSnapshot &snapshot, const RunChunks &run)
+    {
+        run(users(), kSolveChunk, [this, &snapshot](size_t begin, size_t end, size_t)
+            {
+                for (size_t user = begin; user < end; ++user)
+                {
+                    solve(snapshot.booksRead((uint32_t)user), bookFactors, bookGram, userFactors.row(user));
+                }
+            });
+        vector<double> userGram;
+        gram(userFactors, userGram, run);
+        run(books(), kSolveChunk, [this, &snapshot, &userGram](size_t begin, size_t end, size_t)
+            {
+                for (size_t book = begin; book < end; ++book)
+                {
+                    solve(snapshot.readers((uint32_t)book), userFactors, userGram, bookFactors.row(book));
+                }
+            });
+        gram(bookFactors, bookGram, run);
+        buildPanels();
+        completed++;
+    }
+
+    // A vector for a reader of books who has none, in out (stride floats)
+    void foldIn(IdSpan books, float *out) const
+    {
+        fill(out, out + stride(), 0.0f);
+        solve(books, bookFactors, bookGram, out);
+    }
+
+    // Write the model to path through a temporary file and rename
+    bool save(const string &path, string &error) const
+    {
+        size_t f = options.factors;
+        vector<float> data;
+        data.reserve((users() + books()) * f);
+        for (size_t user = 0; user < users(); ++user)
+        {
+            data.insert(data.end(), userFactors.row(user), userFactors.row(user) + f);
+        }
+        for (size_t book = 0; book < books(); ++book)
+        {
+            data.insert(data.end(), bookFactors.row(book), bookFactors.row(book) + f);
+        }
+
+        FactorHeader header;
+        memcpy(header.magic, kFactorMagic, sizeof(header.magic));
+        header.formatVersion = kFactorFormatVersion;
+        header.byteOrder = kSnapshotByteOrder;
+        header.userCount = users();
+        header.bookCount = books();
+        header.readCount = trainedReads;
+        header.factors = f;
+        header.iterations = completed;
+        header.regularization = options.regularization;
+        header.alpha = options.alpha;
+        header.dataChecksum = checksumBytes(data.data(), data.size() * sizeof(float));
+        header.headerChecksum = headerChecksum(header);
+
+        string temporary = path + ".tmp";
+        FILE *file = fopen(temporary.c_str(), "wb");
+        if (!file)
+        {
+            error = "Cannot create " + temporary + ": " + strerror(errno);
+            return false;
+        }
+        bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+                  (data.empty() || fwrite(data.data(), sizeof(float), data.size(), file) == data.size()) &&
+                  fflush(file) == 0 && fsync(fileno(file)) == 0;
+        ok = fclose(file) == 0 && ok;
+        if (!ok || rename(temporary.c_str(), path.c_str()) != 0)
+        {
+            error = "Cannot write " + path + ": " + strerror(errno);
+            remove(temporary.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    // Replace the model with a checkpoint written by save()
+    bool load(const string &path, string &error)
+    {
+        MappedFile file;
+        if (!file.open(path, error))
+        {
+            return false;
+        }
+        string_view bytes = file.contents();
+        FactorHeader header;
+        if (bytes.size() < sizeof(header))
+        {
+            error = path + " is not a factor checkpoint";
+            return false;
+        }
+        memcpy(&header, bytes.data(), sizeof(header));
+        if (memcmp(header.magic, kFactorMagic, sizeof(header.magic)) != 0 || header.formatVersion != kFactorFormatVersion ||
+            header.byteOrder != kSnapshotByteOrder || header.headerChecksum != headerChecksum(header))
+        {
+            error = path + " is not a factor checkpoint this build can read";
+            return false;
+        }
+        uint64_t rows = header.userCount + header.bookCount;
+        if (header.factors == 0 || header.factors > kMaxFactors || header.userCount > UINT32_MAX ||
+            header.bookCount > UINT32_MAX || bytes.size() != sizeof(header) + rows * header.factors * sizeof(float))
+        {
+            error = path + " is truncated or malformed";
+            return false;
+        }
+        const char *data = bytes.data() + sizeof(header);
+        if (checksumBytes(data, bytes.size() - sizeof(header)) != header.dataChecksum)
+        {
+            error = path + " is corrupt: checksum mismatch";
+            return false;
+        }
+
+        options = FactorOptions();
+        options.factors = header.factors;
+        options.regularization = header.regularization;
+        options.alpha = header.alpha;
+        size_t rowBytes = header.factors * sizeof(float);
+        userFactors.assign(header.userCount, header.factors);
+        bookFactors.assign(header.bookCount, header.factors);
+        for (size_t user = 0; user < header.userCount; ++user, data += rowBytes)
+        {
+            memcpy(userFactors.row(user), data, rowBytes);
+        }
+        for (size_t book = 0; book < header.bookCount; ++book, data += rowBytes)
+        {
+            memcpy(bookFactors.row(book), data, rowBytes);
+        }
+        completed = header.iterations;
+        trainedReads = header.readCount;
+        bookGram.assign(options.factors * options.factors, 0);
+        addGram(bookFactors, 0, books(), bookGram.data());
+        buildPanels();
+        on = true;
+        return true;
+    }
+};
+
+// Write-ahead event log layout: a header, then one record per mutation,
+// each a uint32_t payload size, the low 32 bits of the payload checksum,
+// and the payload: an EventType byte and its data. Host byte order, as in
+// snapshots. Replaying a record twice is harmless: names intern to the
+// ids they already have and repeated reads are ignored.
+const char kEventLogMagic[8] = {'B', 'K', 'R', 'E', 'V', 'L', 'O', 'G'};
+const uint32_t kEventLogFormatVersion = 1;
+
+enum EventType : uint8_t
+{
+    kEventAddUser = 1, // name
+    kEventAddBook = 2, // title
+    kEventAddRead = 3  // uint32_t user id, uint32_t book id
+};
+
+struct EventLogHeader
+{
+    char magic[8];
+    uint32_t formatVersion = 0;
+    uint32_t byteOrder = 0;
+};
+
+// Durability settings of the event log
+struct EventLogOptions
+{
+    chrono::milliseconds syncInterval{5}; // longest an event waits for its group commit
+    size_t maxBufferedBytes = 64 << 20;   // appends wait for the disk beyond this
+    uint64_t compactBytes = 256 << 20;    // fold the log into a new snapshot past this; 0 = never
+};
+
+// Event log counters since it was opened
+struct EventLogStats
+{
+    uint64_t events = 0;       // appended
+    uint64_t durableEvents = 0;
+    uint64_t commits = 0;      // group commits: one write and one fdatasync each
+    uint64_t fileBytes = 0;    // log size, buffered bytes included
+    double syncSeconds = 0;    // spent in write + fdatasync
+};
+
+// Appends mutations to a log file. Appends only copy into a buffer; a
+// flusher thread writes and fdatasyncs everything buffered as one group
+// commit at most syncInterval after the first event of the group, so the
+// cost of a sync is shared by every event that arrived meanwhile.
+// Appenders may run on several threads but are serialized by the caller
+// when their order matters.
+class EventLog
+{
+private:
+    EventLogOptions options;
+    string path;
+    int fd = -1;
+    thread flusher;
+
+    mutable mutex bufferLock;
+    condition_variable flushNeeded; // wakes the flusher
+    condition_variable flushed;     // wakes appenders and sync() callers
+    string buffer;                  // appended, not written yet
+    string writing;                 // being written by the flusher
+    size_t syncWaiters = 0;
+    bool stopping = false;
+    string failure; // first write error; appends are dropped after it
+    atomic<bool> failed{false}; // failure is set
+    EventLogStats counters;
+
+    // Groups larger than this are committed without waiting out the interval
+    static constexpr size_t kEagerBytes = 1 << 20;
+
+    static bool writeAll(int fd, const string &bytes)
+    {
+        size_t written = 0;
+        while (written < bytes.size())
+        {
+            ssize_t wrote = ::write(fd, bytes.data() + written, bytes.size() - written);
+            if (wrote < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (wrote <= 0)
+            {
+                return false;
+            }
+            written += (size_t)wrote;
+        }
+        return true;
+    }
+
+    void run()
+    {
+        unique_lock<mutex> guard(bufferLock);
+        for (;;)
+        {
+            flushNeeded.wait(guard, [this]
+                             { return stopping || !buffer.empty(); });
+            flushNeeded.wait_for(guard, options.syncInterval, [this]
+                                 { return stopping || syncWaiters > 0 || buffer.size() >= kEagerBytes; });
+            if (buffer.empty())
+            {
+                return; // stopping with nothing left
+            }
+
+            writing.swap(buffer);
+            uint64_t upTo = counters.events;
+            guard.unlock();
+            auto start = chrono::steady_clock::now();
+            bool ok = writeAll(fd, writing) && fdatasync(fd) == 0;
+            string error = ok ? string() : "Cannot write " + path + ": " + strerror(errno);
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            guard.lock();
+
+            if (!ok && failure.empty())
+            {
+                failure = error;
+                failed.store(true, memory_order_release);
+            }
+            counters.durableEvents = ok ? upTo : counters.durableEvents;
+            counters.commits++;
+            counters.syncSeconds += seconds;
+            writing.clear();
+            flushed.notify_all();
+        }
+    }
+
+public:
+    EventLog() = default;
+    EventLog(const EventLog &) = delete;
+    EventLog &operator=(const EventLog &) = delete;
+
+    ~EventLog()
+    {
+        close();
+    }
+
+    bool isOpen() const
+    {
+        return fd >= 0;
+    }
+
+    // Open a log for appending, creating it with a header if needed
+    bool open(const string &logPath, const EventLogOptions &settings, string &error)
+    {
+        close();
+        path = logPath;
+        options = settings;
+        fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        struct stat info;
+        if (fd < 0 || fstat(fd, &info) != 0)
+        {
+            error = "Cannot open " + path + ": " + strerror(errno);
+            close();
+            return false;
+        }
+        counters = EventLogStats();
+        counters.fileBytes = (uint64_t)info.st_size;
+        if (info.st_size == 0)
+        {
+            EventLogHeader header;
+            memcpy(header.magic, kEventLogMagic, sizeof(header.magic));
+            header.formatVersion = kEventLogFormatVersion;
+            header.byteOrder = kSnapshotByteOrder;
+            string bytes((const char *)&header, sizeof(header));
+            if (!writeAll(fd, bytes) || fsync(fd) != 0)
+            {
+                error = "Cannot write " + path + ": " + strerror(errno);
+                close();
+                return false;
+            }
+            counters.fileBytes = sizeof(header);
+        }
+        stopping = false;
+        failure.clear();
+        failed.store(false, memory_order_release);
+        flusher = thread(&EventLog::run, this);
+        return true;
+    }
+
+    // Commit what is buffered and close the file
+    void close()
+    {
+        if (fd < 0)
+        {
+            return;
+        }
+        {
+            lock_guard<mutex> guard(bufferLock);
+            stopping = true;
+        }
+        flushNeeded.notify_one();
+        if (flusher.joinable())
+        {
+            flusher.join();
+        }
+        ::close(fd);
+        fd = -1;
+    }
+
+    // Buffer one event; it is durable after the group commit that takes it.
+    // Waits while maxBufferedBytes are buffered. Returns false, dropping
+    // the event, once a write has failed.
+    bool append(EventType type, const void *data, size_t size)
+    {
+        char payload[1 + 8];
+        uint32_t recordSize = (uint32_t)(1 + size);
+        uint32_t check;
+        if (size + 1 <= sizeof(payload))
+        {
+            payload[0] = (char)type;
+            memcpy(payload + 1, data, size);
+            check = (uint32_t)checksumBytes(payload, recordSize);
+        }
+        else
+        {
+            string joined(1, (char)type);
+            joined.append((const char *)data, size);
+            check = (uint32_t)checksumBytes(joined.data(), joined.size());
+        }
+
+        unique_lock<mutex> guard(bufferLock);
+        flushed.wait(guard, [this]
+                     { return buffer.size() < options.maxBufferedBytes || !failure.empty(); });
+        if (!failure.empty())
+        {
+            return false;
+        }
+        bool wasEmpty = buffer.empty();
+        buffer.append((const char *)&recordSize, sizeof(recordSize));
+        buffer.append((const char *)&check, sizeof(check));
+        buffer.push_back((char)type);
+        buffer.append((const char *)data, size);
+        counters.events++;
+        counters.fileBytes += 2 * sizeof(uint32_t) + recordSize;
+        if (wasEmpty || buffer.size() >= kEagerBytes)
+        {
+            flushNeeded.notify_one();
+        }
+        return true;
+    }
+
+    // True once a write has failed; every later append is dropped
+    bool hasFailed() const
+    {
+        return failed.load(memory_order_acquire);
+    }
+
+    // First write error, or empty
+    string error() const
+    {
+        lock_guard<mutex> guard(bufferLock);
+        return failure;
+    }
+
+    // Wait until every event appended so far is durable; false (with the
+    // error) if the log could not be written
+    bool sync(string &error)
+    {
+        unique_lock<mutex> guard(bufferLock);
+        uint64_t target = counters.events;
+        syncWaiters++;
+        flushNeeded.notify_one();
+        flushed.wait(guard, [this, target]
+                     { return counters.durableEvents >= target || !failure.empty(); });
+        syncWaiters--;
+        error = failure;
+        return failure.empty();
+    }
+
+    EventLogStats stats() const
+    {
+        lock_guard<mutex> guard(bufferLock);
+        return counters;
+    }
+
+    // Call visit(type, data) for every intact record of a log file, in
+    // order. A torn or corrupt tail, as a crash mid-commit leaves, ends the
+    // replay and is cut off so appends continue after the last good record.
+    // A missing file replays nothing.
+    template <typename Visit>
+    static bool replay(const string &logPath, Visit visit, size_t &events, string &error)
+    {
+        events = 0;
+        struct stat info;
+        if (stat(logPath.c_str(), &info) != 0)
+        {
+            if (errno == ENOENT)
+            {
+                return true;
+            }
+            error = "Cannot open " + logPath + ": " + strerror(errno);
+            return false;
+        }
+        MappedFile file;
+        if (!file.open(logPath, error))
+        {
+            return false;
+        }
+        string_view bytes = file.contents();
+        EventLogHeader header;
+        if (bytes.size() < sizeof(header))
+        {
+            return truncate(logPath.c_str(), 0) == 0; // crashed before the header was synced
+        }
+        memcpy(&header, bytes.data(), sizeof(header));
+        if (memcmp(header.magic, kEventLogMagic, sizeof(header.magic)) != 0 ||
+            header.formatVersion != kEventLogFormatVersion || header.byteOrder != kSnapshotByteOrder)
+        {
+            error = logPath + " is not an event log of this format and byte order";
+            return false;
+        }
+
+        size_t position = sizeof(header);
+        while (position + 2 * sizeof(uint32_t) <= bytes.size())
+        {
+            uint32_t recordSize;
+            uint32_t check;
+            memcpy(&recordSize, bytes.data() + position, sizeof(recordSize));
+            memcpy(&check, bytes.data() + position + sizeof(recordSize), sizeof(check));
+            size_t start = position + 2 * sizeof(uint32_t);
+            if (recordSize == 0 || recordSize > bytes.size() - start ||
+                (uint32_t)checksumBytes(bytes.data() + start, recordSize) != check)
+            {
+                break;
+            }
+            visit((EventType)bytes[start], bytes.substr(start + 1, recordSize - 1));
+            events++;
+            position = start + recordSize;
+        }
+        if (position < bytes.size() && truncate(logPath.c_str(), (off_t)position) != 0)
+        {
+            error = "Cannot truncate " + logPath + ": " + strerror(errno);
+            return false;
+        }
+        return true;
+    }
+};
+
+// What openDurable() found and replayed
+struct RecoveryReport
+{
+    bool snapshotLoaded = false;
+    size_t events = 0; // log records replayed
+    double seconds = 0;
+};
+
+// Receives one user's recommended book ids, best first. Batch queries call
+// it concurrently from pool workers, so it must be thread-safe.
+typedef function<void(uint32_t user, IdSpan books)> RecommendationSink;
+
+// One query of a batch whose queries may each use different settings
+struct RecommendRequest
+{
+    uint32_t user = kInvalidId;
+    int k = 2;
+    size_t maxResults = 10;
+    RecommendEngine engine = RecommendEngine::ExactKnn;
+    SimilarityMetric metric = SimilarityMetric::Jaccard;
+};
+
+// Receives the book ids for requests[index]; called concurrently
+typedef function<void(size_t index, IdSpan books)> RequestSink;
+
+// Graph class representing the library book recommendation system
+class BookRecommendationSystem
+{
+private:
+    // Name tables: lookups take namesLock shared, new names take it exclusive
+    StringInterner bookTitles;
+    StringInterner userNames;
+    shared_ptr<const MappedFile> namesBacking; // snapshot file the name tables point into
+    mutable shared_mutex namesLock;
+
+    // Writers (addRead, addUser, addBook, publish) are serialized by
+    // writeLock; queries never take it and run on a published snapshot
+    BipartiteGraph graph;
+    mutex writeLock;
+
+    MinHashIndex minHash;
+    mutable shared_mutex minHashLock;
+
+    CooccurrenceIndex cooccurrence;
+    mutable shared_mutex cooccurrenceLock;
+
+    RandomWalkIndex walkIndex;
+    mutable shared_mutex walkLock;
+
+    FactorModel factors;
+    mutable shared_mutex factorLock;
+
+    mutable NeighborCache neighborCache;
+
+    unique_ptr<WorkStealingPool> pool;
+    vector<QueryScratch> workerScratch; // one per pool worker
+    mutex poolLock;                     // one batch at a time
+
+    // Write-ahead log of every mutation, appended under writeLock, and the
+    // data directory holding it and its snapshot; see openDurable()
+    EventLog eventLog;
+    EventLogOptions logOptions;
+    string dataDirectory;
+    thread compactor;
+    mutex compactorLock;
+    condition_variable compactorWake;
+    bool compactorStopping = false;
+
+    // Users per batch task: large enough to amortize queueing, small enough
+    // for stealing to even out heavy users
+    static constexpr size_t kBatchChunk = 64;
+
+    // Nodes per analytics task; rows are cheaper than queries
+    static constexpr size_t kAnalyticsChunk = 1024;
+
+    // Walk the readers of every book the target has read, accumulating
+    // per-user intersection counts into the scratch buffers
+    void collectOverlaps(const GraphSnapshot &snapshot, uint32_t target, IdSpan targetBooks,
+                         QueryScratch &scratch) const
+    {
+        scratch.overlap.resize(snapshot.users(), 0);
+        scratch.touched.clear();
+        for (uint32_t book : targetBooks)
+        {
+            for (uint32_t reader : snapshot.readers(book))
+            {
+                if (reader != target && scratch.overlap[reader]++ == 0)
+                {
+                    scratch.touched.push_back(reader);
+                }
+            }
+        }
+    }
+
+    // Fill the same scratch buffers by comparing the target against every
+    // user with the bitset kernel. Used for heavy readers whose reader-list
+    // walk would scatter increments over most of the graph anyway.
+    void scanOverlaps(const GraphSnapshot &snapshot, uint32_t target, QueryScratch &scratch) const
+    {
+        scratch.overlap.resize(snapshot.users(), 0);
+        scratch.touched.clear();
+        for (uint32_t user = 0; user < snapshot.users(); ++user)
+        {
+            if (user != target)
+            {
+                size_t common = snapshot.kernel.intersection(target, user);
+                if (common > 0)
+                {
+                    scratch.overlap[user] = (uint32_t)common;
+                    scratch.touched.push_back(user);
+                }
+            }
+        }
+    }
+
+    // Re-rank the target's LSH candidates by exact intersection on the
+    // snapshot. Signatures may already include unpublished reads; exact
+    // re-ranking keeps results consistent with the snapshot regardless.
+    void approximateOverlaps(const GraphSnapshot &snapshot, uint32_t target, QueryScratch &scratch) const
+    {
+        {
+            shared_lock<shared_mutex> guard(minHashLock);
+            minHash.candidates(target, scratch);
+        }
+        scratch.overlap.resize(snapshot.users(), 0);
+        scratch.touched.clear();
+        for (uint32_t user : scratch.candidates)
+        {
+            size_t common = user < snapshot.users() ? snapshot.kernel.intersection(target, user) : 0;
+            if (common > 0)
+            {
+                scratch.overlap[user] = (uint32_t)common;
+                scratch.touched.push_back(user);
+            }
+        }
+    }
+
+    // Pick the cheaper similarity engine for this target
+    void findOverlaps(const GraphSnapshot &snapshot, uint32_t target, IdSpan targetBooks, RecommendEngine engine,
+                      QueryScratch &scratch) const
+    {
+        if (engine == RecommendEngine::MinHashKnn && minHash.enabled())
+        {
+            approximateOverlaps(snapshot, target, scratch);
+            statCount(kStatIntersections, scratch.candidates.size());
+            return;
+        }
+
+        size_t walkCost = 0;
+        for (uint32_t book : targetBooks)
+        {
+            walkCost += snapshot.readers(book).size();
+        }
+
+        if (snapshot.kernel.isDense(target) && walkCost * 2 > snapshot.reads())
+        {
+            scanOverlaps(snapshot, target, scratch);
+            statCount(kStatIntersections, snapshot.users() - 1);
+        }
+        else
+        {
+            collectOverlaps(snapshot, target, targetBooks, scratch);
+            statCount(kStatReaderVisits, walkCost);
+        }
+    }
+
+    // Scratch for the single-query API, one per calling thread
+    static QueryScratch &threadScratch()
+    {
+        static thread_local QueryScratch scratch;
+        return scratch;
+    }
+
+    // One query on the latest snapshot and this thread's scratch
+    IdSpan recommendIdsUntimed(uint32_t target, int k, size_t maxResults, RecommendEngine engine,
+                               SimilarityMetric metric) const
+    {
+        shared_ptr<const GraphSnapshot> current = snapshot();
+        QueryScratch &scratch = threadScratch();
+        recommendIds(*current, target, k, maxResults, engine, metric, scratch);
+        return IdSpan{scratch.results.data(), scratch.results.size()};
+    }
+
+    // Invalidate the neighbor cache, publish the delta and refresh the
+    // incremental indexes; callers hold writeLock
+    bool publishLocked()
+    {
+        neighborCache.stamp(graph.current(), [this](auto visit)
+                            { graph.forEachPending(visit); });
+        vector<uint32_t> walkers; // users whose walk segments are now stale
+        if (walkIndex.enabled())
+        {
+            graph.forEachPending([&walkers](uint32_t user, uint32_t)
+                                 { walkers.push_back(user); });
+        }
+        bool published = graph.publish();
+        if (minHash.enabled())
+        {
+            unique_lock<shared_mutex> guard(minHashLock);
+            minHash.refreshBuckets();
+        }
+        if (cooccurrence.enabled())
+        {
+            unique_lock<shared_mutex> guard(cooccurrenceLock);
+            cooccurrence.refreshNeighbors();
+        }
+        if (walkIndex.enabled() && published)
+        {
+            shared_ptr<const GraphSnapshot> current = graph.snapshot();
+            sort(walkers.begin(), walkers.end());
+            walkers.erase(unique(walkers.begin(), walkers.end()), walkers.end());
+            unique_lock<shared_mutex> walks(walkLock);
+            walkIndex.resize(current->users());
+            for (uint32_t user : walkers)
+            {
+                walkIndex.draw(*current, user);
+            }
+        }
+        return published;
+    }
+
+    // Draw every user's walk segments on the snapshot in parallel and swap
+    // them in. The new index is built without walkLock, which queries on
+    // the pool may be waiting for.
+    void drawAllWalks(const GraphSnapshot &snapshot, const RandomWalkOptions &options)
+    {
+        RandomWalkIndex fresh;
+        fresh.configure(options);
+        fresh.resize(snapshot.users());
+        runChunks(snapshot.users(), kAnalyticsChunk, [&fresh, &snapshot](size_t begin, size_t end, size_t)
+                  {
+                      for (size_t user = begin; user < end; ++user)
+                      {
+                          fresh.draw(snapshot, (uint32_t)user);
+                      }
+                  });
+        unique_lock<shared_mutex> walks(walkLock);
+        swap(walkIndex, fresh);
+    }
+
+    // findOverlaps for weighted metrics: also sum the idf of the shared
+    // books. LSH candidates are intersected by merging rows; everyone else
+    // is reached through the reader lists, heavy readers included, since
+    // the bitset kernel only counts.
+    void findWeightedOverlaps(const GraphSnapshot &snapshot, uint32_t target, IdSpan targetBooks,
+                              RecommendEngine engine, QueryScratch &scratch) const
+    {
+        const double *idf = snapshot.bookIdf();
+        scratch.overlap.resize(snapshot.users(), 0);
+        scratch.weightedOverlap.resize(snapshot.users(), 0);
+        scratch.touched.clear();
+        if (engine == RecommendEngine::MinHashKnn && minHash.enabled())
+        {
+            {
+                shared_lock<shared_mutex> guard(minHashLock);
+                minHash.candidates(target, scratch);
+            }
+            for (uint32_t user : scratch.candidates)
+            {
+                IdSpan books = snapshot.booksRead(user);
+                const uint32_t *i = targetBooks.begin();
+                const uint32_t *j = books.begin();
+                uint32_t common = 0;
+                double weight = 0;
+                while (i != targetBooks.end() && j != books.end())
+                {
+                    if (*i == *j)
+                    {
+                        common++;
+                        weight += idf[*i];
+                    }
+                    uint32_t a = *i;
+                    uint32_t b = *j;
+                    i += a <= b;
+                    j += b <= a;
+                }
+                if (common > 0)
+                {
+                    scratch.overlap[user] = common;
+                    scratch.weightedOverlap[user] = weight;
+                    scratch.touched.push_back(user);
+                }
+            }
+            statCount(kStatIntersections, scratch.candidates.size());
+            return;
+        }
+
+        for (uint32_t book : targetBooks)
+        {
+            double weight = idf[book];
+            IdSpan readers = snapshot.readers(book);
+            for (uint32_t reader : readers)
+            {
+                if (reader == target)
+                {
+                    continue;
+                }
+                if (scratch.overlap[reader]++ == 0)
+                {
+                    scratch.touched.push_back(reader);
+                }
+                scratch.weightedOverlap[reader] += weight;
+            }
+            statCount(kStatReaderVisits, readers.size());
+        }
+    }
+
+    // The k users most similar to a reader of userBooks under the
+    // Similarity policy, best first; valid until the scratch is reused.
+    // target is that reader, excluded from the results, or kInvalidId for
+    // a reader held elsewhere (see nearestToBooks). One instantiation per
+    // metric, so the scoring loop has no metric branches.
+    template <typename Similarity>
+    const vector<TopKSelector<double>::Entry> &nearestNeighborsBy(const GraphSnapshot &snapshot, uint32_t target,
+                                                                 IdSpan userBooks, int k, RecommendEngine engine,
+                                                                 QueryScratch &scratch) const
+    {
+        PhaseTimer timer;
+
+        // Candidate generation: only users sharing a book with the target are
+        // reached, with their overlap counted while walking each book's readers
+        // (or, for heavy readers, by the bitset kernel)
+        if constexpr (Similarity::kWeighted)
+        {
+            findWeightedOverlaps(snapshot, target, userBooks, engine, scratch);
+        }
+        else
+        {
+            findOverlaps(snapshot, target, userBooks, engine, scratch);
+        }
+        timer.lap(kPhaseSimilarity);
+        statCount(kStatCandidateUsers, scratch.touched.size());
+
+        // Keep the k most similar candidates
+        scratch.nearestUsers.reset(max(k, 0));
+        if constexpr (Similarity::kWeighted)
+        {
+            const double *userWeight = snapshot.userIdfWeight();
+            double targetWeight = target < snapshot.users() ? userWeight[target] : 0;
+            for (uint32_t user : scratch.touched)
+            {
+                scratch.nearestUsers.push(Similarity::score(scratch.weightedOverlap[user], targetWeight, userWeight[user]), user);
+                scratch.overlap[user] = 0;
+                scratch.weightedOverlap[user] = 0;
+            }
+        }
+        else
+        {
+            double targetSize = userBooks.size();
+            for (uint32_t user : scratch.touched)
+            {
+                scratch.nearestUsers.push(Similarity::score(scratch.overlap[user], targetSize, snapshot.booksRead(user).size()), user);
+                scratch.overlap[user] = 0;
+            }
+        }
+        const auto &nearest = scratch.nearestUsers.sorted();
+        timer.lap(kPhaseUserSelect);
+        return nearest;
+    }
+
+    // nearestNeighborsBy for a metric chosen at run time
+    const vector<TopKSelector<double>::Entry> &nearestNeighbors(const GraphSnapshot &snapshot, uint32_t target,
+                                                               IdSpan userBooks, int k, RecommendEngine engine,
+                                                               SimilarityMetric metric, QueryScratch &scratch) const
+    {
+        switch (metric)
+        {
+        case SimilarityMetric::Cosine:
+            return nearestNeighborsBy<CosineSimilarity>(snapshot, target, userBooks, k, engine, scratch);
+        case SimilarityMetric::Overlap:
+            return nearestNeighborsBy<OverlapSimilarity>(snapshot, target, userBooks, k, engine, scratch);
+        case SimilarityMetric::IdfJaccard:
+            return nearestNeighborsBy<IdfJaccardSimilarity>(snapshot, target, userBooks, k, engine, scratch);
+        default:
+            return nearestNeighborsBy<JaccardSimilarity>(snapshot, target, userBooks, k, engine, scratch);
+        }
+    }
+
+    // Item-based recommendation: score every neighbor of the target's
+    // books by summed similarity. Touches maxNeighbors entries per book
+    // read, however many users the library has.
+    void itemBasedIds(const GraphSnapshot &snapshot, uint32_t target, size_t maxResults, QueryScratch &scratch) const
+    {
+        IdSpan userBooks = snapshot.booksRead(target);
+        scratch.bookScores.resize(snapshot.books(), 0);
+        scratch.votedBooks.clear();
+        {
+            shared_lock<shared_mutex> guard(cooccurrenceLock);
+            for (uint32_t book : userBooks)
+            {
+                for (const BookNeighbor &neighbor : cooccurrence.neighbors(book))
+                {
+                    if (neighbor.book < snapshot.books() && !userBooks.contains(neighbor.book))
+                    {
+                        if (scratch.bookScores[neighbor.book] == 0)
+                        {
+                            scratch.votedBooks.push_back(neighbor.book);
+                        }
+                        scratch.bookScores[neighbor.book] += neighbor.score;
+                    }
+                }
+            }
+        }
+
+        scratch.scoredBooks.reset(maxResults);
+        for (uint32_t book : scratch.votedBooks)
+        {
+            scratch.scoredBooks.push(scratch.bookScores[book], book);
+            scratch.bookScores[book] = 0;
+        }
+
+        scratch.results.clear();
+        for (const auto &entry : scratch.scoredBooks.sorted())
+        {
+            scratch.results.push_back(entry.second);
+        }
+    }
+
+    // Personalized PageRank: rank the unread books by how often random
+    // walks restarting at the target visit them. Walks follow the stored
+    // segments, each at most once per query so the walks stay independent;
+    // once a user's segments are spent, and for users newer than the
+    // segments, walks step through the adjacency directly. The walks are
+    // seeded by the target, so a query is repeatable on the same snapshot.
+    void walkIds(const GraphSnapshot &snapshot, uint32_t target, size_t maxResults, QueryScratch &scratch) const
+    {
+        IdSpan userBooks = snapshot.booksRead(target);
+        PhaseTimer timer;
+        scratch.bookVotes.resize(snapshot.books(), 0);
+        scratch.votedBooks.clear();
+        scratch.overlap.resize(snapshot.users(), 0);
+        scratch.touched.clear();
+        size_t taken = 0;
+        {
+            shared_lock<shared_mutex> guard(walkLock);
+            const RandomWalkOptions &options = walkIndex.settings();
+            uint64_t restartBelow = options.restart >= 1 ? UINT64_MAX : (uint64_t)(options.restart * 0x1p64);
+            uint64_t state = options.seed ^ ((uint64_t)target * 0x9e3779b97f4a7c15ULL);
+            for (size_t walk = 0; walk < options.walksPerQuery && !userBooks.empty(); ++walk)
+            {
+                uint32_t at = target;
+                const uint32_t *segment = nullptr;
+                size_t position = options.segmentLength;
+                for (size_t step = 0; step < options.maxSteps; ++step)
+                {
+                    // One step from at: a book it read and a reader of that book
+                    uint32_t book;
+                    if (position == options.segmentLength)
+                    {
+                        // The user's next unspent segment, if any
+                        segment = nullptr;
+                        if (at < scratch.overlap.size() && scratch.overlap[at] < options.segmentsPerUser)
+                        {
+                            if (scratch.overlap[at] == 0)
+                            {
+                                scratch.touched.push_back(at);
+                            }
+                            segment = walkIndex.segment(at, scratch.overlap[at]++);
+                        }
+                        position = 0;
+                    }
+                    if (segment)
+                    {
+                        book = segment[2 * position];
+                        at = segment[2 * position + 1];
+                        position++;
+                    }
+                    else
+                    {
+                        IdSpan books = snapshot.booksRead(at);
+                        book = books.empty() ? kInvalidId : books[RandomWalkIndex::next(state) % books.size()];
+                        IdSpan readers = snapshot.readers(book);
+                        at = readers.empty() ? kInvalidId : readers[RandomWalkIndex::next(state) % readers.size()];
+                        position = options.segmentLength;
+                    }
+                    if (book == kInvalidId || book >= snapshot.books())
+                    {
+                        break;
+                    }
+                    taken++;
+                    if (!userBooks.contains(book) && scratch.bookVotes[book]++ == 0)
+                    {
+                        scratch.votedBooks.push_back(book);
+                    }
+                    if (RandomWalkIndex::next(state) < restartBelow)
+                    {
+                        break;
+                    }
+                }
+            }
+        }
+        for (uint32_t user : scratch.touched)
+        {
+            scratch.overlap[user] = 0;
+        }
+        timer.lap(kPhaseWalk);
+        statCount(kStatWalkSteps, taken);
+        statCount(kStatCandidateBooks, scratch.votedBooks.size());
+
+        // Keep the maxResults most visited books
+        scratch.topBooks.reset(maxResults);
+        for (uint32_t book : scratch.votedBooks)
+        {
+            scratch.topBooks.push(scratch.bookVotes[book], book);
+            scratch.bookVotes[book] = 0;
+        }
+
+        scratch.results.clear();
+        for (const auto &entry : scratch.topBooks.sorted())
+        {
+            scratch.results.push_back(entry.second);
+        }
+        timer.lap(kPhaseBookSelect);
+    }
+
+    // Embedding recommendation: score every book the model has by the dot
+    // product of its vector with the target's, in one vectorized scan over
+    // the book panels, and keep the best unread ones. Users without reads
+    // get nothing.
+    void embeddingIds(const GraphSnapshot &snapshot, uint32_t target, size_t maxResults, QueryScratch &scratch) const
+    {
+        IdSpan userBooks = snapshot.booksRead(target);
+        PhaseTimer timer;
+        shared_lock<shared_mutex> guard(factorLock);
+        size_t books = userBooks.empty() ? 0 : min(factors.books(), snapshot.books());
+        const float *query = factors.userVector(target);
+        if (!query && books > 0)
+        {
+            scratch.foldedUser.resize(factors.stride());
+            factors.foldIn(userBooks, scratch.foldedUser.data());
+            query = scratch.foldedUser.data();
+        }
+        size_t panels = (books + 15) / 16;
+        scratch.bookDots.resize(panels * 16);
+        dotPanels(query, factors.panels(), panels, factors.settings().factors, scratch.bookDots.data());
+        timer.lap(kPhaseEmbedding);
+        statCount(kStatCandidateBooks, books);
+
+        // Keep the maxResults best scores, stepping over the books read
+        scratch.scoredBooks.reset(maxResults);
+        const uint32_t *read = userBooks.begin();
+        for (uint32_t book = 0; book < books; ++book)
+        {
+            if (read != userBooks.end() && *read == book)
+            {
+                read++;
+                continue;
+            }
+            scratch.scoredBooks.push(scratch.bookDots[book], book);
+        }
+
+        scratch.results.clear();
+        for (const auto &entry : scratch.scoredBooks.sorted())
+        {
+            scratch.results.push_back(entry.second);
+        }
+        timer.lap(kPhaseBookSelect);
+    }
+
+    // nearestNeighbors for exact Jaccard kNN, served from the neighbor
+    // cache when its entry for the target is still exact
+    const vector<NeighborCache::Neighbor> &cachedNeighbors(const GraphSnapshot &snapshot, uint32_t target, int k,
+                                                           RecommendEngine engine, SimilarityMetric metric,
+                                                           QueryScratch &scratch) const
+    {
+        if (engine != RecommendEngine::ExactKnn || metric != SimilarityMetric::Jaccard || k <= 0)
+        {
+            return nearestNeighbors(snapshot, target, snapshot.booksRead(target), k, engine, metric, scratch);
+        }
+        if (neighborCache.lookup(snapshot, target, k, scratch.cachedNeighbors))
+        {
+            return scratch.cachedNeighbors;
+        }
+        IdSpan userBooks = snapshot.booksRead(target);
+        const auto &neighbors = nearestNeighborsBy<JaccardSimilarity>(snapshot, target, userBooks, k, engine, scratch);
+        neighborCache.store(snapshot, target, k, neighbors);
+        return neighbors;
+    }
+
+    // Ids of the books recommended to the target, best first, in
+    // scratch.results
+    void recommendIds(const GraphSnapshot &snapshot, uint32_t target, int k, size_t maxResults,
+                      RecommendEngine engine, SimilarityMetric metric, QueryScratch &scratch) const
+    {
+        size_t reserved = scratch.capacity();
+        statCount(kStatQueries);
+        if (engine == RecommendEngine::ItemBased && cooccurrence.enabled())
+        {
+            itemBasedIds(snapshot, target, maxResults, scratch);
+        }
+        else if (engine == RecommendEngine::RandomWalk && walkIndex.enabled())
+        {
+            walkIds(snapshot, target, maxResults, scratch);
+        }
+        else if (engine == RecommendEngine::Embedding && factors.enabled())
+        {
+            embeddingIds(snapshot, target, maxResults, scratch);
+        }
+        else
+        {
+            knnIds(snapshot, target, k, maxResults, engine, metric, scratch);
+        }
+        if (scratch.capacity() != reserved)
+        {
+            statCount(kStatScratchGrowths);
+        }
+    }
+
+    // recommendIds for the neighbor-based engines
+    void knnIds(const GraphSnapshot &snapshot, uint32_t target, int k, size_t maxResults, RecommendEngine engine,
+                SimilarityMetric metric, QueryScratch &scratch) const
+    {
+        IdSpan userBooks = snapshot.booksRead(target);
+        const auto &neighbors = cachedNeighbors(snapshot, target, k, engine, metric, scratch);
+        PhaseTimer timer;
+
+        // Count books read by the similar users but not by the target user
+        scratch.bookVotes.resize(snapshot.books(), 0);
+        scratch.votedBooks.clear();
+        for (const auto &neighbor : neighbors)
+        {
+            for (uint32_t book : snapshot.booksRead(neighbor.second))
+            {
+                if (!userBooks.contains(book) && scratch.bookVotes[book]++ == 0)
+                {
+                    scratch.votedBooks.push_back(book);
+                }
+            }
+        }
+
+        timer.lap(kPhaseBookCount);
+        statCount(kStatCandidateBooks, scratch.votedBooks.size());
+
+        // Keep the maxResults most recommended books
+        scratch.topBooks.reset(maxResults);
+        for (uint32_t book : scratch.votedBooks)
+        {
+            scratch.topBooks.push(scratch.bookVotes[book], book);
+            scratch.bookVotes[book] = 0;
+        }
+
+        scratch.results.clear();
+        for (const auto &entry : scratch.topBooks.sorted())
+        {
+            scratch.results.push_back(entry.second);
+        }
+        timer.lap(kPhaseBookSelect);
+    }
+
+    // Run body(begin, end, worker) on the pool for every chunk-sized range
+    // of [0, count) and wait for all of them
+    template <typename Body>
+    void runChunks(size_t count, size_t chunk, const Body &body)
+    {
+        lock_guard<mutex> guard(poolLock);
+        ensurePoolLocked();
+
+        vector<WorkStealingPool::Task> tasks;
+        tasks.reserve((count + chunk - 1) / chunk);
+        for (size_t begin = 0; begin < count; begin += chunk)
+        {
+            size_t end = min(count, begin + chunk);
+            tasks.emplace_back([&body, begin, end](size_t worker)
+                               { body(begin, end, worker); });
+        }
+        pool->runAll(tasks);
+    }
+
+    // Create the default pool, one thread per core, unless one was sized;
+    // callers hold poolLock
+    void ensurePoolLocked()
+    {
+        if (!pool)
+        {
+            resizePool(thread::hardware_concurrency());
+        }
+    }
+
+    // Threads the batch APIs fan out to
+    size_t workerCount()
+    {
+        lock_guard<mutex> guard(poolLock);
+        ensurePoolLocked();
+        return pool->size();
+    }
+
+    // Run recommendIds for count users on the pool, chunk by chunk. The
+    // whole batch runs against one snapshot.
+    template <typename UserAt>
+    void runBatch(const shared_ptr<const GraphSnapshot> &snapshot, size_t count, UserAt userAt, int k,
+                  size_t maxResults, RecommendEngine engine, const RecommendationSink &sink)
+    {
+        const GraphSnapshot *graphView = snapshot.get();
+        runChunks(count, kBatchChunk, [this, graphView, userAt, k, maxResults, engine, &sink](size_t begin, size_t end, size_t worker)
+                  {
+                      QueryScratch &local = workerScratch[worker];
+                      for (size_t i = begin; i < end; ++i)
+                      {
+                          uint32_t user = userAt(i);
+                          recommendIds(*graphView, user, k, maxResults, engine, SimilarityMetric::Jaccard, local);
+                          sink(user, IdSpan{local.results.data(), local.results.size()});
+                      }
+                  });
+    }
+
+    // Weighted projection of the nodes of forward onto each other through
+    // the middle nodes they share. Rows are built in parallel, each by
+    // counting its 2-hop neighbors in the worker's scratch like a kNN
+    // query does, and then stitched together in order.
+    WeightedProjection project(const CsrAdjacency &forward, const CsrAdjacency &backward, const ProjectionOptions &options)
+    {
+        auto start = chrono::steady_clock::now();
+        WeightedProjection projection;
+        size_t nodes = forward.nodeCount();
+
+        struct Piece
+        {
+            vector<uint64_t> lengths;
+            vector<uint32_t> neighbors;
+            vector<uint32_t> weights;
+            size_t cut = 0;
+        };
+        vector<Piece> pieces((nodes + kAnalyticsChunk - 1) / kAnalyticsChunk);
+        runChunks(nodes, kAnalyticsChunk, [this, &forward, &backward, &options, &pieces, nodes](size_t begin, size_t end, size_t worker)
+                  {
+                      QueryScratch &local = workerScratch[worker];
+                      Piece &piece = pieces[begin / kAnalyticsChunk];
+                      local.overlap.resize(max(local.overlap.size(), nodes), 0);
+                      for (size_t node = begin; node < end; ++node)
+                      {
+                          local.touched.clear();
+                          for (uint32_t middle : forward.row((uint32_t)node))
+                          {
+                              IdSpan others = backward.row(middle);
+                              if (others.size() > options.maxDegree)
+                              {
+                                  continue;
+                              }
+                              for (uint32_t other : others)
+                              {
+                                  if (other != node && local.overlap[other]++ == 0)
+                                  {
+                                      local.touched.push_back(other);
+                                  }
+                              }
+                          }
+
+                          // Keep the heaviest pairs when the row is too long
+                          if (options.maxNeighbors > 0 && local.touched.size() > options.maxNeighbors)
+                          {
+                              piece.cut++;
+                              local.topBooks.reset(options.maxNeighbors);
+                              for (uint32_t other : local.touched)
+                              {
+                                  local.topBooks.push(local.overlap[other], other);
+                              }
+                              for (uint32_t other : local.touched)
+                              {
+                                  local.overlap[other] = 0;
+                              }
+                              local.touched.clear();
+                              for (const auto &entry : local.topBooks.sorted())
+                              {
+                                  local.overlap[entry.second] = entry.first;
+                                  local.touched.push_back(entry.second);
+                              }
+                          }
+
+                          sort(local.touched.begin(), local.touched.end());
+                          size_t kept = 0;
+                          for (uint32_t other : local.touched)
+                          {
+                              if (local.overlap[other] >= options.minWeight)
+                              {
+                                  piece.neighbors.push_back(other);
+                                  piece.weights.push_back(local.overlap[other]);
+                                  kept++;
+                              }
+                              local.overlap[other] = 0;
+                          }
+                          piece.lengths.push_back(kept);
+                      }
+                  });
+
+        size_t edges = 0;
+        for (const Piece &piece : pieces)
+        {
+            edges += piece.neighbors.size();
+        }
+        projection.offsets.reserve(nodes + 1);
+        projection.neighbors.reserve(edges);
+        projection.weights.reserve(edges);
+        for (Piece &piece : pieces)
+        {
+            for (uint64_t length : piece.lengths)
+            {
+                projection.offsets.push_back(projection.offsets.back() + length);
+            }
+            projection.neighbors.insert(projection.neighbors.end(), piece.neighbors.begin(), piece.neighbors.end());
+            projection.weights.insert(projection.weights.end(), piece.weights.begin(), piece.weights.end());
+            projection.cutRows += piece.cut;
+            piece = Piece();
+        }
+
+        for (uint32_t middle = 0; middle < backward.nodeCount(); ++middle)
+        {
+            projection.skippedHubs += backward.row(middle).size() > options.maxDegree;
+        }
+        projection.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        return projection;
+    }
+
+    void resizePool(size_t threads)
+    {
+        pool.reset();
+        pool.reset(new WorkStealingPool(max<size_t>(1, threads)));
+        workerScratch.clear();
+        workerScratch.resize(pool->size());
+    }
+
+    // Append a mutation to the event log, if there is one; false if the
+    // log has failed. Callers hold writeLock so the log order is the order
+    // ids were assigned in.
+    bool logName(EventType type, string_view name)
+    {
+        return !eventLog.isOpen() || eventLog.append(type, name.data(), name.size());
+    }
+
+    bool logRead(uint32_t user, uint32_t book)
+    {
+        uint32_t ids[2] = {user, book};
+        return !eventLog.isOpen() || eventLog.append(kEventAddRead, ids, sizeof(ids));
+    }
+
+    // Mutations are refused once the event log has failed, so memory does
+    // not run ahead of what a restart recovers
+    bool logFailed() const
+    {
+        return eventLog.isOpen() && eventLog.hasFailed();
+    }
+
+    // Logged before it is applied, so a read the log drops is not
+    // recorded. Callers hold writeLock.
+    bool addReadLocked(uint32_t user, uint32_t book)
+    {
+        if (logFailed() || graph.hasRead(user, book) || !logRead(user, book))
+        {
+            return false;
+        }
+        graph.addRead(user, book);
+        if (minHash.enabled())
+        {
+            unique_lock<shared_mutex> signatures(minHashLock);
+            minHash.addRead(user, book);
+        }
+        if (cooccurrence.enabled())
+        {
+            IdSpan buffered = graph.pendingReads(user); // ends with this read
+            unique_lock<shared_mutex> counts(cooccurrenceLock);
+            cooccurrence.addRead(book, graph.current().booksRead(user), IdSpan{buffered.first, buffered.size() - 1});
+        }
+        if (graph.publishDue())
+        {
+            publishLocked();
+        }
+        return true;
+    }
+
+    // Publish a batch of (user, book) reads, in any order and possibly
+    // repeated or already recorded, as one snapshot and bring the indexes
+    // up to date; returns how many were new. Only the new reads are
+    // logged, before anything is published; once the event log fails the
+    // rest of the batch is dropped. Callers hold writeLock.
+    size_t publishBatchLocked(vector<pair<uint32_t, uint32_t>> &edges)
+    {
+        if (logFailed())
+        {
+            return 0;
+        }
+        // Buffered reads are already counted by the co-occurrence index
+        if (cooccurrence.enabled() && graph.pending() > 0)
+        {
+            publishLocked();
+        }
+
+        // Reads already recorded, published or buffered, were logged when
+        // they arrived; publishReads folds the buffered ones back in
+        if (eventLog.isOpen())
+        {
+            BipartiteGraph::sortEdges(edges, graph.users());
+            size_t kept = 0;
+            for (const auto &edge : edges)
+            {
+                if (graph.hasRead(edge.first, edge.second))
+                {
+                    continue;
+                }
+                if (!logRead(edge.first, edge.second))
+                {
+                    break;
+                }
+                edges[kept++] = edge;
+            }
+            edges.resize(kept);
+        }
+        shared_ptr<const GraphSnapshot> previous = graph.snapshot();
+        neighborCache.stamp(*previous, [this, &edges](auto visit)
+                            {
+                                graph.forEachPending(visit);
+                                for (const auto &edge : edges)
+                                {
+                                    visit(edge.first, edge.second);
+                                }
+                            });
+        size_t added = graph.publishReads(edges);
+        if (minHash.enabled())
+        {
+            unique_lock<shared_mutex> signatures(minHashLock);
+            for (const auto &edge : edges)
+            {
+                minHash.addRead(edge.first, edge.second);
+            }
+            minHash.refreshBuckets();
+        }
+        if (cooccurrence.enabled())
+        {
+            // Pair each touched user's new books with the books they had
+            // before and with the new ones before them
+            shared_ptr<const GraphSnapshot> current = graph.snapshot();
+            unique_lock<shared_mutex> counts(cooccurrenceLock);
+            vector<uint8_t> touched(current->users(), 0);
+            vector<uint32_t> fresh;
+            for (const auto &edge : edges)
+            {
+                touched[edge.first] = 1;
+            }
+            for (uint32_t user = 0; user < current->users(); ++user)
+            {
+                if (!touched[user])
+                {
+                    continue;
+                }
+                IdSpan before = previous->booksRead(user);
+                IdSpan after = current->booksRead(user);
+                fresh.clear();
+                set_difference(after.begin(), after.end(), before.begin(), before.end(), back_inserter(fresh));
+                for (size_t j = 0; j < fresh.size(); ++j)
+                {
+                    cooccurrence.addRead(fresh[j], before, IdSpan{fresh.data(), j});
+                }
+            }
+            cooccurrence.refreshNeighbors();
+        }
+        if (walkIndex.enabled())
+        {
+            drawAllWalks(*graph.snapshot(), walkIndex.settings());
+        }
+        return added;
+    }
+
+    // Shared body of loadUsers and loadBooks
+    LoadReport loadNames(const string &path, const LoadOptions &options, StringInterner &table)
+    {
+        ApiTimer timer(kApiLoad);
+        auto start = chrono::steady_clock::now();
+        LoadReport report;
+        MappedFile file;
+        string error;
+        if (!file.open(path, error))
+        {
+            report.errors.push_back({0, error});
+            return report;
+        }
+
+        string_view text = file.contents();
+        string_view line;
+        size_t lineNumber = 0;
+        lock_guard<mutex> guard(writeLock);
+        if (logFailed())
+        {
+            report.errors.push_back({0, logError()});
+            return report;
+        }
+        {
+            unique_lock<shared_mutex> names(namesLock);
+            while (nextLine(text, line))
+            {
+                lineNumber++;
+                if (line.empty() || (options.hasHeader && lineNumber == 1))
+                {
+                    continue;
+                }
+                report.rows++;
+
+                string_view name = line.substr(0, line.find(options.delimiter));
+                if (name.empty())
+                {
+                    report.reject(lineNumber, "Empty name.", options.maxErrors);
+                    continue;
+                }
+                bool inserted;
+                table.intern(name, inserted);
+                if (inserted && !logName(&table == &userNames ? kEventAddUser : kEventAddBook, name))
+                {
+                    report.errors.push_back({lineNumber, logError()});
+                    break;
+                }
+                if (inserted)
+                {
+                    report.loaded++;
+                }
+                else
+                {
+                    report.duplicates++;
+                }
+            }
+            graph.resize(userNames.size(), bookTitles.size());
+        }
+
+        report.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        return report;
+    }
+
+    // Offsets and blob of an interner's names, as stored in snapshots
+    static void flattenNames(const StringInterner &table, vector<uint64_t> &offsets, string &blob)
+    {
+        offsets.assign(1, 0);
+        blob.clear();
+        for (uint32_t id = 0; id < table.size(); ++id)
+        {
+            blob.append(table.name(id));
+            offsets.push_back(blob.size());
+        }
+    }
+
+public:
+    // Add a new book to the graph
+    void addBook(const string &title)
+    {
+        lock_guard<mutex> guard(writeLock);
+        if (logFailed())
+        {
+            cout << logError() << endl;
+            return;
+        }
+        bool inserted;
+        {
+            unique_lock<shared_mutex> names(namesLock);
+            bookTitles.intern(title, inserted);
+        }
+        if (inserted)
+        {
+            graph.resize(userNames.size(), bookTitles.size());
+            if (!logName(kEventAddBook, title))
+            {
+                cout << logError() << endl;
+            }
+        }
+        else
+        {
+            cout << "Book already exists." << endl;
+        }
+    }
+
+    // Add a new user to the graph
+    void addUser(const string &userName)
+    {
+        lock_guard<mutex> guard(writeLock);
+        if (logFailed())
+        {
+            cout << logError() << endl;
+            return;
+        }
+        bool inserted;
+        {
+            unique_lock<shared_mutex> names(namesLock);
+            userNames.intern(userName, inserted);
+        }
+        if (inserted)
+        {
+            graph.resize(userNames.size(), bookTitles.size());
+            cout << (logName(kEventAddUser, userName) ? "User added successfully." : logError()) << endl;
+        }
+        else
+        {
+            cout << "User already exists." << endl;
+        }
+    }
+
+    // Record that a user has read a book
+    void addRead(const string &userName, const string &title)
+    {
+        ApiTimer timer(kApiAddRead);
+        lock_guard<mutex> guard(writeLock);
+        uint32_t user = userId(userName);
+        uint32_t book = bookId(title);
+        if (user == kInvalidId || book == kInvalidId)
+        {
+            cout << "User or book not found." << endl;
+        }
+        else if (!addReadLocked(user, book) && logFailed())
+        {
+            cout << logError() << endl;
+        }
+    }
+
+    // Id-level ingest for bulk paths: no console messages, returns the id,
+    // or kInvalidId if the name could not be logged (see logError())
+    uint32_t internUser(string_view userName)
+    {
+        lock_guard<mutex> guard(writeLock);
+        if (logFailed())
+        {
+            return kInvalidId;
+        }
+        bool inserted;
+        uint32_t user;
+        {
+            unique_lock<shared_mutex> names(namesLock);
+            user = userNames.intern(userName, inserted);
+        }
+        graph.resize(user + 1, 0);
+        return !inserted || logName(kEventAddUser, userName) ? user : kInvalidId;
+    }
+
+    uint32_t internBook(string_view title)
+    {
+        lock_guard<mutex> guard(writeLock);
+        if (logFailed())
+        {
+            return kInvalidId;
+        }
+        bool inserted;
+        uint32_t book;
+        {
+            unique_lock<shared_mutex> names(namesLock);
+            book = bookTitles.intern(title, inserted);
+        }
+        graph.resize(0, book + 1);
+        return !inserted || logName(kEventAddBook, title) ? book : kInvalidId;
+    }
+
+    // Returns false if the read was already recorded, or could not be
+    // logged (see logError())
+    bool addReadIds(uint32_t user, uint32_t book)
+    {
+        ApiTimer timer(kApiAddRead);
+        lock_guard<mutex> guard(writeLock);
+        return addReadLocked(user, book);
+    }
+
+    // Id-level bulk ingest: publish a batch of reads of interned users and
+    // books as one snapshot, as loadReads does; returns how many were new,
+    // 0 if the event log has failed (see logError())
+    size_t addReadsIds(vector<pair<uint32_t, uint32_t>> &edges)
+    {
+        ApiTimer timer(kApiLoad);
+        lock_guard<mutex> guard(writeLock);
+        return publishBatchLocked(edges);
+    }
+
+    // Make every read recorded so far visible to queries. Reads also become
+    // visible on their own once enough are buffered or the oldest buffered
+    // read is older than setMaxStaleness().
+    void publish()
+    {
+        ApiTimer timer(kApiPublish);
+        lock_guard<mutex> guard(writeLock);
+        publishLocked();
+    }
+
+    void setMaxStaleness(chrono::milliseconds staleness)
+    {
+        lock_guard<mutex> guard(writeLock);
+        graph.setMaxStaleness(staleness);
+    }
+
+    // The snapshot queries currently run against
+    shared_ptr<const GraphSnapshot> snapshot() const
+    {
+        return graph.snapshot();
+    }
+
+    uint32_t userId(string_view userName) const
+    {
+        shared_lock<shared_mutex> names(namesLock);
+        return userNames.find(userName);
+    }
+
+    uint32_t bookId(string_view title) const
+    {
+        shared_lock<shared_mutex> names(namesLock);
+        return bookTitles.find(title);
+    }
+
+    // Interned strings never move, so the view stays valid until the
+    // system is replaced by openSnapshot()
+    string_view userName(uint32_t user) const
+    {
+        shared_lock<shared_mutex> names(namesLock);
+        return userNames.name(user);
+    }
+
+    string_view bookTitle(uint32_t book) const
+    {
+        shared_lock<shared_mutex> names(namesLock);
+        return bookTitles.name(book);
+    }
+
+    size_t userCount() const
+    {
+        shared_lock<shared_mutex> names(namesLock);
+        return userNames.size();
+    }
+
+    size_t bookCount() const
+    {
+        shared_lock<shared_mutex> names(namesLock);
+        return bookTitles.size();
+    }
+
+    // Bulk-load users, one name per line (first column). Names are interned
+    // in one batch; repeated names count as duplicates, nothing is printed.
+    LoadReport loadUsers(const string &path, const LoadOptions &options)
+    {
+        return loadNames(path, options, userNames);
+    }
+
+    // Bulk-load books, one title per line (first column)
+    LoadReport loadBooks(const string &path, const LoadOptions &options)
+    {
+        return loadNames(path, options, bookTitles);
+    }
+
+    // Bulk-load reads, one "user<delimiter>title" row per line. The file is
+    // memory-mapped and parsed by several threads in line-aligned chunks
+    // without allocating per field; all new reads are then published as one
+    // snapshot. Rows naming unknown users or books are reported instead of
+    // printed, unless options.createMissing interns them.
+    LoadReport loadReads(const string &path, const LoadOptions &options)
+    {
+        ApiTimer timer(kApiLoad);
+        auto start = chrono::steady_clock::now();
+        LoadReport report;
+        MappedFile file;
+        string error;
+        if (!file.open(path, error))
+        {
+            report.errors.push_back({0, error});
+            return report;
+        }
+
+        string_view text = file.contents();
+        string_view line;
+        size_t firstLine = 1;
+        if (options.hasHeader && nextLine(text, line))
+        {
+            firstLine++;
+        }
+
+        // Per-chunk parse results; line numbers are chunk-relative until merged
+        struct DeferredRow
+        {
+            size_t line;
+            string_view user;
+            string_view title;
+        };
+        struct ReadChunk
+        {
+            string_view text;
+            size_t lines = 0;
+            size_t rows = 0;
+            vector<pair<uint32_t, uint32_t>> edges;
+            vector<DeferredRow> deferred; // unknown names, createMissing only
+            vector<pair<size_t, const char *>> errors;
+        };
+
+        size_t threads = options.threads != 0 ? options.threads : max(1u, thread::hardware_concurrency());
+        vector<ReadChunk> chunks;
+        for (string_view piece : splitAtLines(text, threads))
+        {
+            chunks.emplace_back();
+            chunks.back().text = piece;
+        }
+
+        lock_guard<mutex> guard(writeLock);
+        if (logFailed())
+        {
+            report.errors.push_back({0, logError()});
+            return report;
+        }
+        {
+            // Writers are locked out, so the name tables cannot change while
+            // the parser threads read them
+            shared_lock<shared_mutex> names(namesLock);
+            auto parse = [this, &options](ReadChunk &chunk)
+            {
+                string_view rest = chunk.text;
+                string_view row;
+                while (nextLine(rest, row))
+                {
+                    chunk.lines++;
+                    if (row.empty())
+                    {
+                        continue;
+                    }
+                    chunk.rows++;
+
+                    size_t split = row.find(options.delimiter);
+                    if (split == string_view::npos)
+                    {
+                        chunk.errors.push_back({chunk.lines, "Malformed row."});
+                        continue;
+                    }
+                    string_view userField = row.substr(0, split);
+                    string_view titleField = row.substr(split + 1);
+                    uint32_t user = userNames.find(userField);
+                    uint32_t book = bookTitles.find(titleField);
+                    if (user != kInvalidId && book != kInvalidId)
+                    {
+                        chunk.edges.push_back({user, book});
+                    }
+                    else if (options.createMissing)
+                    {
+                        chunk.deferred.push_back({chunk.lines, userField, titleField});
+                    }
+                    else
+                    {
+                        chunk.errors.push_back({chunk.lines, "User or book not found."});
+                    }
+                }
+            };
+
+            vector<thread> parsers;
+            for (size_t i = 1; i < chunks.size(); ++i)
+            {
+                parsers.emplace_back(parse, ref(chunks[i]));
+            }
+            if (!chunks.empty())
+            {
+                parse(chunks[0]);
+            }
+            for (thread &parser : parsers)
+            {
+                parser.join();
+            }
+        }
+
+        // Gather edges and errors in file order
+        vector<pair<uint32_t, uint32_t>> edges;
+        size_t lineBase = firstLine;
+        size_t deferredRows = 0;
+        for (ReadChunk &chunk : chunks)
+        {
+            report.rows += chunk.rows;
+            for (const auto &rowError : chunk.errors)
+            {
+                report.reject(lineBase + rowError.first - 1, rowError.second, options.maxErrors);
+            }
+            for (DeferredRow &row : chunk.deferred)
+            {
+                row.line += lineBase - 1;
+            }
+            deferredRows += chunk.deferred.size();
+            if (edges.empty())
+            {
+                edges.swap(chunk.edges);
+            }
+            else
+            {
+                edges.insert(edges.end(), chunk.edges.begin(), chunk.edges.end());
+                vector<pair<uint32_t, uint32_t>>().swap(chunk.edges);
+            }
+            lineBase += chunk.lines;
+        }
+
+        // Intern the missing names in one batch
+        if (deferredRows > 0)
+        {
+            unique_lock<shared_mutex> names(namesLock);
+            bool userInserted;
+            bool bookInserted;
+            for (const ReadChunk &chunk : chunks)
+            {
+                for (const DeferredRow &row : chunk.deferred)
+                {
+                    if (logFailed())
+                    {
+                        report.reject(row.line, logError().c_str(), options.maxErrors);
+                        continue;
+                    }
+                    uint32_t user = userNames.intern(row.user, userInserted);
+                    uint32_t book = bookTitles.intern(row.title, bookInserted);
+                    if ((userInserted && !logName(kEventAddUser, row.user)) ||
+                        (bookInserted && !logName(kEventAddBook, row.title)))
+                    {
+                        report.reject(row.line, logError().c_str(), options.maxErrors);
+                        continue;
+                    }
+                    edges.push_back({user, book});
+                }
+            }
+            graph.resize(userNames.size(), bookTitles.size());
+        }
+
+        if (logFailed())
+        {
+            report.errors.push_back({0, logError()});
+            report.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            return report;
+        }
+        size_t added = publishBatchLocked(edges);
+        report.loaded = added;
+        report.duplicates = report.rows - report.rejected - added;
+        if (logFailed())
+        {
+            report.errors.push_back({0, logError()});
+        }
+
+        report.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        return report;
+    }
+
+    // Write every recorded read, the name tables and the bitset kernel to a
+    // versioned, checksummed snapshot file that openSnapshot() can map and
+    // query in place. Written to path.tmp and renamed, so readers of path
+    // never see a partial file.
+    bool saveSnapshot(const string &path, string &error)
+    {
+        lock_guard<mutex> guard(writeLock);
+        return saveSnapshotLocked(path, error);
+    }
+
+private:
+    // saveSnapshot for callers holding writeLock
+    bool saveSnapshotLocked(const string &path, string &error)
+    {
+        publishLocked();
+        shared_ptr<const GraphSnapshot> current = graph.snapshot();
+
+        SnapshotHeader header;
+        memcpy(header.magic, kSnapshotMagic, sizeof(header.magic));
+        header.formatVersion = kSnapshotFormatVersion;
+        header.byteOrder = kSnapshotByteOrder;
+        header.graphVersion = current->version;
+        header.userCount = current->users();
+        header.bookCount = current->books();
+        header.readCount = current->reads();
+        header.denseUsers = current->kernel.denseUsers();
+
+        string temporary = path + ".tmp";
+        FILE *file = fopen(temporary.c_str(), "wb");
+        if (!file)
+        {
+            error = "Cannot create " + temporary + ": " + strerror(errno);
+            return false;
+        }
+
+        SnapshotWriter writer(file);
+        bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+        {
+            shared_lock<shared_mutex> names(namesLock);
+            vector<uint64_t> offsets;
+            string blob;
+            flattenNames(userNames, offsets, blob);
+            ok = ok && writer.write(header, kUserNameOffsets, offsets.data(), offsets.size() * sizeof(uint64_t)) &&
+                 writer.write(header, kUserNameBlob, blob.data(), blob.size()) &&
+                 writer.write(header, kUserNameSlots, userNames.slotArray(), userNames.slotArraySize() * sizeof(uint64_t));
+            flattenNames(bookTitles, offsets, blob);
+            ok = ok && writer.write(header, kBookNameOffsets, offsets.data(), offsets.size() * sizeof(uint64_t)) &&
+                 writer.write(header, kBookNameBlob, blob.data(), blob.size()) &&
+                 writer.write(header, kBookNameSlots, bookTitles.slotArray(), bookTitles.slotArraySize() * sizeof(uint64_t));
+        }
+
+        const CsrAdjacency &userBooks = current->userBooks;
+        const CsrAdjacency &bookReaders = current->bookReaders;
+        const JaccardKernel &kernel = current->kernel;
+        ok = ok &&
+             writer.write(header, kUserBookOffsets, (userBooks.nodeCount() + 1) * sizeof(uint64_t),
+                          [&userBooks](const auto &append) { return userBooks.writeOffsets(append); }) &&
+             writer.write(header, kUserBookNeighbors, userBooks.edgeCount() * sizeof(uint32_t),
+                          [&userBooks](const auto &append) { return userBooks.writeNeighbors(append); }) &&
+             writer.write(header, kBookReaderOffsets, (bookReaders.nodeCount() + 1) * sizeof(uint64_t),
+                          [&bookReaders](const auto &append) { return bookReaders.writeOffsets(append); }) &&
+             writer.write(header, kBookReaderNeighbors, bookReaders.edgeCount() * sizeof(uint32_t),
+                          [&bookReaders](const auto &append) { return bookReaders.writeNeighbors(append); }) &&
+             writer.write(header, kKernelSlots, userBooks.nodeCount() * sizeof(uint32_t),
+                          [&kernel](const auto &append) { return kernel.writeSlots(append); }) &&
+             writer.write(header, kKernelBitsets, header.denseUsers * kernel.words() * sizeof(uint64_t),
+                          [&kernel](const auto &append) { return kernel.writeBitsets(append); });
+
+        header.fileSize = writer.size();
+        header.headerChecksum = headerChecksum(header);
+        ok = ok && fseek(file, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, file) == 1 &&
+             fflush(file) == 0 && fsync(fileno(file)) == 0;
+        ok = fclose(file) == 0 && ok;
+        if (!ok || rename(temporary.c_str(), path.c_str()) != 0)
+        {
+            error = "Cannot write " + path + ": " + strerror(errno);
+            remove(temporary.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    // fsync a directory so renames and unlinks in it are durable
+    static bool syncDirectory(const string &directory, string &error)
+    {
+        int fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        bool ok = fd >= 0 && fsync(fd) == 0;
+        if (!ok)
+        {
+            error = "Cannot sync " + directory + ": " + strerror(errno);
+        }
+        if (fd >= 0)
+        {
+            ::close(fd);
+        }
+        return ok;
+    }
+
+    string logPath() const
+    {
+        return dataDirectory + "/events.log";
+    }
+
+    string retiredLogPath() const
+    {
+        return dataDirectory + "/events.log.old";
+    }
+
+    string snapshotPath() const
+    {
+        return dataDirectory + "/snapshot";
+    }
+
+    // Fold the event log into a new snapshot. The log is retired before the
+    // snapshot is written and deleted after, so a crash at any point leaves
+    // a snapshot and logs that replay to the same state. A retired log left
+    // by such a crash is folded in first. Callers hold writeLock.
+    bool compactLocked(string &error)
+    {
+        if (!eventLog.isOpen())
+        {
+            error = "No data directory is open.";
+            return false;
+        }
+        struct stat info;
+        if (stat(retiredLogPath().c_str(), &info) == 0)
+        {
+            if (!saveSnapshotLocked(snapshotPath(), error) || unlink(retiredLogPath().c_str()) != 0)
+            {
+                error = error.empty() ? "Cannot remove " + retiredLogPath() + ": " + strerror(errno) : error;
+                return false;
+            }
+        }
+
+        if (!eventLog.sync(error))
+        {
+            return false;
+        }
+        eventLog.close();
+        if (rename(logPath().c_str(), retiredLogPath().c_str()) != 0)
+        {
+            error = "Cannot retire " + logPath() + ": " + strerror(errno);
+            eventLog.open(logPath(), logOptions, error);
+            return false;
+        }
+        return syncDirectory(dataDirectory, error) && eventLog.open(logPath(), logOptions, error) &&
+               saveSnapshotLocked(snapshotPath(), error) && unlink(retiredLogPath().c_str()) == 0 &&
+               syncDirectory(dataDirectory, error);
+    }
+
+    // Background compaction once the log outgrows compactBytes, checked
+    // every second
+    void runCompactor()
+    {
+        unique_lock<mutex> guard(compactorLock);
+        while (!compactorWake.wait_for(guard, chrono::seconds(1), [this]
+                                       { return compactorStopping; }))
+        {
+            if (eventLog.stats().fileBytes < logOptions.compactBytes)
+            {
+                continue;
+            }
+            string error;
+            lock_guard<mutex> writer(writeLock);
+            if (!compactLocked(error))
+            {
+                cerr << error << endl;
+            }
+        }
+    }
+
+    // Apply one replayed event; names intern to the ids they had, reads
+    // are collected for one batch publish. Callers hold writeLock.
+    void replayEvent(EventType type, string_view data, vector<pair<uint32_t, uint32_t>> &edges)
+    {
+        if (type == kEventAddUser || type == kEventAddBook)
+        {
+            bool inserted;
+            unique_lock<shared_mutex> names(namesLock);
+            (type == kEventAddUser ? userNames : bookTitles).intern(data, inserted);
+            graph.resize(userNames.size(), bookTitles.size());
+        }
+        else if (type == kEventAddRead && data.size() == 2 * sizeof(uint32_t))
+        {
+            uint32_t ids[2];
+            memcpy(ids, data.data(), sizeof(ids));
+            if (ids[0] < userNames.size() && ids[1] < bookTitles.size())
+            {
+                edges.push_back({ids[0], ids[1]});
+            }
+        }
+    }
+
+public:
+    // Replace the whole system with a snapshot file, mapped read-only and
+    // queried in place: nothing is deserialized, so start-up cost is the
+    // page faults queries take. The header, the section sizes and the
+    // offset, id and slot arrays are always validated, so a damaged file
+    // cannot send a query outside the mapping; section checksums (which
+    // hash the whole file) only with verifyChecksums, which files from
+    // untrusted sources should use. Any MinHash index is dropped.
+    bool openSnapshot(const string &path, string &error, bool verifyChecksums = false)
+    {
+        shared_ptr<MappedFile> file = make_shared<MappedFile>();
+        if (!file->open(path, error, MADV_NORMAL))
+        {
+            return false;
+        }
+
+        string_view bytes = file->contents();
+        SnapshotHeader header;
+        if (bytes.size() < sizeof(header))
+        {
+            error = path + " is not a snapshot";
+            return false;
+        }
+        memcpy(&header, bytes.data(), sizeof(header));
+        if (memcmp(header.magic, kSnapshotMagic, sizeof(header.magic)) != 0)
+        {
+            error = path + " is not a snapshot";
+            return false;
+        }
+        if (header.formatVersion != kSnapshotFormatVersion || header.byteOrder != kSnapshotByteOrder)
+        {
+            error = path + " has an unsupported format version or byte order";
+            return false;
+        }
+        if (header.headerChecksum != headerChecksum(header) || header.fileSize != bytes.size())
+        {
+            error = path + " is truncated or corrupt";
+            return false;
+        }
+
+        const char *base = bytes.data();
+        for (const SnapshotSection &section : header.sections)
+        {
+            if (section.offset % kSnapshotAlignment != 0 || section.offset > header.fileSize ||
+                section.size > header.fileSize - section.offset)
+            {
+                error = path + " has a section outside the file";
+                return false;
+            }
+            if (verifyChecksums && checksumBytes(base + section.offset, section.size) != section.checksum)
+            {
+                error = path + " failed its checksum";
+                return false;
+            }
+        }
+
+        auto array = [&header, base](SnapshotSectionId id)
+        {
+            return base + header.sections[id].offset;
+        };
+        auto count = [&header](SnapshotSectionId id, size_t width)
+        {
+            return header.sections[id].size / width;
+        };
+        size_t users = header.userCount;
+        size_t books = header.bookCount;
+        size_t userSlots = count(kUserNameSlots, sizeof(uint64_t));
+        size_t bookSlots = count(kBookNameSlots, sizeof(uint64_t));
+        size_t words = (books + 63) / 64;
+        bool shaped = count(kUserNameOffsets, sizeof(uint64_t)) == users + 1 &&
+                      count(kBookNameOffsets, sizeof(uint64_t)) == books + 1 &&
+                      (userSlots > users || userSlots == 0) && (userSlots & (userSlots - 1)) == 0 &&
+                      (bookSlots > books || bookSlots == 0) && (bookSlots & (bookSlots - 1)) == 0 &&
+                      count(kUserBookOffsets, sizeof(uint64_t)) == users + 1 &&
+                      count(kBookReaderOffsets, sizeof(uint64_t)) == books + 1 &&
+                      count(kUserBookNeighbors, sizeof(uint32_t)) == header.readCount &&
+                      count(kBookReaderNeighbors, sizeof(uint32_t)) == header.readCount &&
+                      count(kKernelSlots, sizeof(uint32_t)) == users &&
+                      count(kKernelBitsets, sizeof(uint64_t)) == header.denseUsers * words;
+        if (!shaped)
+        {
+            error = path + " has inconsistent section sizes";
+            return false;
+        }
+        bool consistent =
+            offsetsValid((const uint64_t *)array(kUserNameOffsets), users, header.sections[kUserNameBlob].size) &&
+            offsetsValid((const uint64_t *)array(kBookNameOffsets), books, header.sections[kBookNameBlob].size) &&
+            offsetsValid((const uint64_t *)array(kUserBookOffsets), users, header.readCount) &&
+            offsetsValid((const uint64_t *)array(kBookReaderOffsets), books, header.readCount) &&
+            idsValid((const uint32_t *)array(kUserBookNeighbors), header.readCount, books) &&
+            idsValid((const uint32_t *)array(kBookReaderNeighbors), header.readCount, users) &&
+            idsValid((const uint32_t *)array(kKernelSlots), users, header.denseUsers, true) &&
+            nameSlotsValid((const uint64_t *)array(kUserNameSlots), userSlots, users) &&
+            nameSlotsValid((const uint64_t *)array(kBookNameSlots), bookSlots, books);
+        if (!consistent)
+        {
+            error = path + " has out-of-range offsets or ids";
+            return false;
+        }
+
+        shared_ptr<GraphSnapshot> snapshot = make_shared<GraphSnapshot>();
+        snapshot->userBooks = CsrAdjacency::view((const uint64_t *)array(kUserBookOffsets),
+                                                 (const uint32_t *)array(kUserBookNeighbors), users);
+        snapshot->bookReaders = CsrAdjacency::view((const uint64_t *)array(kBookReaderOffsets),
+                                                   (const uint32_t *)array(kBookReaderNeighbors), books);
+        snapshot->kernel.view(snapshot->userBooks, books, (const uint32_t *)array(kKernelSlots),
+                              (const uint64_t *)array(kKernelBitsets));
+        snapshot->userCount = users;
+        snapshot->bookCount = books;
+        snapshot->version = max<uint64_t>(header.graphVersion, graph.snapshot()->version + 1);
+        snapshot->backing = file;
+
+        lock_guard<mutex> guard(writeLock);
+        {
+            unique_lock<shared_mutex> names(namesLock);
+            userNames.view((const uint64_t *)array(kUserNameOffsets), array(kUserNameBlob), users,
+                           (const uint64_t *)array(kUserNameSlots), userSlots);
+            bookTitles.view((const uint64_t *)array(kBookNameOffsets), array(kBookNameBlob), books,
+                            (const uint64_t *)array(kBookNameSlots), bookSlots);
+            namesBacking = file;
+        }
+        {
+            unique_lock<shared_mutex> signatures(minHashLock);
+            minHash = MinHashIndex();
+        }
+        {
+            unique_lock<shared_mutex> counts(cooccurrenceLock);
+            cooccurrence = CooccurrenceIndex();
+        }
+        {
+            unique_lock<shared_mutex> walks(walkLock);
+            walkIndex = RandomWalkIndex();
+        }
+        {
+            unique_lock<shared_mutex> model(factorLock);
+            factors = FactorModel();
+        }
+        neighborCache.configure(neighborCache.budgetBytes(), snapshot->version);
+        graph.reset(snapshot);
+        return true;
+    }
+
+    // Make the system durable in a data directory. Its snapshot, if any, is
+    // opened and its event log replayed on top; from then on every
+    // mutation is appended to the log and group-committed within
+    // options.syncInterval, and the log is folded into a new snapshot once
+    // it outgrows options.compactBytes, which bounds recovery time. Call on
+    // an empty system, before anything is loaded.
+    bool openDurable(const string &directory, const EventLogOptions &options, RecoveryReport &report, string &error)
+    {
+        auto start = chrono::steady_clock::now();
+        report = RecoveryReport();
+        if (mkdir(directory.c_str(), 0755) != 0 && errno != EEXIST)
+        {
+            error = "Cannot create " + directory + ": " + strerror(errno);
+            return false;
+        }
+        closeDurable();
+        dataDirectory = directory;
+        logOptions = options;
+
+        struct stat info;
+        if (stat(snapshotPath().c_str(), &info) == 0)
+        {
+            if (!openSnapshot(snapshotPath(), error))
+            {
+                return false;
+            }
+            report.snapshotLoaded = true;
+        }
+
+        {
+            lock_guard<mutex> guard(writeLock);
+            vector<pair<uint32_t, uint32_t>> edges;
+            auto visit = [this, &edges](EventType type, string_view data)
+            { replayEvent(type, data, edges); };
+            size_t retiredEvents = 0;
+            if (!EventLog::replay(retiredLogPath(), visit, retiredEvents, error) ||
+                !EventLog::replay(logPath(), visit, report.events, error))
+            {
+                return false;
+            }
+            report.events += retiredEvents;
+            publishBatchLocked(edges);
+            if (!eventLog.open(logPath(), options, error) ||
+                (stat(retiredLogPath().c_str(), &info) == 0 && !compactLocked(error)))
+            {
+                return false;
+            }
+        }
+
+        if (options.compactBytes > 0)
+        {
+            compactorStopping = false;
+            compactor = thread(&BookRecommendationSystem::runCompactor, this);
+        }
+        report.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        return true;
+    }
+
+    // Fold the event log into a new snapshot now
+    bool compact(string &error)
+    {
+        lock_guard<mutex> guard(writeLock);
+        return compactLocked(error);
+    }
+
+    // Wait until every mutation so far is on disk. Mutations are durable
+    // on their own within the sync interval; this is for callers that must
+    // not acknowledge before.
+    bool syncLog(string &error)
+    {
+        return eventLog.sync(error);
+    }
+
+    EventLogStats eventLogStats() const
+    {
+        return eventLog.stats();
+    }
+
+    // The event log's write error, or empty. Once the log has failed every
+    // mutation is refused: ingest calls add nothing and report it here.
+    string logError() const
+    {
+        return eventLog.isOpen() ? eventLog.error() : string();
+    }
+
+    // Stop compacting and commit and close the event log; later mutations
+    // are not logged
+    void closeDurable()
+    {
+        if (compactor.joinable())
+        {
+            {
+                lock_guard<mutex> guard(compactorLock);
+                compactorStopping = true;
+            }
+            compactorWake.notify_one();
+            compactor.join();
+        }
+        lock_guard<mutex> guard(writeLock);
+        eventLog.close();
+    }
+
+    ~BookRecommendationSystem()
+    {
+        closeDurable();
+    }
+
+    // Turn on the approximate engine, signing every read recorded so far.
+    // Later reads update signatures incrementally.
+    void enableMinHash(const MinHashOptions &options)
+    {
+        lock_guard<mutex> guard(writeLock);
+        publishLocked();
+        shared_ptr<const GraphSnapshot> current = graph.snapshot();
+
+        unique_lock<shared_mutex> signatures(minHashLock);
+        minHash.configure(options);
+        minHash.resize(current->users());
+        for (uint32_t user = 0; user < current->users(); ++user)
+        {
+            for (uint32_t book : current->booksRead(user))
+            {
+                minHash.addRead(user, book);
+            }
+        }
+        minHash.refreshBuckets();
+    }
+
+    // Turn on the item-based engine, counting co-reads of every read
+    // recorded so far. Later reads update the counts incrementally.
+    void enableCooccurrence(const CooccurrenceOptions &options)
+    {
+        lock_guard<mutex> guard(writeLock);
+        publishLocked();
+        shared_ptr<const GraphSnapshot> current = graph.snapshot();
+
+        unique_lock<shared_mutex> counts(cooccurrenceLock);
+        cooccurrence.configure(options);
+        for (uint32_t user = 0; user < current->users(); ++user)
+        {
+            IdSpan books = current->booksRead(user);
+            for (size_t i = 0; i < books.size(); ++i)
+            {
+                cooccurrence.addRead(books[i], IdSpan{books.first, i});
+            }
+        }
+        cooccurrence.refreshNeighbors();
+    }
+
+    // Turn on the personalized PageRank engine, drawing walk segments for
+    // every user. Segments of users who read something are redrawn when
+    // the read is published.
+    void enableRandomWalks(const RandomWalkOptions &options)
+    {
+        lock_guard<mutex> guard(writeLock);
+        publishLocked();
+        drawAllWalks(*graph.snapshot(), options);
+    }
+
+    // Train the embedding engine with ALS on the worker pool over the
+    // published graph, up to options.iterations in all. With
+    // options.resume, training continues the current model when it has as
+    // many factors, so it resumes from a loaded checkpoint and runs only
+    // the iterations left; it fails when that model was trained on other
+    // data. Writes options.checkpointPath after every iteration. Writers
+    // are not held up, and queries use the old model until the new one is
+    // done.
+    bool trainFactors(const FactorOptions &options, string &error)
+    {
+        shared_ptr<const GraphSnapshot> current;
+        {
+            lock_guard<mutex> guard(writeLock);
+            publishLocked();
+            current = graph.snapshot();
+        }
+        FactorModel fresh;
+        {
+            shared_lock<shared_mutex> guard(factorLock);
+            if (!fresh.configure(options, *current, options.resume ? &factors : nullptr, error))
+            {
+                return false;
+            }
+        }
+        auto run = [this](size_t count, size_t chunk, const auto &body)
+        { runChunks(count, chunk, body); };
+        while (fresh.iterations() < options.iterations)
+        {
+            fresh.iterate(*current, run);
+            if (!options.checkpointPath.empty() && !fresh.save(options.checkpointPath, error))
+            {
+                return false;
+            }
+        }
+        unique_lock<shared_mutex> guard(factorLock);
+        swap(factors, fresh);
+        return true;
+    }
+
+    // Settings of the served embedding model, with the iterations it has
+    // completed; factors is 0 when there is none
+    FactorOptions factorSettings() const
+    {
+        shared_lock<shared_mutex> guard(factorLock);
+        FactorOptions settings = factors.settings();
+        settings.factors = factors.enabled() ? settings.factors : 0;
+        settings.iterations = factors.iterations();
+        return settings;
+    }
+
+    // Write the embedding model to a checkpoint file
+    bool saveFactors(const string &path, string &error) const
+    {
+        shared_lock<shared_mutex> guard(factorLock);
+        if (!factors.enabled())
+        {
+            error = "No trained factors to save.";
+            return false;
+        }
+        return factors.save(path, error);
+    }
+
+    // Serve the embedding engine from a checkpoint, replacing any model.
+    // The checkpoint must have been trained on the published library, so
+    // its vectors belong to the users and books they are served for.
+    bool loadFactors(const string &path, string &error)
+    {
+        FactorModel loaded;
+        if (!loaded.load(path, error))
+        {
+            return false;
+        }
+        shared_ptr<const GraphSnapshot> current;
+        {
+            lock_guard<mutex> guard(writeLock);
+            publishLocked();
+            current = graph.snapshot();
+        }
+        if (!loaded.trainedOn(*current, error))
+        {
+            error = path + ": " + error;
+            return false;
+        }
+        unique_lock<shared_mutex> guard(factorLock);
+        swap(factors, loaded);
+        return true;
+    }
+
+    // "Readers of this book also read": up to k titles, most similar
+    // first. Needs enableCooccurrence(); reflects published reads.
+    vector<string> similarBooks(const string &title, size_t k)
+    {
+        vector<string> similar;
+        uint32_t book = bookId(title);
+        if (book == kInvalidId)
+        {
+            cout << "Book not found." << endl;
+            return similar;
+        }
+
+        shared_lock<shared_mutex> counts(cooccurrenceLock);
+        shared_lock<shared_mutex> names(namesLock);
+        const vector<BookNeighbor> &neighbors = cooccurrence.neighbors(book);
+        for (size_t i = 0; i < min(k, neighbors.size()); ++i)
+        {
+            similar.emplace_back(bookTitles.name(neighbors[i].book));
+        }
+        return similar;
+    }
+
+    // Item-based recommendations from the neighbor lists of the books the
+    // user has read. Needs enableCooccurrence(); falls back to exact kNN
+    // otherwise.
+    vector<string> recommendForUser(const string &userName, size_t maxResults)
+    {
+        return kNNRecommendBooks(userName, 2, maxResults, RecommendEngine::ItemBased);
+    }
+
+    // Cache exact kNN neighbor lists in about budgetBytes of memory, so
+    // users asking again before anyone near them reads something skip the
+    // similarity phase. 0 turns the cache off; resizing empties it.
+    void setNeighborCacheBudget(size_t budgetBytes)
+    {
+        lock_guard<mutex> guard(writeLock);
+        neighborCache.configure(budgetBytes, 0);
+    }
+
+    NeighborCacheStats neighborCacheStats() const
+    {
+        return neighborCache.stats();
+    }
+
+    // Hot-path instrumentation summed over every thread, with the neighbor
+    // cache counters. Counts are process-wide: several systems in one
+    // process share them. See StatsReport::prometheus() and json().
+    StatsReport stats() const
+    {
+        StatsReport report = collectStats();
+        report.neighborCache = neighborCache.stats();
+        return report;
+    }
+
+    // Compare approximate against exact top-k neighbors on every
+    // step-th user, to pick MinHash settings knowingly
+    RecallReport minHashRecall(int k, size_t sampleUsers)
+    {
+        RecallReport report;
+        if (!minHash.enabled() || sampleUsers == 0)
+        {
+            return report;
+        }
+
+        shared_ptr<const GraphSnapshot> current = snapshot();
+        QueryScratch &scratch = threadScratch();
+        size_t step = max<size_t>(1, current->users() / sampleUsers);
+        size_t expected = 0;
+        size_t found = 0;
+        vector<uint32_t> exact;
+        for (uint32_t user = 0; user < current->users(); user += step)
+        {
+            auto start = chrono::steady_clock::now();
+            exact.clear();
+            IdSpan books = current->booksRead(user);
+            for (const auto &neighbor : nearestNeighbors(*current, user, books, k, RecommendEngine::ExactKnn, SimilarityMetric::Jaccard, scratch))
+            {
+                exact.push_back(neighbor.second);
+            }
+            auto middle = chrono::steady_clock::now();
+            for (const auto &neighbor : nearestNeighbors(*current, user, books, k, RecommendEngine::MinHashKnn, SimilarityMetric::Jaccard, scratch))
+            {
+                found += find(exact.begin(), exact.end(), neighbor.second) != exact.end();
+            }
+            auto end = chrono::steady_clock::now();
+
+            expected += exact.size();
+            report.usersSampled++;
+            report.exactMicros += chrono::duration<double, micro>(middle - start).count();
+            report.approximateMicros += chrono::duration<double, micro>(end - middle).count();
+        }
+
+        report.recall = expected == 0 ? 1.0 : (double)found / expected;
+        if (report.usersSampled > 0)
+        {
+            report.exactMicros /= report.usersSampled;
+            report.approximateMicros /= report.usersSampled;
+        }
+        return report;
+    }
+
+    // k-nearest neighbors (kNN) algorithm to recommend books based on user similarity.
+    // Returns at most maxResults books, most recommended first. The MinHash
+    // engine is used only after enableMinHash(). The kNN engines rank
+    // neighbors by metric. Safe to call concurrently with writers; sees
+    // the reads published when the call starts.
+    vector<string> kNNRecommendBooks(const string &userName, int k, size_t maxResults,
+                                     RecommendEngine engine = RecommendEngine::ExactKnn,
+                                     SimilarityMetric metric = SimilarityMetric::Jaccard)
+    {
+        ApiTimer timer(kApiRecommend);
+        vector<string> recommendations;
+
+        uint32_t target = userId(userName);
+        if (target == kInvalidId)
+        {
+            cout << "User not found." << endl;
+            return recommendations;
+        }
+
+        IdSpan books = recommendIdsUntimed(target, k, maxResults, engine, metric);
+
+        // Extract recommended books
+        recommendations.reserve(books.size());
+        shared_lock<shared_mutex> names(namesLock);
+        for (uint32_t book : books)
+        {
+            recommendations.emplace_back(bookTitles.name(book));
+        }
+
+        return recommendations;
+    }
+
+    // kNNRecommendBooks into a caller-owned vector, for hot loops. The
+    // titles point into the name tables, which only grow, and stay valid
+    // until openSnapshot() replaces them. Once titles has room for
+    // maxResults, a query makes no heap allocations. Returns false if the
+    // user is not found.
+    bool kNNRecommendBooks(string_view userName, int k, size_t maxResults, vector<string_view> &titles,
+                           RecommendEngine engine = RecommendEngine::ExactKnn,
+                           SimilarityMetric metric = SimilarityMetric::Jaccard)
+    {
+        ApiTimer timer(kApiRecommend);
+        titles.clear();
+        uint32_t target = userId(userName);
+        if (target == kInvalidId)
+        {
+            return false;
+        }
+
+        IdSpan books = recommendIdsUntimed(target, k, maxResults, engine, metric);
+        shared_lock<shared_mutex> names(namesLock);
+        for (uint32_t book : books)
+        {
+            titles.push_back(bookTitles.name(book));
+        }
+        return true;
+    }
+
+    // kNNRecommendBooks by user id, returning book ids. The span points
+    // into this thread's scratch and is valid until its next query. Once
+    // the scratch has grown to fit the graph, a query makes no heap
+    // allocations.
+    IdSpan kNNRecommendIds(uint32_t user, int k, size_t maxResults, RecommendEngine engine = RecommendEngine::ExactKnn,
+                           SimilarityMetric metric = SimilarityMetric::Jaccard)
+    {
+        ApiTimer timer(kApiRecommend);
+        return recommendIdsUntimed(user, k, maxResults, engine, metric);
+    }
+
+    // Shard side of a scattered exact kNN query (see ShardedLibrary): the k
+    // users here most similar to a reader of books (sorted ids), best
+    // first, leaving out exclude. The reader may live on another shard. A
+    // score needs only the two rows, so it equals the single-node score
+    // bit for bit. That does not hold for IdfJaccard, whose idf weights
+    // would only count this shard's readers.
+    vector<TopKSelector<double>::Entry> nearestToBooks(IdSpan books, uint32_t exclude, int k, SimilarityMetric metric)
+    {
+        ApiTimer timer(kApiRecommend);
+        statCount(kStatQueries);
+        shared_ptr<const GraphSnapshot> current = snapshot();
+        return nearestNeighbors(*current, exclude, books, k, RecommendEngine::ExactKnn, metric, threadScratch());
+    }
+
+    // Shard side of the book count: how many of the given users read each
+    // book outside exclude (sorted ids), as (book, votes) pairs
+    vector<pair<uint32_t, uint32_t>> countVotes(IdSpan users, IdSpan exclude)
+    {
+        shared_ptr<const GraphSnapshot> current = snapshot();
+        QueryScratch &scratch = threadScratch();
+        scratch.bookVotes.resize(current->books(), 0);
+        scratch.votedBooks.clear();
+        for (uint32_t user : users)
+        {
+            for (uint32_t book : current->booksRead(user))
+            {
+                if (!exclude.contains(book) && scratch.bookVotes[book]++ == 0)
+                {
+                    scratch.votedBooks.push_back(book);
+                }
+            }
+        }
+
+        vector<pair<uint32_t, uint32_t>> votes;
+        votes.reserve(scratch.votedBooks.size());
+        for (uint32_t book : scratch.votedBooks)
+        {
+            votes.push_back({book, scratch.bookVotes[book]});
+            scratch.bookVotes[book] = 0;
+        }
+        return votes;
+    }
+
+    // Size the batch worker pool; defaults to one thread per core
+    void setWorkerThreads(size_t threads)
+    {
+        lock_guard<mutex> guard(poolLock);
+        resizePool(threads);
+    }
+
+    // kNN recommendations for each listed user id, computed in parallel on
+    // the worker pool and streamed to the sink as each user completes.
+    // Workers share the graph read-only and reuse their own scratch buffers.
+    void recommendBatch(IdSpan users, int k, size_t maxResults, const RecommendationSink &sink,
+                        RecommendEngine engine = RecommendEngine::ExactKnn)
+    {
+        ApiTimer timer(kApiRecommendBatch);
+        runBatch(
+            snapshot(), users.size(), [users](size_t i)
+            { return users[i]; },
+            k, maxResults, engine, sink);
+    }
+
+    // Answer a batch of independent queries on the worker pool, all on the
+    // same snapshot. Small batches are split finely so every worker gets
+    // a share, as a server coalescing concurrent requests produces them.
+    void recommendRequests(const vector<RecommendRequest> &requests, const RequestSink &sink)
+    {
+        ApiTimer timer(kApiRecommendBatch);
+        shared_ptr<const GraphSnapshot> current = snapshot();
+        const GraphSnapshot *graphView = current.get();
+        size_t chunk = min(kBatchChunk, max<size_t>(1, requests.size() / (4 * workerCount())));
+        runChunks(requests.size(), chunk, [this, graphView, &requests, &sink](size_t begin, size_t end, size_t worker)
+                  {
+                      QueryScratch &local = workerScratch[worker];
+                      for (size_t i = begin; i < end; ++i)
+                      {
+                          const RecommendRequest &request = requests[i];
+                          recommendIds(*graphView, request.user, request.k, request.maxResults, request.engine,
+                                       request.metric, local);
+                          sink(i, IdSpan{local.results.data(), local.results.size()});
+                      }
+                  });
+    }
+
+    // recommendBatch over every user, e.g. for nightly precomputation
+    void recommendAll(int k, size_t maxResults, const RecommendationSink &sink,
+                      RecommendEngine engine = RecommendEngine::ExactKnn)
+    {
+        ApiTimer timer(kApiRecommendBatch);
+        shared_ptr<const GraphSnapshot> current = snapshot();
+        runBatch(
+            current, current->users(), [](size_t i)
+            { return (uint32_t)i; },
+            k, maxResults, engine, sink);
+    }
+
+    // Reading communities of the published graph: every read unites its
+    // user and book in a lock-free union-find, in parallel on the worker
+    // pool, then components are labelled largest first
+    ComponentReport connectedComponents()
+    {
+        auto start = chrono::steady_clock::now();
+        ComponentReport report;
+        shared_ptr<const GraphSnapshot> current = snapshot();
+        size_t users = current->users();
+
+        // Users are nodes [0, users), books follow; a component's root is
+        // its smallest node, so a user whenever the component has one
+        ConcurrentUnionFind sets(users + current->books());
+        runChunks(users, kAnalyticsChunk, [&current, &sets, users](size_t begin, size_t end, size_t)
+                  {
+                      for (size_t user = begin; user < end; ++user)
+                      {
+                          for (uint32_t book : current->booksRead((uint32_t)user))
+                          {
+                              sets.unite((uint32_t)user, (uint32_t)(users + book));
+                          }
+                      }
+                  });
+        vector<uint32_t> roots(users);
+        runChunks(users, kAnalyticsChunk, [&sets, &roots](size_t begin, size_t end, size_t)
+                  {
+                      for (size_t user = begin; user < end; ++user)
+                      {
+                          roots[user] = sets.find((uint32_t)user);
+                      }
+                  });
+
+        // Sizes by root, then number the roots by size
+        vector<uint32_t> usersAt(users, 0);
+        vector<uint32_t> booksAt(users, 0);
+        vector<uint32_t> order;
+        for (uint32_t user = 0; user < users; ++user)
+        {
+            if (usersAt[roots[user]]++ == 0)
+            {
+                order.push_back(roots[user]);
+            }
+        }
+        for (uint32_t book = 0; book < current->books(); ++book)
+        {
+            if (!current->readers(book).empty())
+            {
+                booksAt[sets.find((uint32_t)(users + book))]++;
+            }
+        }
+        sort(order.begin(), order.end(), [&usersAt](uint32_t a, uint32_t b)
+             { return usersAt[a] > usersAt[b] || (usersAt[a] == usersAt[b] && a < b); });
+
+        vector<uint32_t> &label = booksAt; // reused once the counts are copied out
+        report.componentUsers.reserve(order.size());
+        report.componentBooks.reserve(order.size());
+        for (uint32_t root : order)
+        {
+            report.componentUsers.push_back(usersAt[root]);
+            report.componentBooks.push_back(booksAt[root]);
+            label[root] = (uint32_t)(report.componentUsers.size() - 1);
+        }
+        report.userComponent.resize(users);
+        for (uint32_t user = 0; user < users; ++user)
+        {
+            report.userComponent[user] = label[roots[user]];
+        }
+
+        report.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        return report;
+    }
+
+    // Users weighted by the books they share, over the published graph;
+    // books past options.maxDegree readers are left out
+    WeightedProjection projectUsers(const ProjectionOptions &options)
+    {
+        shared_ptr<const GraphSnapshot> current = snapshot();
+        return project(current->userBooks, current->bookReaders, options);
+    }
+
+    // Books weighted by the readers they share; users past
+    // options.maxDegree books are left out
+    WeightedProjection projectBooks(const ProjectionOptions &options)
+    {
+        shared_ptr<const GraphSnapshot> current = snapshot();
+        return project(current->bookReaders, current->userBooks, options);
+    }
+};
+
+// Draws ranks 0 .. n-1 with probability proportional to 1 / (rank + 1)^s
+// in constant time per draw, from a Walker alias table
+class ZipfSampler
+{
+private:
+    vector<double> accept; // chance a draw landing on a slot keeps it
+    vector<uint32_t> alias; // taken otherwise
+
+public:
+    ZipfSampler(size_t n, double exponent) : accept(n, 1.0), alias(n)
+    {
+        double total = 0;
+        for (size_t rank = 0; rank < n; ++rank)
+        {
+            accept[rank] = pow((double)(rank + 1), -exponent);
+            total += accept[rank];
+        }
+
+        // Vose's method: pair each under-full slot with an over-full one
+        vector<uint32_t> small;
+        vector<uint32_t> large;
+        for (size_t rank = 0; rank < n; ++rank)
+        {
+            accept[rank] *= n / total;
+            alias[rank] = (uint32_t)rank;
+            (accept[rank] < 1.0 ? small : large).push_back((uint32_t)rank);
+        }
+        while (!small.empty() && !large.empty())
+        {
+            uint32_t under = small.back();
+            small.pop_back();
+            uint32_t over = large.back();
+            alias[under] = over;
+            accept[over] -= 1.0 - accept[under];
+            if (accept[over] < 1.0)
+            {
+                large.pop_back();
+                small.push_back(over);
+            }
+        }
+        for (uint32_t rank : large)
+        {
+            accept[rank] = 1.0;
+        }
+        for (uint32_t rank : small)
+        {
+            accept[rank] = 1.0; // rounding leftovers
+        }
+    }
+
+    uint32_t operator()(mt19937_64 &rng) const
+    {
+        uint32_t slot = (uint32_t)(rng() % accept.size());
+        double coin = (rng() >> 11) * (1.0 / 9007199254740992.0);
+        return coin < accept[slot] ? slot : alias[slot];
+    }
+};
+
+// Shape of a generated library for benchmarks. Book popularity follows a
+// Zipf law with exponent bookSkew (0 is uniform). Reads per user follow a
+// Pareto law with shape activityShape (above 1; nearer 1 is heavier
+// tailed) scaled to a mean of about readsPerUser, capped at
+// maxReadsPerUser. Repeated draws of a book by one user count once.
+struct SyntheticOptions
+{
+    size_t users = 100000;
+    size_t books = 20000;
+    size_t readsPerUser = 8;
+    double bookSkew = 1.0;
+    double activityShape = 2.0;
+    size_t maxReadsPerUser = 5000;
+    uint64_t seed = 42;
+};
+
+// Reads generated between bulk publishes, to bound generator memory
+const size_t kSyntheticBatch = size_t(1) << 25;
+
+// Fill the system with generated users, books and reads, published in
+// large batches through the bulk ingest path. The same options always
+// give the same library, with the same ids. Library is a
+// BookRecommendationSystem or a ShardedLibrary.
+template <typename Library>
+void generateSyntheticLibrary(Library &system, const SyntheticOptions &options)
+{
+    mt19937_64 rng(options.seed);
+    uniform_real_distribution<double> uniform(0.0, 1.0);
+    ZipfSampler popularity(options.books, options.bookSkew);
+
+    // Popularity rank to book id, shuffled so popular titles are spread
+    // over the id range like real catalogs
+    vector<uint32_t> bookAt(options.books);
+    for (size_t i = 0; i < options.books; ++i)
+    {
+        bookAt[i] = system.internBook("book-" + to_string(i));
+    }
+    shuffle(bookAt.begin(), bookAt.end(), rng);
+
+    double shape = max(1.05, options.activityShape);
+    double scale = options.readsPerUser * (shape - 1) / shape;
+    size_t maxReads = min(options.maxReadsPerUser, options.books);
+    vector<pair<uint32_t, uint32_t>> edges;
+    for (size_t i = 0; i < options.users; ++i)
+    {
+        uint32_t user = system.internUser("user-" + to_string(i));
+        double draw = scale * pow(1.0 - uniform(rng), -1.0 / shape);
+        size_t reads = min<size_t>(maxReads, max<size_t>(1, (size_t)llround(min(draw, 1e12))));
+        for (size_t r = 0; r < reads; ++r)
+        {
+            edges.push_back({user, bookAt[popularity(rng)]});
+        }
+        if (edges.size() >= kSyntheticBatch)
+        {
+            system.addReadsIds(edges);
+            edges.clear();
+        }
+    }
+    system.addReadsIds(edges);
+    system.publish();
+}
+
+// Time recommendAll over a synthetic library at 1, 2, 4, ... maxThreads
+// workers and print the speedup over a single worker
+int benchBatch(const SyntheticOptions &options, size_t maxThreads)
+{
+    BookRecommendationSystem system;
+    generateSyntheticLibrary(system, options);
+    cout << "users=" << options.users << " books=" << options.books
+         << " readsPerUser=" << options.readsPerUser << " cores=" << thread::hardware_concurrency() << endl;
+
+    vector<size_t> threadCounts;
+    for (size_t threads = 1; threads < maxThreads; threads *= 2)
+    {
+        threadCounts.push_back(threads);
+    }
+    threadCounts.push_back(max<size_t>(1, maxThreads));
+
+    double baseSeconds = 0;
+    for (size_t threads : threadCounts)
+    {
+        system.setWorkerThreads(threads);
+        atomic<size_t> recommended{0};
+        auto start = chrono::steady_clock::now();
+        system.recommendAll(10, 10, [&recommended](uint32_t, IdSpan books)
+                            { recommended.fetch_add(books.size(), memory_order_relaxed); });
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        if (threads == 1)
+        {
+            baseSeconds = seconds;
+        }
+
+        cout << "threads=" << threads << " seconds=" << seconds
+             << " usersPerSecond=" << options.users / seconds
+             << " speedup=" << baseSeconds / seconds
+             << " books=" << recommended.load() << endl;
+    }
+    return 0;
+}
+
+// Query throughput while reads stream in: exact kNN queries of random
+// users on this thread for some seconds, first alone, then while a writer
+// thread calls addReadIds at readsPerSecond. Prints both query rates, the
+// rate the writer reached, the snapshots it published and its slowest
+// addRead, which includes a publish.
+int benchIngest(const SyntheticOptions &options, size_t readsPerSecond, double seconds)
+{
+    BookRecommendationSystem system;
+    generateSyntheticLibrary(system, options);
+    system.setNeighborCacheBudget(0);
+    shared_ptr<const GraphSnapshot> start = system.snapshot();
+    size_t users = start->users();
+    size_t books = start->books();
+    cout << "users=" << users << " books=" << books << " reads=" << start->reads()
+         << " cores=" << thread::hardware_concurrency() << endl;
+    if (users == 0 || books == 0)
+    {
+        return 1;
+    }
+
+    auto queryFor = [&system, &options, users](double duration)
+    {
+        mt19937_64 rng(options.seed + 2);
+        size_t queries = 0;
+        auto begin = chrono::steady_clock::now();
+        auto end = begin + chrono::duration<double>(duration);
+        while (chrono::steady_clock::now() < end)
+        {
+            system.kNNRecommendIds((uint32_t)(rng() % users), 10, 10);
+            queries++;
+        }
+        return queries / chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+    };
+    double idle = queryFor(seconds);
+
+    atomic<bool> stopping{false};
+    size_t written = 0;
+    double slowestMicros = 0;
+    thread writer([&]
+                  {
+                      mt19937_64 rng(options.seed + 3);
+                      auto begin = chrono::steady_clock::now();
+                      while (!stopping.load(memory_order_relaxed))
+                      {
+                          // Catch up to the target rate, then wait a millisecond
+                          double elapsed = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+                          for (; written < elapsed * readsPerSecond; ++written)
+                          {
+                              auto call = chrono::steady_clock::now();
+                              system.addReadIds((uint32_t)(rng() % users), (uint32_t)(rng() % books));
+                              slowestMicros = max(slowestMicros, chrono::duration<double, micro>(chrono::steady_clock::now() - call).count());
+                          }
+                          this_thread::sleep_for(chrono::milliseconds(1));
+                      }
+                  });
+    double ingesting = queryFor(seconds);
+    stopping = true;
+    writer.join();
+
+    cout << "idle queriesPerSecond=" << idle << endl;
+    cout << "ingesting queriesPerSecond=" << ingesting << " ratio=" << ingesting / idle
+         << " readsPerSecond=" << written / seconds << " snapshots=" << system.snapshot()->version - start->version
+         << " slowestAddReadMicros=" << slowestMicros << endl;
+    return 0;
+}
+
+// Time connected components and both projections over a synthetic library
+int benchAnalytics(const SyntheticOptions &options, const ProjectionOptions &projection)
+{
+    BookRecommendationSystem system;
+    generateSyntheticLibrary(system, options);
+    shared_ptr<const GraphSnapshot> current = system.snapshot();
+    cout << "users=" << options.users << " books=" << options.books << " reads=" << current->reads() << endl;
+
+    ComponentReport components = system.connectedComponents();
+    cout << "components=" << components.components() << " seconds=" << components.seconds;
+    if (components.components() > 0)
+    {
+        cout << " largestUsers=" << components.componentUsers[0] << " largestBooks=" << components.componentBooks[0];
+    }
+    cout << endl;
+
+    WeightedProjection users = system.projectUsers(projection);
+    cout << "userProjection edges=" << users.edgeCount() << " skippedBooks=" << users.skippedHubs
+         << " cutRows=" << users.cutRows << " seconds=" << users.seconds << endl;
+    WeightedProjection books = system.projectBooks(projection);
+    cout << "bookProjection edges=" << books.edgeCount() << " skippedUsers=" << books.skippedHubs
+         << " cutRows=" << books.cutRows << " seconds=" << books.seconds << endl;
+    return 0;
+}
+
+// Per-call latencies of one benchmarked operation
+class LatencySamples
+{
+private:
+    vector<double> micros;
+
+public:
+    template <typename Call>
+    void time(Call call)
+    {
+        auto start = chrono::steady_clock::now();
+        call();
+        micros.push_back(chrono::duration<double, micro>(chrono::steady_clock::now() - start).count());
+    }
+
+    void add(double sampleMicros)
+    {
+        micros.push_back(sampleMicros);
+    }
+
+    void merge(const LatencySamples &other)
+    {
+        micros.insert(micros.end(), other.micros.begin(), other.micros.end());
+    }
+
+    // JSON fields: call count, calls per second (of busy time, or of
+    // wallSeconds when calls overlapped), mean and percentile latencies in
+    // microseconds
+    void writeJson(ostream &out, double wallSeconds = 0)
+    {
+        sort(micros.begin(), micros.end());
+        double total = 0;
+        for (double sample : micros)
+        {
+            total += sample;
+        }
+        auto percentile = [this](double q)
+        {
+            return micros.empty() ? 0.0 : micros[min(micros.size() - 1, (size_t)(q * micros.size()))];
+        };
+        double seconds = wallSeconds > 0 ? wallSeconds : total * 1e-6;
+        out << "\"count\": " << micros.size()
+            << ", \"opsPerSecond\": " << (seconds > 0 ? micros.size() / seconds : 0.0)
+            << ", \"meanMicros\": " << (micros.empty() ? 0.0 : total / micros.size())
+            << ", \"p50Micros\": " << percentile(0.5) << ", \"p90Micros\": " << percentile(0.9)
+            << ", \"p99Micros\": " << percentile(0.99) << ", \"p999Micros\": " << percentile(0.999)
+            << ", \"maxMicros\": " << (micros.empty() ? 0.0 : micros.back());
+    }
+};
+
+// Settings of the benchmark suite
+struct BenchOptions
+{
+    SyntheticOptions library;
+    size_t queryUsers = 1000; // users sampled for each kNN benchmark
+    vector<int> ks{1, 5, 10, 50};
+    size_t batchUsers = 10000; // users in the recommendBatch benchmark
+    size_t newReads = 100000;  // addRead calls timed
+    size_t warmCacheBytes = size_t(256) << 20;
+};
+
+// Largest resident set of the process so far
+long peakRssKb()
+{
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+// Generate a library, then run the micro benchmarks (kNNRecommendBooks for
+// each k with the neighbor cache off and warm, addRead) and the macro ones
+// (recommendBatch, connectedComponents, projectUsers), and write the
+// results as one JSON document so builds can be compared. Sampled users
+// and reads come from seeded generators, so runs repeat exactly; the
+// resultBooks totals change only when recommendations do.
+int runBenchmarks(const BenchOptions &options, ostream &json)
+{
+    const SyntheticOptions &library = options.library;
+    BookRecommendationSystem system;
+    auto start = chrono::steady_clock::now();
+    generateSyntheticLibrary(system, library);
+    double generateSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    shared_ptr<const GraphSnapshot> current = system.snapshot();
+    long generatedRssKb = peakRssKb();
+
+    mt19937_64 rng(library.seed + 1);
+    vector<uint32_t> sample;
+    vector<string> sampleNames;
+    for (size_t i = 0; i < options.queryUsers && current->users() > 0; ++i)
+    {
+        sample.push_back((uint32_t)(rng() % current->users()));
+        sampleNames.emplace_back(system.userName(sample.back()));
+    }
+
+    vector<string> results;
+    auto knn = [&](const char *cache, int k)
+    {
+        LatencySamples samples;
+        size_t books = 0;
+        size_t empty = 0;
+        for (const string &name : sampleNames)
+        {
+            samples.time([&]
+                         {
+                             size_t found = system.kNNRecommendBooks(name, k, 10).size();
+                             books += found;
+                             empty += found == 0;
+                         });
+        }
+        ostringstream entry;
+        entry << "{\"name\": \"kNNRecommendBooks\", \"cache\": \"" << cache << "\", \"k\": " << k << ", ";
+        samples.writeJson(entry);
+        entry << ", \"resultBooks\": " << books << ", \"emptyResults\": " << empty << "}";
+        results.push_back(entry.str());
+    };
+    system.setNeighborCacheBudget(0);
+    for (int k : options.ks)
+    {
+        knn("off", k);
+    }
+    system.setNeighborCacheBudget(options.warmCacheBytes);
+    for (int k : options.ks)
+    {
+        for (const string &name : sampleNames)
+        {
+            system.kNNRecommendBooks(name, k, 10);
+        }
+        knn("warm", k);
+    }
+    system.setNeighborCacheBudget(0);
+
+    // Every similarity metric at k = 10, uncached
+    const pair<const char *, SimilarityMetric> metrics[] = {{"jaccard", SimilarityMetric::Jaccard},
+                                                            {"cosine", SimilarityMetric::Cosine},
+                                                            {"overlap", SimilarityMetric::Overlap},
+                                                            {"idfJaccard", SimilarityMetric::IdfJaccard}};
+    for (const auto &metric : metrics)
+    {
+        system.kNNRecommendBooks(sampleNames.empty() ? string() : sampleNames[0], 10, 10, RecommendEngine::ExactKnn,
+                                 metric.second); // builds idf weights outside the timing
+        LatencySamples samples;
+        size_t books = 0;
+        for (const string &name : sampleNames)
+        {
+            samples.time([&]
+                         { books += system.kNNRecommendBooks(name, 10, 10, RecommendEngine::ExactKnn, metric.second).size(); });
+        }
+        ostringstream entry;
+        entry << "{\"name\": \"similarity\", \"metric\": \"" << metric.first << "\", \"k\": 10, ";
+        samples.writeJson(entry);
+        entry << ", \"resultBooks\": " << books << "}";
+        results.push_back(entry.str());
+    }
+
+    // Personalized PageRank on the same users, to compare latency and
+    // empty results with exact kNN
+    {
+        RandomWalkOptions walks;
+        auto indexStart = chrono::steady_clock::now();
+        system.enableRandomWalks(walks);
+        double indexSeconds = chrono::duration<double>(chrono::steady_clock::now() - indexStart).count();
+        LatencySamples samples;
+        size_t books = 0;
+        size_t empty = 0;
+        for (const string &name : sampleNames)
+        {
+            samples.time([&]
+                         {
+                             size_t found = system.kNNRecommendBooks(name, 0, 10, RecommendEngine::RandomWalk).size();
+                             books += found;
+                             empty += found == 0;
+                         });
+        }
+        ostringstream entry;
+        entry << "{\"name\": \"randomWalk\", \"walks\": " << walks.walksPerQuery << ", \"restart\": " << walks.restart
+              << ", \"indexSeconds\": " << indexSeconds << ", ";
+        samples.writeJson(entry);
+        entry << ", \"resultBooks\": " << books << ", \"emptyResults\": " << empty << "}";
+        results.push_back(entry.str());
+    }
+
+    // Embeddings on the same users. The jaccard similarity entry is the
+    // kNN latency to compare with; overlapWithKnn is the share of exact
+    // kNN's books (k = 10) that the embedding engine also returns.
+    {
+        FactorOptions factorOptions;
+        string error;
+        auto trainStart = chrono::steady_clock::now();
+        system.trainFactors(factorOptions, error);
+        double trainSeconds = chrono::duration<double>(chrono::steady_clock::now() - trainStart).count();
+        LatencySamples samples;
+        size_t books = 0;
+        size_t knnBooks = 0;
+        size_t shared = 0;
+        for (const string &name : sampleNames)
+        {
+            vector<string> exact = system.kNNRecommendBooks(name, 10, 10);
+            vector<string> found;
+            samples.time([&]
+                         { found = system.kNNRecommendBooks(name, 0, 10, RecommendEngine::Embedding); });
+            books += found.size();
+            knnBooks += exact.size();
+            for (const string &title : found)
+            {
+                shared += find(exact.begin(), exact.end(), title) != exact.end();
+            }
+        }
+        ostringstream entry;
+        entry << "{\"name\": \"embedding\", \"factors\": " << factorOptions.factors << ", \"iterations\": "
+              << factorOptions.iterations << ", \"trainSeconds\": " << trainSeconds << ", ";
+        samples.writeJson(entry);
+        entry << ", \"resultBooks\": " << books << ", \"overlapWithKnn\": " << (knnBooks ? (double)shared / knnBooks : 0.0)
+              << "}";
+        results.push_back(entry.str());
+    }
+
+    {
+        vector<uint32_t> batch;
+        for (size_t i = 0; i < options.batchUsers && current->users() > 0; ++i)
+        {
+            batch.push_back((uint32_t)(rng() % current->users()));
+        }
+        atomic<size_t> books{0};
+        auto batchStart = chrono::steady_clock::now();
+        system.recommendBatch(IdSpan{batch.data(), batch.size()}, 10, 10, [&books](uint32_t, IdSpan recommended)
+                              { books.fetch_add(recommended.size(), memory_order_relaxed); });
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - batchStart).count();
+        ostringstream entry;
+        entry << "{\"name\": \"recommendBatch\", \"k\": 10, \"users\": " << batch.size()
+              << ", \"seconds\": " << seconds << ", \"opsPerSecond\": " << (seconds > 0 ? batch.size() / seconds : 0.0)
+              << ", \"resultBooks\": " << books.load() << "}";
+        results.push_back(entry.str());
+    }
+    {
+        ComponentReport components = system.connectedComponents();
+        ostringstream entry;
+        entry << "{\"name\": \"connectedComponents\", \"seconds\": " << components.seconds
+              << ", \"components\": " << components.components() << "}";
+        results.push_back(entry.str());
+    }
+    {
+        WeightedProjection projection = system.projectUsers(ProjectionOptions());
+        ostringstream entry;
+        entry << "{\"name\": \"projectUsers\", \"seconds\": " << projection.seconds
+              << ", \"edges\": " << projection.edgeCount() << "}";
+        results.push_back(entry.str());
+    }
+
+    // Mutating benchmarks last: uniformly drawn new reads, publishing
+    // whenever addRead decides to, then one final publish
+    {
+        LatencySamples samples;
+        size_t added = 0;
+        for (size_t i = 0; i < options.newReads && current->users() > 0 && current->books() > 0; ++i)
+        {
+            uint32_t user = (uint32_t)(rng() % current->users());
+            uint32_t book = (uint32_t)(rng() % current->books());
+            samples.time([&]
+                         { added += system.addReadIds(user, book); });
+        }
+        ostringstream entry;
+        entry << "{\"name\": \"addRead\", ";
+        samples.writeJson(entry);
+        entry << ", \"added\": " << added << "}";
+        results.push_back(entry.str());
+
+        auto publishStart = chrono::steady_clock::now();
+        system.publish();
+        entry.str("");
+        entry << "{\"name\": \"publish\", \"seconds\": "
+              << chrono::duration<double>(chrono::steady_clock::now() - publishStart).count() << "}";
+        results.push_back(entry.str());
+    }
+
+    json << "{\n  \"library\": {\"users\": " << current->users() << ", \"books\": " << current->books()
+         << ", \"reads\": " << current->reads() << ", \"bookSkew\": " << library.bookSkew
+         << ", \"activityShape\": " << library.activityShape << ", \"seed\": " << library.seed
+         << ", \"generateSeconds\": " << generateSeconds << "},\n";
+    json << "  \"threads\": " << thread::hardware_concurrency() << ",\n  \"benchmarks\": [\n";
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        json << "    " << results[i] << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+    json << "  ],\n  \"stats\": " << system.stats().json() << ",\n  \"generatedRssKb\": " << generatedRssKb << ",\n  \"peakRssKb\": " << peakRssKb() << "\n}\n";
+    return 0;
+}
+
+// Event log ingest and recovery: bulk-load a synthetic library and then
+// single reads into a data directory, and time replaying it and, after
+// compaction, opening its snapshot
+int benchEventLog(const string &directory, const SyntheticOptions &options, size_t newReads)
+{
+    EventLogOptions logOptions;
+    logOptions.compactBytes = 0; // compaction is timed explicitly below
+    RecoveryReport recovery;
+    string error;
+    {
+        BookRecommendationSystem system;
+        if (!system.openDurable(directory, logOptions, recovery, error))
+        {
+            cout << error << endl;
+            return 1;
+        }
+
+        auto start = chrono::steady_clock::now();
+        generateSyntheticLibrary(system, options);
+        double bulkSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        uint64_t bulkEvents = system.eventLogStats().events;
+        cout << "bulk events=" << bulkEvents << " seconds=" << bulkSeconds << " eventsPerSecond=" << bulkEvents / bulkSeconds
+             << endl;
+
+        mt19937_64 rng(options.seed + 2);
+        LatencySamples samples;
+        start = chrono::steady_clock::now();
+        for (size_t i = 0; i < newReads && options.users > 0 && options.books > 0; ++i)
+        {
+            uint32_t user = (uint32_t)(rng() % options.users);
+            uint32_t book = (uint32_t)(rng() % options.books);
+            samples.time([&]
+                         { system.addReadIds(user, book); });
+        }
+        if (!system.syncLog(error))
+        {
+            cout << error << endl;
+            return 1;
+        }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        EventLogStats stats = system.eventLogStats();
+        uint64_t events = stats.events - bulkEvents;
+        cout << "addRead events=" << events << " seconds=" << seconds << " eventsPerSecond=" << events / seconds << " ";
+        samples.writeJson(cout);
+        cout << endl;
+        cout << "log commits=" << stats.commits << " eventsPerCommit=" << (stats.commits ? stats.events / stats.commits : 0)
+             << " syncSeconds=" << stats.syncSeconds << " bytes=" << stats.fileBytes << endl;
+    }
+
+    {
+        BookRecommendationSystem system;
+        if (!system.openDurable(directory, logOptions, recovery, error))
+        {
+            cout << error << endl;
+            return 1;
+        }
+        cout << "replay events=" << recovery.events << " seconds=" << recovery.seconds
+             << " reads=" << system.snapshot()->reads() << endl;
+        auto start = chrono::steady_clock::now();
+        if (!system.compact(error))
+        {
+            cout << error << endl;
+            return 1;
+        }
+        cout << "compact seconds=" << chrono::duration<double>(chrono::steady_clock::now() - start).count() << endl;
+    }
+
+    BookRecommendationSystem system;
+    if (!system.openDurable(directory, logOptions, recovery, error))
+    {
+        cout << error << endl;
+        return 1;
+    }
+    cout << "reopen snapshot=" << recovery.snapshotLoaded << " events=" << recovery.events
+         << " seconds=" << recovery.seconds << " reads=" << system.snapshot()->reads() << endl;
+    return 0;
+}
+
+// Split a request line into its tab-separated fields
+vector<string_view> splitFields(string_view line)
+{
+    vector<string_view> fields;
+    for (;;)
+    {
+        size_t tab = line.find('\t');
+        fields.push_back(line.substr(0, tab));
+        if (tab == string_view::npos)
+        {
+            return fields;
+        }
+        line.remove_prefix(tab + 1);
+    }
+}
+
+// Optional numeric field, or fallback when absent or malformed
+size_t numberField(const vector<string_view> &fields, size_t index, size_t fallback)
+{
+    if (index >= fields.size() || fields[index].empty())
+    {
+        return fallback;
+    }
+    size_t value = 0;
+    for (char c : fields[index])
+    {
+        if (c < '0' || c > '9' || value > SIZE_MAX / 10)
+        {
+            return fallback;
+        }
+        value = value * 10 + (c - '0');
+    }
+    return value;
+}
+
+// Ids in fields [begin, end); malformed ones become kInvalidId
+vector<uint32_t> idFields(const vector<string_view> &fields, size_t begin, size_t end)
+{
+    vector<uint32_t> ids;
+    ids.reserve(end > begin ? end - begin : 0);
+    for (size_t i = begin; i < end; ++i)
+    {
+        ids.push_back((uint32_t)min<size_t>(numberField(fields, i, kInvalidId), kInvalidId));
+    }
+    return ids;
+}
+
+// Protocol names of the similarity metrics, by SimilarityMetric value
+const char *const kMetricNames[] = {"jaccard", "cosine", "overlap", "idf"};
+
+bool parseMetric(string_view name, SimilarityMetric &metric)
+{
+    for (size_t i = 0; i < sizeof(kMetricNames) / sizeof(kMetricNames[0]); ++i)
+    {
+        if (name == kMetricNames[i])
+        {
+            metric = (SimilarityMetric)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Settings of the query server
+struct ServerOptions
+{
+    string socketPath;      // Unix socket to listen on; empty serves stdin and stdout
+    size_t maxBatch = 1024; // recommendation requests per worker pool batch
+    int defaultK = 2;
+    size_t defaultResults = 10;
+    size_t maxLine = 1 << 20; // longer requests close the connection
+};
+
+// Long-running query server over a loaded system. One thread runs a poll()
+// loop over the listening socket and every connection. Each request is one
+// line of tab-separated fields, and replies go back one line per request
+// in request order, so clients may pipeline. Only stats and quit are
+// answered on the loop thread, which otherwise just moves bytes: every
+// other request, from all connections, is collected and handed to a batch
+// thread, which runs them in arrival order. Runs of recommendations go to
+// the worker pool as one recommendRequests() call, and ingest, publish
+// and shard requests run one by one between them, so each request sees
+// the effect of those before it. While a batch runs the next one
+// accumulates, so batches grow with load.
+//
+//   recommend<TAB>user[<TAB>k[<TAB>maxResults[<TAB>exact|minhash|item|walk|embedding[<TAB>jaccard|cosine|overlap|idf]]]]
+//                           -> ok[<TAB>title]...
+//   read<TAB>user<TAB>title -> ok<TAB>added | ok<TAB>duplicate
+//   publish                 -> ok
+//   stats                   -> ok<TAB>{json}
+//   users<TAB>n             -> ok[<TAB>name]... (the first n users)
+//   quit                    -> ok, then the connection is closed
+//
+// Shard requests, sent by a ShardedLibrary coordinator. Ids are the
+// shard's own; books are given as sorted ids:
+//
+//   addbook<TAB>title       -> ok<TAB>book
+//   adduser<TAB>name        -> ok<TAB>user
+//   addreads[<TAB>user<TAB>book]...  -> ok<TAB>added
+//   neighbors<TAB>k<TAB>metric<TAB>user -> ok<TAB>n<TAB>book...(n)[<TAB>user<TAB>score]...
+//   neighbors<TAB>k<TAB>metric<TAB>-[<TAB>book]... -> ok<TAB>0[<TAB>user<TAB>score]...
+//   votes<TAB>n<TAB>user...(n)[<TAB>book]...  -> ok[<TAB>book<TAB>votes]...
+//
+// neighbors answers exact kNN for a user, returning its books first, or
+// for a reader of the given books; scores are hex floats, so they survive
+// the trip exactly. votes counts the books the users read, leaving out
+// the given ones.
+//
+// Failures reply error<TAB>message. Names cannot contain tabs or newlines.
+class QueryServer
+{
+private:
+    struct Reply
+    {
+        bool ready = false;
+        string text;
+    };
+
+    struct Connection
+    {
+        int readFd = -1;
+        int writeFd = -1;
+        bool socket = true;
+        string input;
+        string output;
+        deque<Reply> replies;   // unsent, in request order
+        uint64_t firstReply = 0; // sequence number of replies.front()
+        bool closing = false;    // no more requests: EOF, quit or error
+    };
+
+    // A request waiting for, or coming back from, the batch thread
+    struct Job
+    {
+        uint64_t connection;
+        uint64_t sequence;
+        string line;
+        string reply;
+    };
+
+    BookRecommendationSystem &system;
+    ServerOptions options;
+    unordered_map<uint64_t, Connection> connections;
+    uint64_t nextConnection = 0;
+    int listenFd = -1;
+    int wakeFds[2] = {-1, -1}; // batch thread -> loop
+
+    vector<Job> collecting; // loop thread only
+    bool batchRunning = false;
+
+    mutex batchLock;
+    condition_variable batchReady;
+    vector<Job> submitted; // under batchLock
+    vector<Job> finished;  // under batchLock
+    bool stopping = false; // under batchLock
+
+    // Batch thread: answer each submitted batch in order. Consecutive
+    // recommendations are answered together on the worker pool, before
+    // the next request of any other kind runs.
+    void runBatches()
+    {
+        vector<RecommendRequest> requests;
+        vector<size_t> requestJobs; // job index of each request
+        for (;;)
+        {
+            vector<Job> jobs;
+            {
+                unique_lock<mutex> guard(batchLock);
+                batchReady.wait(guard, [this]
+                                { return stopping || !submitted.empty(); });
+                if (submitted.empty())
+                {
+                    return;
+                }
+                jobs.swap(submitted);
+            }
+
+            auto recommendPending = [this, &jobs, &requests, &requestJobs]
+            {
+                if (requests.empty())
+                {
+                    return;
+                }
+                system.recommendRequests(requests, [this, &jobs, &requestJobs](size_t index, IdSpan books)
+                                         {
+                                             string &reply = jobs[requestJobs[index]].reply;
+                                             reply = "ok";
+                                             for (uint32_t book : books)
+                                             {
+                                                 reply += '\t';
+                                                 reply += system.bookTitle(book);
+                                             }
+                                         });
+                requests.clear();
+                requestJobs.clear();
+            };
+            for (size_t i = 0; i < jobs.size(); ++i)
+            {
+                vector<string_view> fields = splitFields(jobs[i].line);
+                if (fields[0] == "recommend" && fields.size() >= 2)
+                {
+                    RecommendRequest request;
+                    jobs[i].reply = parseRecommend(fields, request);
+                    if (jobs[i].reply.empty())
+                    {
+                        requests.push_back(request);
+                        requestJobs.push_back(i);
+                    }
+                }
+                else
+                {
+                    recommendPending();
+                    jobs[i].reply = execute(fields);
+                }
+            }
+            recommendPending();
+
+            {
+                lock_guard<mutex> guard(batchLock);
+                finished = move(jobs);
+            }
+            char wake = 1;
+            while (write(wakeFds[1], &wake, 1) < 0 && errno == EINTR)
+            {
+            }
+        }
+    }
+
+    void submitBatch()
+    {
+        if (batchRunning || collecting.empty())
+        {
+            return;
+        }
+        size_t count = min(options.maxBatch, collecting.size());
+        {
+            lock_guard<mutex> guard(batchLock);
+            submitted.assign(make_move_iterator(collecting.begin()), make_move_iterator(collecting.begin() + count));
+        }
+        collecting.erase(collecting.begin(), collecting.begin() + count);
+        batchRunning = true;
+        batchReady.notify_one();
+    }
+
+    void collectFinished()
+    {
+        char drain[64];
+        while (read(wakeFds[0], drain, sizeof(drain)) > 0)
+        {
+        }
+        vector<Job> jobs;
+        {
+            lock_guard<mutex> guard(batchLock);
+            jobs.swap(finished);
+        }
+        if (jobs.empty())
+        {
+            return;
+        }
+        batchRunning = false;
+        for (Job &job : jobs)
+        {
+            auto it = connections.find(job.connection);
+            if (it != connections.end())
+            {
+                answer(it->second, job.sequence, move(job.reply));
+            }
+        }
+    }
+
+    // Fill a reply slot and queue every reply that is now next in line
+    void answer(Connection &connection, uint64_t sequence, string text)
+    {
+        Reply &reply = connection.replies[sequence - connection.firstReply];
+        reply.ready = true;
+        reply.text = move(text);
+        while (!connection.replies.empty() && connection.replies.front().ready)
+        {
+            connection.output += connection.replies.front().text;
+            connection.output += '\n';
+            connection.replies.pop_front();
+            connection.firstReply++;
+        }
+    }
+
+    // Batch thread: fill request from a recommend line, or return the
+    // error reply
+    string parseRecommend(const vector<string_view> &fields, RecommendRequest &request)
+    {
+        request.user = system.userId(fields[1]);
+        request.k = (int)min<size_t>(numberField(fields, 2, options.defaultK), INT32_MAX);
+        request.maxResults = numberField(fields, 3, options.defaultResults);
+        string_view engine = fields.size() > 4 ? fields[4] : "exact";
+        if (request.user == kInvalidId)
+        {
+            return "error\tUser not found.";
+        }
+        if (engine != "exact" && engine != "minhash" && engine != "item" && engine != "walk" && engine != "embedding")
+        {
+            return "error\tUnknown engine.";
+        }
+        if (fields.size() > 5 && !parseMetric(fields[5], request.metric))
+        {
+            return "error\tUnknown metric.";
+        }
+        request.engine = engine == "minhash"     ? RecommendEngine::MinHashKnn
+                         : engine == "item"      ? RecommendEngine::ItemBased
+                         : engine == "walk"      ? RecommendEngine::RandomWalk
+                         : engine == "embedding" ? RecommendEngine::Embedding
+                                                 : RecommendEngine::ExactKnn;
+        return string();
+    }
+
+    // The reply to a mutation: an error once the event log has failed,
+    // since the mutation was then refused or may not be durable
+    string logFailure(string reply) const
+    {
+        string error = system.logError();
+        return error.empty() ? reply : "error\t" + error;
+    }
+
+    // Batch thread: run any request but recommend, stats and quit
+    string execute(const vector<string_view> &fields)
+    {
+        string_view verb = fields[0];
+        if (verb == "read" && fields.size() == 3)
+        {
+            uint32_t user = system.userId(fields[1]);
+            uint32_t book = system.bookId(fields[2]);
+            if (user == kInvalidId || book == kInvalidId)
+            {
+                return "error\tUser or book not found.";
+            }
+            bool added = system.addReadIds(user, book);
+            return logFailure(added ? "ok\tadded" : "ok\tduplicate");
+        }
+        if (verb == "addbook" && fields.size() == 2)
+        {
+            return logFailure("ok\t" + to_string(system.internBook(fields[1])));
+        }
+        if (verb == "adduser" && fields.size() == 2)
+        {
+            return logFailure("ok\t" + to_string(system.internUser(fields[1])));
+        }
+        if (verb == "addreads" && fields.size() % 2 == 1)
+        {
+            size_t added = 0;
+            vector<uint32_t> ids = idFields(fields, 1, fields.size());
+            for (size_t i = 0; i < ids.size(); i += 2)
+            {
+                if (ids[i] < system.userCount() && ids[i + 1] < system.bookCount())
+                {
+                    added += system.addReadIds(ids[i], ids[i + 1]);
+                }
+            }
+            return logFailure("ok\t" + to_string(added));
+        }
+        if (verb == "neighbors" && fields.size() >= 4)
+        {
+            SimilarityMetric metric;
+            int k = (int)min<size_t>(numberField(fields, 1, options.defaultK), INT32_MAX);
+            uint32_t user = fields[3] == "-" ? kInvalidId : (uint32_t)min<size_t>(numberField(fields, 3, kInvalidId), kInvalidId);
+            if (!parseMetric(fields[2], metric))
+            {
+                return "error\tUnknown metric.";
+            }
+            if (fields[3] != "-" && user >= system.userCount())
+            {
+                return "error\tUser not found.";
+            }
+
+            // A user's own books come back first, for the other shards
+            vector<uint32_t> books;
+            string reply = "ok";
+            if (user != kInvalidId)
+            {
+                shared_ptr<const GraphSnapshot> current = system.snapshot();
+                IdSpan own = current->booksRead(user);
+                books.assign(own.begin(), own.end());
+            }
+            else
+            {
+                books = idFields(fields, 4, fields.size());
+                sort(books.begin(), books.end());
+                books.erase(unique(books.begin(), books.end()), books.end());
+            }
+            reply += '\t';
+            reply += to_string(user != kInvalidId ? books.size() : 0);
+            for (size_t i = 0; user != kInvalidId && i < books.size(); ++i)
+            {
+                reply += '\t';
+                reply += to_string(books[i]);
+            }
+            char score[32];
+            for (const auto &entry : system.nearestToBooks(IdSpan{books.data(), books.size()}, user, k, metric))
+            {
+                snprintf(score, sizeof(score), "%a", entry.first); // exact round trip
+                reply += '\t';
+                reply += to_string(entry.second);
+                reply += '\t';
+                reply += score;
+            }
+            return reply;
+        }
+        if (verb == "votes" && fields.size() >= 2)
+        {
+            size_t count = min(numberField(fields, 1, 0), fields.size() - 2);
+            vector<uint32_t> users = idFields(fields, 2, 2 + count);
+            vector<uint32_t> exclude = idFields(fields, 2 + count, fields.size());
+            sort(exclude.begin(), exclude.end());
+            string reply = "ok";
+            for (const auto &vote : system.countVotes(IdSpan{users.data(), users.size()}, IdSpan{exclude.data(), exclude.size()}))
+            {
+                reply += '\t';
+                reply += to_string(vote.first);
+                reply += '\t';
+                reply += to_string(vote.second);
+            }
+            return reply;
+        }
+        if (verb == "publish")
+        {
+            system.publish();
+            return "ok";
+        }
+        if (verb == "users")
+        {
+            string reply = "ok";
+            size_t count = min(numberField(fields, 1, 0), system.userCount());
+            for (uint32_t user = 0; user < count; ++user)
+            {
+                reply += '\t';
+                reply += system.userName(user);
+            }
+            return reply;
+        }
+        return "error\tUnknown request.";
+    }
+
+    void handle(uint64_t id, Connection &connection, string_view line)
+    {
+        uint64_t sequence = connection.firstReply + connection.replies.size();
+        connection.replies.emplace_back();
+        string_view verb = line.substr(0, line.find('\t'));
+        if (verb == "stats")
+        {
+            answer(connection, sequence, "ok\t" + system.stats().json());
+        }
+        else if (verb == "quit")
+        {
+            answer(connection, sequence, "ok");
+            connection.closing = true;
+        }
+        else
+        {
+            collecting.push_back({id, sequence, string(line), string()});
+        }
+    }
+
+    // Read what is available and handle every complete line
+    void receive(uint64_t id, Connection &connection)
+    {
+        char chunk[1 << 16];
+        ssize_t got = connection.socket ? recv(connection.readFd, chunk, sizeof(chunk), MSG_DONTWAIT)
+                                        : read(connection.readFd, chunk, sizeof(chunk));
+        if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        {
+            return;
+        }
+        if (got <= 0)
+        {
+            connection.closing = true;
+            if (!connection.input.empty())
+            {
+                handle(id, connection, connection.input); // last line without a newline
+                connection.input.clear();
+            }
+            return;
+        }
+
+        connection.input.append(chunk, (size_t)got);
+        size_t start = 0;
+        size_t end;
+        while (!connection.closing && (end = connection.input.find('\n', start)) != string::npos)
+        {
+            string_view line(connection.input.data() + start, end - start);
+            if (!line.empty() && line.back() == '\r')
+            {
+                line.remove_suffix(1);
+            }
+            if (!line.empty())
+            {
+                handle(id, connection, line);
+            }
+            start = end + 1;
+        }
+        connection.input.erase(0, connection.closing ? connection.input.size() : start);
+        if (connection.input.size() > options.maxLine)
+        {
+            uint64_t sequence = connection.firstReply + connection.replies.size();
+            connection.replies.emplace_back();
+            answer(connection, sequence, "error\tRequest too long.");
+            connection.input.clear();
+            connection.closing = true;
+        }
+    }
+
+    // Write queued replies; sockets take what they can without blocking
+    void send(Connection &connection)
+    {
+        size_t sent = 0;
+        while (sent < connection.output.size())
+        {
+            ssize_t wrote = connection.socket
+                                ? ::send(connection.writeFd, connection.output.data() + sent,
+                                         connection.output.size() - sent, MSG_DONTWAIT | MSG_NOSIGNAL)
+                                : write(connection.writeFd, connection.output.data() + sent, connection.output.size() - sent);
+            if (wrote < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (wrote < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            {
+                break;
+            }
+            if (wrote <= 0)
+            {
+                connection.output.clear(); // peer went away
+                connection.replies.clear();
+                connection.closing = true;
+                return;
+            }
+            sent += (size_t)wrote;
+        }
+        connection.output.erase(0, sent);
+    }
+
+    void accept()
+    {
+        for (;;)
+        {
+            int fd = ::accept(listenFd, nullptr, nullptr);
+            if (fd < 0)
+            {
+                return;
+            }
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+            Connection &connection = connections[nextConnection++];
+            connection.readFd = fd;
+            connection.writeFd = fd;
+        }
+    }
+
+    bool listen(string &error)
+    {
+        sockaddr_un address;
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        if (options.socketPath.size() >= sizeof(address.sun_path))
+        {
+            error = "Socket path too long: " + options.socketPath;
+            return false;
+        }
+        memcpy(address.sun_path, options.socketPath.c_str(), options.socketPath.size() + 1);
+        unlink(options.socketPath.c_str());
+
+        listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listenFd < 0 || bind(listenFd, (sockaddr *)&address, sizeof(address)) != 0 || ::listen(listenFd, 128) != 0)
+        {
+            error = "Cannot listen on " + options.socketPath + ": " + strerror(errno);
+            return false;
+        }
+        fcntl(listenFd, F_SETFL, fcntl(listenFd, F_GETFL) | O_NONBLOCK);
+        return true;
+    }
+
+public:
+    QueryServer(BookRecommendationSystem &served, const ServerOptions &settings) : system(served), options(settings)
+    {
+    }
+
+    // Serve until stdin closes (stdin mode) or forever (socket mode)
+    bool run(string &error)
+    {
+        signal(SIGPIPE, SIG_IGN);
+        if (pipe(wakeFds) != 0)
+        {
+            error = string("Cannot create pipe: ") + strerror(errno);
+            return false;
+        }
+        fcntl(wakeFds[0], F_SETFL, fcntl(wakeFds[0], F_GETFL) | O_NONBLOCK);
+        if (!options.socketPath.empty())
+        {
+            if (!listen(error))
+            {
+                return false;
+            }
+        }
+        else
+        {
+            Connection &console = connections[nextConnection++];
+            console.readFd = STDIN_FILENO;
+            console.writeFd = STDOUT_FILENO;
+            console.socket = false;
+        }
+        thread batches(&QueryServer::runBatches, this);
+
+        vector<pollfd> polled;
+        vector<uint64_t> polledIds;
+        while (listenFd >= 0 || !connections.empty())
+        {
+            polled.assign(1, pollfd{wakeFds[0], POLLIN, 0});
+            polledIds.assign(1, 0);
+            if (listenFd >= 0)
+            {
+                polled.push_back({listenFd, POLLIN, 0});
+                polledIds.push_back(0);
+            }
+            for (auto &entry : connections)
+            {
+                Connection &connection = entry.second;
+                if (!connection.closing)
+                {
+                    polled.push_back({connection.readFd, POLLIN, 0});
+                    polledIds.push_back(entry.first);
+                }
+                if (connection.socket && !connection.output.empty())
+                {
+                    polled.push_back({connection.writeFd, POLLOUT, 0});
+                    polledIds.push_back(entry.first);
+                }
+            }
+            if (poll(polled.data(), polled.size(), -1) < 0 && errno != EINTR)
+            {
+                error = string("poll failed: ") + strerror(errno);
+                break;
+            }
+
+            if (polled[0].revents)
+            {
+                collectFinished();
+            }
+            for (size_t i = 1; i < polled.size(); ++i)
+            {
+                if (!polled[i].revents)
+                {
+                    continue;
+                }
+                if (polled[i].fd == listenFd)
+                {
+                    accept();
+                    continue;
+                }
+                auto it = connections.find(polledIds[i]);
+                if (it == connections.end())
+                {
+                    continue;
+                }
+                if (polled[i].events == POLLIN)
+                {
+                    receive(it->first, it->second);
+                }
+                else
+                {
+                    send(it->second);
+                }
+            }
+
+            submitBatch();
+            for (auto it = connections.begin(); it != connections.end();)
+            {
+                Connection &connection = it->second;
+                if (!connection.output.empty() && (!connection.socket || connection.closing))
+                {
+                    send(connection); // stdout blocks; closing sockets try again below
+                }
+                if (connection.closing && connection.replies.empty() && connection.output.empty())
+                {
+                    if (connection.socket)
+                    {
+                        close(connection.readFd);
+                    }
+                    it = connections.erase(it);
+                }
+                else
+                {
+                    ++it;
+                }
+            }
+        }
+
+        {
+            lock_guard<mutex> guard(batchLock);
+            stopping = true;
+        }
+        batchReady.notify_one();
+        batches.join();
+        close(wakeFds[0]);
+        close(wakeFds[1]);
+        return error.empty();
+    }
+};
+
+// Settings of the load generator
+struct LoadGenOptions
+{
+    string socketPath;
+    size_t connections = 4;
+    size_t pipeline = 8; // requests in flight per connection
+    double seconds = 10;
+    size_t users = 10000; // queries pick among the server's first users
+    int k = 10;
+    uint64_t seed = 42;
+};
+
+// Blocking client connection speaking the server's line protocol
+class LineClient
+{
+private:
+    int fd = -1;
+    string buffered;
+
+public:
+    ~LineClient()
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+    }
+
+    bool connect(const string &path)
+    {
+        sockaddr_un address;
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(address.sun_path))
+        {
+            return false;
+        }
+        memcpy(address.sun_path, path.c_str(), path.size() + 1);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        return fd >= 0 && ::connect(fd, (sockaddr *)&address, sizeof(address)) == 0;
+    }
+
+    bool send(const string &text)
+    {
+        size_t sent = 0;
+        while (sent < text.size())
+        {
+            ssize_t wrote = ::send(fd, text.data() + sent, text.size() - sent, MSG_NOSIGNAL);
+            if (wrote <= 0 && errno != EINTR)
+            {
+                return false;
+            }
+            sent += wrote > 0 ? (size_t)wrote : 0;
+        }
+        return true;
+    }
+
+    bool receive(string &line)
+    {
+        for (;;)
+        {
+            size_t end = buffered.find('\n');
+            if (end != string::npos)
+            {
+                line.assign(buffered, 0, end);
+                buffered.erase(0, end + 1);
+                return true;
+            }
+            char chunk[1 << 16];
+            ssize_t got = recv(fd, chunk, sizeof(chunk), 0);
+            if (got < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (got <= 0)
+            {
+                return false;
+            }
+            buffered.append(chunk, (size_t)got);
+        }
+    }
+};
+
+// Drive a running server with recommend requests from several pipelined
+// connections for a fixed time and report sustained QPS and latency
+// percentiles (send to reply, so queueing counts) as JSON
+int runLoadGenerator(const LoadGenOptions &options, ostream &json)
+{
+    // The users to query, fetched from the server itself
+    vector<string> names;
+    {
+        LineClient client;
+        string reply;
+        if (!client.connect(options.socketPath) || !client.send("users\t" + to_string(options.users) + "\n") ||
+            !client.receive(reply))
+        {
+            cout << "Cannot reach " << options.socketPath << endl;
+            return 1;
+        }
+        vector<string_view> fields = splitFields(reply);
+        for (size_t i = 1; i < fields.size(); ++i)
+        {
+            names.emplace_back(fields[i]);
+        }
+        if (names.empty())
+        {
+            cout << "The server has no users." << endl;
+            return 1;
+        }
+    }
+
+    vector<LatencySamples> samples(options.connections);
+    vector<size_t> errors(options.connections, 0);
+    auto start = chrono::steady_clock::now();
+    auto deadline = start + chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(options.seconds));
+    vector<thread> clients;
+    for (size_t c = 0; c < options.connections; ++c)
+    {
+        clients.emplace_back([&, c]
+                             {
+                                 LineClient client;
+                                 if (!client.connect(options.socketPath))
+                                 {
+                                     errors[c]++;
+                                     return;
+                                 }
+                                 mt19937_64 rng(options.seed + c);
+                                 deque<chrono::steady_clock::time_point> sent;
+                                 auto request = [&]
+                                 {
+                                     sent.push_back(chrono::steady_clock::now());
+                                     return client.send("recommend\t" + names[rng() % names.size()] + "\t" + to_string(options.k) + "\n");
+                                 };
+                                 bool ok = true;
+                                 for (size_t i = 0; i < max<size_t>(1, options.pipeline) && ok; ++i)
+                                 {
+                                     ok = request();
+                                 }
+                                 string reply;
+                                 while (ok && !sent.empty() && client.receive(reply))
+                                 {
+                                     auto now = chrono::steady_clock::now();
+                                     samples[c].add(chrono::duration<double, micro>(now - sent.front()).count());
+                                     sent.pop_front();
+                                     errors[c] += reply.compare(0, 2, "ok") != 0;
+                                     if (now < deadline)
+                                     {
+                                         ok = request();
+                                     }
+                                 }
+                             });
+    }
+    for (thread &client : clients)
+    {
+        client.join();
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    LatencySamples total;
+    size_t failed = 0;
+    for (size_t c = 0; c < options.connections; ++c)
+    {
+        total.merge(samples[c]);
+        failed += errors[c];
+    }
+    json << "{\"name\": \"loadgen\", \"connections\": " << options.connections << ", \"pipeline\": " << options.pipeline
+         << ", \"k\": " << options.k << ", \"seconds\": " << seconds << ", ";
+    total.writeJson(json, seconds);
+    json << ", \"errors\": " << failed << "}" << endl;
+    return 0;
+}
+
+// Coordinator of a library hash-partitioned over shard processes, each a
+// QueryServer over its own BookRecommendationSystem (demo shard). A user
+// and its reads live on shard hashName(user) % shards. Every shard holds
+// the whole catalog, with reader lists of its own users only. Books reach
+// every shard in the same order, so a book has the same id everywhere.
+// Users are numbered per shard in arrival order, so a shard's ids sort
+// like the global ids and its tie-breaks agree with a single node's.
+//
+// An exact kNN query takes three round trips. First the target's shard
+// returns its books and local neighbors. Then the other shards score
+// their users against those books in parallel. Last, the shards holding
+// the merged top k count their books. Scores and votes are exact, so
+// results equal a single node's, ties included. IdfJaccard is refused,
+// since idf needs reader counts no single shard has. Not thread-safe: one
+// coordinator per calling thread.
+class ShardedLibrary
+{
+private:
+    struct Shard
+    {
+        LineClient client;
+        string outgoing;             // requests not yet sent
+        deque<uint32_t> expected;    // id each unread reply must carry, or kInvalidId
+        size_t unanswered = 0;       // query replies owed to answer()
+        vector<uint32_t> globalUser; // by shard user id
+    };
+
+    vector<unique_ptr<Shard>> shards;
+    StringInterner titles;
+    StringInterner names;
+    vector<pair<uint32_t, uint32_t>> placement; // by user: (shard, shard user id)
+    string failure;                             // first ingest failure or lost shard
+
+    vector<uint32_t> bookVotes; // zero between queries
+    vector<uint32_t> votedBooks;
+    TopKSelector<double> nearestUsers;
+    TopKSelector<uint32_t> topBooks;
+
+    // Buffered ingest requests and unread replies per shard before either
+    // is forced out, to bound both sides' memory
+    static constexpr size_t kFlushBytes = size_t(1) << 16;
+    static constexpr size_t kMaxUnread = size_t(1) << 16;
+
+    // Reads per addreads request
+    static constexpr size_t kReadsPerRequest = 4096;
+
+    void request(size_t index, string_view line, uint32_t expectedId)
+    {
+        Shard &shard = *shards[index];
+        shard.outgoing.append(line.data(), line.size());
+        shard.outgoing += '\n';
+        shard.expected.push_back(expectedId);
+        if (shard.outgoing.size() >= kFlushBytes)
+        {
+            flush(index);
+        }
+        if (shard.expected.size() >= kMaxUnread)
+        {
+            drain(index, nullptr);
+        }
+    }
+
+    bool flush(size_t index)
+    {
+        Shard &shard = *shards[index];
+        if (!shard.outgoing.empty() && !shard.client.send(shard.outgoing) && failure.empty())
+        {
+            failure = "Lost shard " + to_string(index);
+        }
+        shard.outgoing.clear();
+        return failure.empty();
+    }
+
+    // Read every unread ingest reply, checking assigned ids and adding up
+    // the counts of new reads into added
+    bool drain(size_t index, size_t *added)
+    {
+        Shard &shard = *shards[index];
+        flush(index);
+        string reply;
+        while (!shard.expected.empty() && failure.empty())
+        {
+            uint32_t expectedId = shard.expected.front();
+            shard.expected.pop_front();
+            if (!shard.client.receive(reply))
+            {
+                failure = "Lost shard " + to_string(index);
+                break;
+            }
+            vector<string_view> fields = splitFields(reply);
+            size_t value = numberField(fields, 1, SIZE_MAX);
+            if (fields[0] != "ok" || (expectedId != kInvalidId && value != expectedId))
+            {
+                failure = "Shard " + to_string(index) + " is not empty or failed: " + reply;
+            }
+            else if (added && expectedId == kInvalidId && value != SIZE_MAX)
+            {
+                *added += value;
+            }
+        }
+        shard.expected.clear();
+        return failure.empty();
+    }
+
+    bool drainAll(size_t *added)
+    {
+        for (size_t i = 0; i < shards.size(); ++i)
+        {
+            drain(i, added);
+        }
+        return failure.empty();
+    }
+
+    // A shard whose connection failed may be mid-reply, so nothing it
+    // sends can be trusted again: the loss is sticky
+    bool lose(size_t index, string &error)
+    {
+        if (failure.empty())
+        {
+            failure = "Lost shard " + to_string(index);
+        }
+        error = failure;
+        return false;
+    }
+
+    // Send one query line to a shard; answer() reads the reply
+    bool ask(size_t index, const string &line, string &error)
+    {
+        if (!shards[index]->client.send(line + "\n"))
+        {
+            return lose(index, error);
+        }
+        shards[index]->unanswered++;
+        return true;
+    }
+
+    // Receive a shard's reply to ask(); fields view into reply
+    bool answer(size_t index, string &reply, vector<string_view> &fields, string &error)
+    {
+        Shard &shard = *shards[index];
+        if (!shard.client.receive(reply))
+        {
+            return lose(index, error);
+        }
+        shard.unanswered--;
+        fields = splitFields(reply);
+        if (fields[0] != "ok")
+        {
+            error = "Shard " + to_string(index) + ": " + reply;
+            return false;
+        }
+        return true;
+    }
+
+    // Give up on a query: read and drop the replies other shards still owe
+    // it, so the next query does not take them for its own. Returns false.
+    bool abandon()
+    {
+        string reply;
+        for (size_t i = 0; i < shards.size(); ++i)
+        {
+            Shard &shard = *shards[i];
+            for (; shard.unanswered > 0 && failure.empty(); shard.unanswered--)
+            {
+                if (!shard.client.receive(reply))
+                {
+                    failure = "Lost shard " + to_string(i);
+                }
+            }
+        }
+        return false;
+    }
+
+    // Merge (user, score) pairs from fields [begin, end) of a neighbors reply
+    void mergeNeighbors(size_t index, const vector<string_view> &fields, size_t begin)
+    {
+        const vector<uint32_t> &globalUser = shards[index]->globalUser;
+        for (size_t i = begin; i + 1 < fields.size(); i += 2)
+        {
+            size_t user = numberField(fields, i, SIZE_MAX);
+            if (user < globalUser.size())
+            {
+                nearestUsers.push(strtod(string(fields[i + 1]).c_str(), nullptr), globalUser[user]);
+            }
+        }
+    }
+
+public:
+    // Connect to the shard sockets, retrying for up to timeout while the
+    // shard processes start. Shards must start empty.
+    bool connect(const vector<string> &paths, chrono::milliseconds timeout, string &error)
+    {
+        auto deadline = chrono::steady_clock::now() + timeout;
+        shards.clear();
+        for (const string &path : paths)
+        {
+            for (;;)
+            {
+                unique_ptr<Shard> shard(new Shard());
+                if (shard->client.connect(path))
+                {
+                    shards.push_back(move(shard));
+                    break;
+                }
+                if (chrono::steady_clock::now() >= deadline)
+                {
+                    error = "Cannot reach shard " + path;
+                    shards.clear();
+                    return false;
+                }
+                this_thread::sleep_for(chrono::milliseconds(10));
+            }
+        }
+        return true;
+    }
+
+    // Ingest, as on BookRecommendationSystem. Failures are sticky and
+    // reported by error().
+    uint32_t internBook(string_view title)
+    {
+        bool inserted;
+        uint32_t book = titles.intern(title, inserted);
+        for (size_t i = 0; inserted && i < shards.size(); ++i)
+        {
+            request(i, "addbook\t" + string(title), book);
+        }
+        return book;
+    }
+
+    uint32_t internUser(string_view userName)
+    {
+        bool inserted;
+        uint32_t user = names.intern(userName, inserted);
+        if (inserted && !shards.empty())
+        {
+            uint32_t index = (uint32_t)(hashName(userName) % shards.size());
+            uint32_t local = (uint32_t)shards[index]->globalUser.size();
+            shards[index]->globalUser.push_back(user);
+            placement.push_back({index, local});
+            request(index, "adduser\t" + string(userName), local);
+        }
+        return user;
+    }
+
+    // Send reads of interned users and books to their users' shards;
+    // returns how many were new
+    size_t addReadsIds(vector<pair<uint32_t, uint32_t>> &edges)
+    {
+        drainAll(nullptr);
+        vector<string> lines(shards.size());
+        vector<size_t> counts(shards.size(), 0);
+        for (const auto &edge : edges)
+        {
+            if (edge.first >= placement.size() || edge.second >= titles.size())
+            {
+                continue;
+            }
+            uint32_t index = placement[edge.first].first;
+            string &line = lines[index];
+            if (line.empty())
+            {
+                line = "addreads";
+            }
+            line += '\t';
+            line += to_string(placement[edge.first].second);
+            line += '\t';
+            line += to_string(edge.second);
+            if (++counts[index] == kReadsPerRequest)
+            {
+                request(index, line, kInvalidId);
+                line.clear();
+                counts[index] = 0;
+            }
+        }
+        for (size_t i = 0; i < shards.size(); ++i)
+        {
+            if (!lines[i].empty())
+            {
+                request(i, lines[i], kInvalidId);
+            }
+        }
+        size_t added = 0;
+        drainAll(&added);
+        return added;
+    }
+
+    // Publish on every shard
+    void publish()
+    {
+        for (size_t i = 0; i < shards.size(); ++i)
+        {
+            request(i, "publish", kInvalidId);
+        }
+        drainAll(nullptr);
+    }
+
+    // First ingest failure or lost shard, or empty; every request after
+    // it is refused
+    const string &error() const
+    {
+        return failure;
+    }
+
+    uint32_t userId(string_view userName) const
+    {
+        return names.find(userName);
+    }
+
+    string_view bookTitle(uint32_t book) const
+    {
+        return titles.name(book);
+    }
+
+    size_t userCount() const
+    {
+        return names.size();
+    }
+
+    // Exact kNN recommendation for a user, as kNNRecommendIds with the
+    // exact engine: the ids of up to maxResults books, best first
+    bool recommend(uint32_t user, int k, size_t maxResults, SimilarityMetric metric, vector<uint32_t> &results,
+                   string &error)
+    {
+        results.clear();
+        if (!drainAll(nullptr))
+        {
+            error = failure;
+            return false;
+        }
+        if (user >= placement.size())
+        {
+            error = "User not found.";
+            return false;
+        }
+        if (metric == SimilarityMetric::IdfJaccard)
+        {
+            error = "IdfJaccard needs global book frequencies; shards only have their own.";
+            return false;
+        }
+        string settings = to_string(k) + "\t" + kMetricNames[(size_t)metric] + "\t";
+        string reply;
+        vector<string_view> fields;
+
+        // The target's shard: its books, then its neighbors
+        uint32_t home = placement[user].first;
+        if (!ask(home, "neighbors\t" + settings + to_string(placement[user].second), error) ||
+            !answer(home, reply, fields, error))
+        {
+            return abandon();
+        }
+        size_t bookCount = min(numberField(fields, 1, 0), fields.size() - 2);
+        vector<uint32_t> books = idFields(fields, 2, 2 + bookCount);
+        nearestUsers.reset(max(k, 0));
+        mergeNeighbors(home, fields, 2 + bookCount);
+
+        // Every other shard, scoring against the same books
+        string scatter = "neighbors\t" + settings + "-";
+        for (uint32_t book : books)
+        {
+            scatter += '\t';
+            scatter += to_string(book);
+        }
+        for (size_t i = 0; i < shards.size(); ++i)
+        {
+            if (i != home && !ask(i, scatter, error))
+            {
+                return abandon();
+            }
+        }
+        for (size_t i = 0; i < shards.size(); ++i)
+        {
+            if (i != home)
+            {
+                if (!answer(i, reply, fields, error))
+                {
+                    return abandon();
+                }
+                mergeNeighbors(i, fields, 2);
+            }
+        }
+
+        // The shards holding the k nearest count their books
+        vector<vector<uint32_t>> nearestBy(shards.size());
+        for (const auto &entry : nearestUsers.sorted())
+        {
+            nearestBy[placement[entry.second].first].push_back(placement[entry.second].second);
+        }
+        string excluded;
+        for (uint32_t book : books)
+        {
+            excluded += '\t';
+            excluded += to_string(book);
+        }
+        for (size_t i = 0; i < shards.size(); ++i)
+        {
+            if (nearestBy[i].empty())
+            {
+                continue;
+            }
+            string line = "votes\t" + to_string(nearestBy[i].size());
+            for (uint32_t local : nearestBy[i])
+            {
+                line += '\t';
+                line += to_string(local);
+            }
+            if (!ask(i, line + excluded, error))
+            {
+                return abandon();
+            }
+        }
+        bookVotes.resize(titles.size(), 0);
+        votedBooks.clear();
+        bool received = true;
+        for (size_t i = 0; i < shards.size(); ++i)
+        {
+            if (nearestBy[i].empty() || !received)
+            {
+                continue;
+            }
+            received = answer(i, reply, fields, error);
+            for (size_t f = 1; received && f + 1 < fields.size(); f += 2)
+            {
+                size_t book = numberField(fields, f, SIZE_MAX);
+                if (book < bookVotes.size())
+                {
+                    if (bookVotes[book] == 0)
+                    {
+                        votedBooks.push_back((uint32_t)book);
+                    }
+                    bookVotes[book] += (uint32_t)numberField(fields, f + 1, 0);
+                }
+            }
+        }
+
+        // Keep the maxResults most recommended books
+        topBooks.reset(maxResults);
+        for (uint32_t book : votedBooks)
+        {
+            topBooks.push(bookVotes[book], book);
+            bookVotes[book] = 0;
+        }
+        if (!received)
+        {
+            return abandon();
+        }
+        for (const auto &entry : topBooks.sorted())
+        {
+            results.push_back(entry.second);
+        }
+        return true;
+    }
+};
+
+// Start shardCount shard processes on Unix sockets in a fresh directory,
+// load the same synthetic library into them through a ShardedLibrary and
+// into one in-process system, and compare exact kNN results for queries
+// sampled users under each metric the shards support. Prints one JSON
+// line per metric with both latencies; returns 1 on any mismatch.
+int checkShards(const SyntheticOptions &library, size_t shardCount, size_t queries, ostream &json)
+{
+    char directory[] = "/tmp/bookrec-shards-XXXXXX";
+    if (shardCount == 0)
+    {
+        cout << "Need at least one shard." << endl;
+        return 1;
+    }
+    if (!mkdtemp(directory))
+    {
+        cout << "Cannot create a socket directory: " << strerror(errno) << endl;
+        return 1;
+    }
+
+    // Fork the shards before this process starts any threads
+    vector<string> paths;
+    vector<pid_t> children;
+    cout.flush();
+    for (size_t i = 0; i < shardCount; ++i)
+    {
+        paths.push_back(string(directory) + "/shard-" + to_string(i));
+        pid_t child = fork();
+        if (child == 0)
+        {
+            BookRecommendationSystem shard;
+            ServerOptions options;
+            options.socketPath = paths.back();
+            string error;
+            QueryServer server(shard, options);
+            bool served = server.run(error);
+            cerr << error << endl;
+            _exit(served ? 0 : 1);
+        }
+        if (child > 0)
+        {
+            children.push_back(child);
+        }
+    }
+    auto stopShards = [&]
+    {
+        for (pid_t child : children)
+        {
+            kill(child, SIGTERM);
+            waitpid(child, nullptr, 0);
+        }
+        for (const string &path : paths)
+        {
+            unlink(path.c_str());
+        }
+        rmdir(directory);
+    };
+
+    ShardedLibrary sharded;
+    string error;
+    if (children.size() != shardCount || !sharded.connect(paths, chrono::seconds(10), error))
+    {
+        cout << (error.empty() ? "Cannot start the shards." : error) << endl;
+        stopShards();
+        return 1;
+    }
+    auto start = chrono::steady_clock::now();
+    generateSyntheticLibrary(sharded, library);
+    auto middle = chrono::steady_clock::now();
+    BookRecommendationSystem single;
+    generateSyntheticLibrary(single, library);
+    auto end = chrono::steady_clock::now();
+    if (!sharded.error().empty())
+    {
+        cout << sharded.error() << endl;
+        stopShards();
+        return 1;
+    }
+    json << "{\"name\": \"shardLoad\", \"shards\": " << shardCount << ", \"users\": " << library.users
+         << ", \"shardedSeconds\": " << chrono::duration<double>(middle - start).count()
+         << ", \"singleNodeSeconds\": " << chrono::duration<double>(end - middle).count() << "}" << endl;
+
+    const int ks[] = {1, 5, 10, 50};
+    const SimilarityMetric metrics[] = {SimilarityMetric::Jaccard, SimilarityMetric::Cosine, SimilarityMetric::Overlap};
+    size_t mismatches = 0;
+    vector<uint32_t> expected;
+    vector<uint32_t> actual;
+    for (SimilarityMetric metric : metrics)
+    {
+        mt19937_64 rng(library.seed);
+        LatencySamples local;
+        LatencySamples remote;
+        size_t wrong = 0;
+        for (size_t q = 0; q < queries && single.userCount() > 0; ++q)
+        {
+            uint32_t user = (uint32_t)(rng() % single.userCount());
+            uint32_t shardedUser = sharded.userId(single.userName(user));
+            int k = ks[q % 4];
+            local.time([&]
+                       {
+                           IdSpan books = single.kNNRecommendIds(user, k, 10, RecommendEngine::ExactKnn, metric);
+                           expected.assign(books.begin(), books.end());
+                       });
+            bool answered = false;
+            remote.time([&]
+                        { answered = sharded.recommend(shardedUser, k, 10, metric, actual, error); });
+            bool same = answered && expected.size() == actual.size();
+            for (size_t i = 0; same && i < expected.size(); ++i)
+            {
+                same = single.bookTitle(expected[i]) == sharded.bookTitle(actual[i]);
+            }
+            wrong += !same;
+        }
+        json << "{\"name\": \"shardCheck\", \"shards\": " << shardCount << ", \"metric\": \""
+             << kMetricNames[(size_t)metric] << "\", \"mismatches\": " << wrong << ", \"singleNode\": {";
+        local.writeJson(json);
+        json << "}, \"sharded\": {";
+        remote.writeJson(json);
+        json << "}}" << endl;
+        mismatches += wrong;
+    }
+    if (!error.empty())
+    {
+        cout << error << endl;
+    }
+
+    // Lose a shard: the query it fails and every later one must be refused,
+    // not answered from replies the failed query left unread
+    bool refused = true;
+    if (shardCount > 1 && error.empty() && single.userCount() > 0)
+    {
+        kill(children.back(), SIGKILL);
+        waitpid(children.back(), nullptr, 0);
+        children.pop_back();
+        string lost;
+        for (uint32_t user = 0; user < 4; ++user)
+        {
+            refused = !sharded.recommend(user % sharded.userCount(), 5, 10, SimilarityMetric::Jaccard, actual, lost) &&
+                      actual.empty() && refused;
+        }
+        refused = refused && lost == sharded.error() && !lost.empty();
+        json << "{\"name\": \"shardCheck\", \"case\": \"lostShardRefused\", \"passed\": "
+             << (refused ? "true" : "false") << "}" << endl;
+    }
+    stopShards();
+    return mismatches == 0 && error.empty() && refused ? 0 : 1;
+}
+
+// Randomized check of the bitset kernel against intersectionSize and the
+// plain Jaccard formula. Every AND + popcount kernel this CPU runs counts
+// random word arrays of every tail length; then sampled pairs of dense and
+// sparse users of a synthetic library are counted by every pair path the
+// pair allows, with every kernel on the bitset AND path. Prints one JSON
+// line per kernel and per path; returns 1 on any mismatch, or when a path
+// was never tried or never chosen.
+int checkKernels(const SyntheticOptions &library, size_t pairs, ostream &json)
+{
+    static const char *const pathNames[JaccardKernel::kPairPathCount] = {"bitsetAnd", "bitsetProbe", "listMerge"};
+    mt19937_64 rng(library.seed);
+    vector<pair<const char *, AndPopcountFn>> kernels = andPopcountKernels();
+    vector<size_t> kernelChecked(kernels.size(), 0);
+    vector<size_t> kernelWrong(kernels.size(), 0);
+
+    // Word arrays from empty to a few vectors long, from saturated to sparse
+    vector<uint64_t> a;
+    vector<uint64_t> b;
+    for (size_t n = 0; n <= 67; ++n)
+    {
+        for (int sparsity = -1; sparsity < 4; ++sparsity)
+        {
+            a.resize(n);
+            b.resize(n);
+            size_t expected = 0;
+            for (size_t i = 0; i < n; ++i)
+            {
+                a[i] = sparsity < 0 ? UINT64_MAX : rng();
+                b[i] = sparsity < 0 ? UINT64_MAX : rng();
+                for (int s = 0; s < sparsity; ++s)
+                {
+                    a[i] &= rng();
+                    b[i] &= rng();
+                }
+                for (uint64_t word = a[i] & b[i]; word != 0; word &= word - 1)
+                {
+                    expected++;
+                }
+            }
+            for (size_t k = 0; k < kernels.size(); ++k)
+            {
+                kernelChecked[k]++;
+                kernelWrong[k] += kernels[k].second(a.data(), b.data(), n) != expected;
+            }
+        }
+    }
+
+    BookRecommendationSystem system;
+    generateSyntheticLibrary(system, library);
+    shared_ptr<const GraphSnapshot> current = system.snapshot();
+    const JaccardKernel &kernel = current->kernel;
+    vector<uint32_t> dense;
+    vector<uint32_t> sparse;
+    for (uint32_t user = 0; user < current->users(); ++user)
+    {
+        (kernel.isDense(user) ? dense : sparse).push_back(user);
+    }
+    if (dense.empty() || sparse.empty())
+    {
+        cout << "The library needs dense and sparse users; try more books or reads per user." << endl;
+        return 1;
+    }
+
+    size_t pathChecked[JaccardKernel::kPairPathCount] = {};
+    size_t pathChosen[JaccardKernel::kPairPathCount] = {};
+    size_t pathWrong[JaccardKernel::kPairPathCount] = {};
+    size_t jaccardWrong = 0;
+    for (size_t p = 0; p < pairs; ++p)
+    {
+        // Dense-dense, dense-sparse, sparse-dense and sparse-sparse in turn
+        const vector<uint32_t> &first = p % 4 < 2 ? dense : sparse;
+        const vector<uint32_t> &second = p % 2 == 0 ? dense : sparse;
+        uint32_t u = first[rng() % first.size()];
+        uint32_t v = second[rng() % second.size()];
+        IdSpan booksU = current->booksRead(u);
+        IdSpan booksV = current->booksRead(v);
+        size_t expected = intersectionSize(booksU, booksV);
+
+        if (kernel.isDense(u) && kernel.isDense(v))
+        {
+            for (size_t k = 0; k < kernels.size(); ++k)
+            {
+                bool wrong = kernel.intersectionBy(JaccardKernel::kBitsetAnd, u, v, kernels[k].second) != expected;
+                kernelChecked[k]++;
+                kernelWrong[k] += wrong;
+                pathChecked[JaccardKernel::kBitsetAnd]++;
+                pathWrong[JaccardKernel::kBitsetAnd] += wrong;
+            }
+        }
+        if (kernel.isDense(u) || kernel.isDense(v))
+        {
+            pathChecked[JaccardKernel::kBitsetProbe]++;
+            pathWrong[JaccardKernel::kBitsetProbe] += kernel.intersectionBy(JaccardKernel::kBitsetProbe, u, v, andPopcount) != expected;
+        }
+        pathChecked[JaccardKernel::kListMerge]++;
+        pathWrong[JaccardKernel::kListMerge] += kernel.intersectionBy(JaccardKernel::kListMerge, u, v, andPopcount) != expected;
+
+        // The path the kernel picks, and the score the kNN loop used to compute
+        pathChosen[kernel.pathFor(u, v)]++;
+        double commonBooks = expected;
+        double totalBooks = booksU.size() + booksV.size() - commonBooks;
+        jaccardWrong += kernel.intersection(u, v) != expected || kernel.jaccard(u, v) != commonBooks / totalBooks;
+    }
+
+    bool passed = jaccardWrong == 0;
+    for (size_t k = 0; k < kernels.size(); ++k)
+    {
+        json << "{\"name\": \"kernelCheck\", \"popcount\": \"" << kernels[k].first << "\", \"checked\": " << kernelChecked[k]
+             << ", \"mismatches\": " << kernelWrong[k] << "}" << endl;
+        passed = passed && kernelWrong[k] == 0;
+    }
+    for (size_t path = 0; path < JaccardKernel::kPairPathCount; ++path)
+    {
+        json << "{\"name\": \"kernelCheck\", \"path\": \"" << pathNames[path] << "\", \"checked\": " << pathChecked[path]
+             << ", \"chosen\": " << pathChosen[path] << ", \"mismatches\": " << pathWrong[path] << "}" << endl;
+        passed = passed && pathWrong[path] == 0 && pathChecked[path] > 0 && pathChosen[path] > 0;
+    }
+    json << "{\"name\": \"kernelCheck\", \"pairs\": " << pairs << ", \"denseUsers\": " << dense.size()
+         << ", \"jaccardMismatches\": " << jaccardWrong << "}" << endl;
+    return passed ? 0 : 1;
+}
+
+// Snapshot round trip: a synthetic library is saved, opened in a fresh
+// system and queried side by side with the original, which must give the
+// same recommendations, ids and names under every metric. Then damaged
+// copies of the file, one fault each, must fail to open; the checksum
+// case is only caught by a verified open. Prints JSON lines; returns 1 on
+// any difference or on a damaged file that opens.
+int checkSnapshot(const SyntheticOptions &library, size_t queries, ostream &json)
+{
+    char directory[] = "/tmp/bookrec-snapshot-XXXXXX";
+    if (!mkdtemp(directory))
+    {
+        cout << "Cannot create a snapshot directory: " << strerror(errno) << endl;
+        return 1;
+    }
+    string path = string(directory) + "/library.snapshot";
+    string damagedPath = string(directory) + "/damaged.snapshot";
+    auto cleanUp = [&]
+    {
+        unlink(path.c_str());
+        unlink(damagedPath.c_str());
+        rmdir(directory);
+    };
+
+    BookRecommendationSystem original;
+    generateSyntheticLibrary(original, library);
+    BookRecommendationSystem reopened;
+    BookRecommendationSystem verified;
+    string error;
+    auto start = chrono::steady_clock::now();
+    bool saved = original.saveSnapshot(path, error);
+    auto middle = chrono::steady_clock::now();
+    bool opened = saved && reopened.openSnapshot(path, error);
+    auto end = chrono::steady_clock::now();
+    if (!opened || !verified.openSnapshot(path, error, true))
+    {
+        cout << error << endl;
+        cleanUp();
+        return 1;
+    }
+    json << "{\"name\": \"snapshotSave\", \"users\": " << original.userCount() << ", \"books\": " << original.bookCount()
+         << ", \"saveSeconds\": " << chrono::duration<double>(middle - start).count()
+         << ", \"openSeconds\": " << chrono::duration<double>(end - middle).count() << "}" << endl;
+
+    const int ks[] = {1, 5, 10, 50};
+    const SimilarityMetric metrics[] = {SimilarityMetric::Jaccard, SimilarityMetric::Cosine, SimilarityMetric::Overlap,
+                                        SimilarityMetric::IdfJaccard};
+    bool passed = reopened.userCount() == original.userCount() && reopened.bookCount() == original.bookCount();
+    vector<uint32_t> expected;
+    for (SimilarityMetric metric : metrics)
+    {
+        mt19937_64 rng(library.seed);
+        size_t wrong = 0;
+        for (size_t q = 0; q < queries && original.userCount() > 0; ++q)
+        {
+            uint32_t user = (uint32_t)(rng() % original.userCount());
+            int k = ks[q % 4];
+            IdSpan books = original.kNNRecommendIds(user, k, 10, RecommendEngine::ExactKnn, metric);
+            expected.assign(books.begin(), books.end());
+            books = reopened.kNNRecommendIds(user, k, 10, RecommendEngine::ExactKnn, metric);
+            bool same = reopened.userId(original.userName(user)) == user && books.size() == expected.size();
+            for (size_t i = 0; same && i < expected.size(); ++i)
+            {
+                same = books[i] == expected[i] && reopened.bookTitle(books[i]) == original.bookTitle(expected[i]) &&
+                       reopened.bookId(original.bookTitle(expected[i])) == expected[i];
+            }
+            wrong += !same;
+        }
+        json << "{\"name\": \"snapshotCheck\", \"metric\": \"" << kMetricNames[(size_t)metric] << "\", \"queries\": "
+             << queries << ", \"mismatches\": " << wrong << "}" << endl;
+        passed = passed && wrong == 0;
+    }
+
+    // Damage one field of a copy of the file and try to open it
+    ifstream input(path, ios::binary);
+    string pristine((istreambuf_iterator<char>(input)), istreambuf_iterator<char>());
+    SnapshotHeader header;
+    memcpy(&header, pristine.data(), sizeof(header));
+    auto damaged = [&](const char *fault, SnapshotSectionId section, size_t index, auto value, bool caughtUnverified)
+    {
+        string bytes = pristine;
+        size_t at = header.sections[section].offset + index * sizeof(value);
+        if (at + sizeof(value) > header.sections[section].offset + header.sections[section].size ||
+            memcmp(&bytes[at], &value, sizeof(value)) == 0)
+        {
+            return; // this library is too small to hold the fault
+        }
+        memcpy(&bytes[at], &value, sizeof(value));
+        ofstream(damagedPath, ios::binary | ios::trunc).write(bytes.data(), bytes.size());
+
+        BookRecommendationSystem unverifiedOpen;
+        BookRecommendationSystem verifiedOpen;
+        string unverifiedError;
+        string verifiedError;
+        bool unverifiedRejected = !unverifiedOpen.openSnapshot(damagedPath, unverifiedError);
+        bool verifiedRejected = !verifiedOpen.openSnapshot(damagedPath, verifiedError, true);
+        json << "{\"name\": \"snapshotDamage\", \"fault\": \"" << fault << "\", \"rejected\": " << (unverifiedRejected ? "true" : "false")
+             << ", \"rejectedVerified\": " << (verifiedRejected ? "true" : "false") << "}" << endl;
+        passed = passed && verifiedRejected && unverifiedRejected == caughtUnverified;
+    };
+    const uint64_t *userSlots = (const uint64_t *)(pristine.data() + header.sections[kUserNameSlots].offset);
+    size_t occupied = 0;
+    while (occupied + 1 < header.sections[kUserNameSlots].size / sizeof(uint64_t) && userSlots[occupied] == 0)
+    {
+        occupied++;
+    }
+    const uint32_t *neighbors = (const uint32_t *)(pristine.data() + header.sections[kUserBookNeighbors].offset);
+    uint32_t otherBook = header.readCount > 0 && header.bookCount > 1 ? (neighbors[0] + 1) % (uint32_t)header.bookCount : 0;
+    damaged("bookIdOutOfRange", kUserBookNeighbors, 0, (uint32_t)header.bookCount, true);
+    damaged("readerIdOutOfRange", kBookReaderNeighbors, 0, (uint32_t)header.userCount, true);
+    damaged("offsetsDecrease", kUserBookOffsets, 1, (uint64_t)header.readCount + 1, true);
+    damaged("nameOffsetsDecrease", kBookNameOffsets, 1, (uint64_t)header.sections[kBookNameBlob].size + 1, true);
+    damaged("kernelSlotOutOfRange", kKernelSlots, 0, (uint32_t)header.denseUsers, true);
+    damaged("nameSlotOutOfRange", kUserNameSlots, occupied, (userSlots[occupied] & ~0xffffffffULL) | (header.userCount + 1), true);
+    damaged("bookIdChanged", kUserBookNeighbors, 0, otherBook, false);
+
+    cleanUp();
+    return passed ? 0 : 1;
+}
+
+// Heap allocations made by the current thread, for checkAllocations.
+// Counting replaces the global operator new and delete, so it is only
+// compiled into check builds: build with -DBOOKREC_COUNT_ALLOCATIONS.
+// The library's array and nothrow variants forward to these. Not inlined,
+// so GCC does not pair malloc and free across them and warn of mismatched
+// new and delete.
+#ifdef BOOKREC_COUNT_ALLOCATIONS
+thread_local size_t threadAllocations = 0;
+thread_local size_t threadFrees = 0;
+
+__attribute__((noinline)) void *operator new(size_t size)
 {
-    string title;
-    unordered_set<string> readers; // Users who have read this book
-};
+    threadAllocations++;
+    if (void *memory = malloc(size != 0 ? size : 1))
+    {
+        return memory;
+    }
+    throw bad_alloc();
+}
 
-// Node representing a user
-struct UserNode
+__attribute__((noinline)) void *operator new(size_t size, align_val_t alignment)
 {
-    string userName;
-    unordered_set<string> booksRead; // Books read by this user
-};
+    threadAllocations++;
+    size_t align = (size_t)alignment;
+    if (void *memory = aligned_alloc(align, (max<size_t>(size, 1) + align - 1) / align * align))
+    {
+        return memory;
+    }
+    throw bad_alloc();
+}
 
-// Graph class representing the library book recommendation system
-class BookRecommendationSystem
+__attribute__((noinline)) void operator delete(void *memory) noexcept
 {
-private:
-    unordered_map<string, BookNode> books;
-    unordered_map<string, UserNode> users;
+    threadFrees += memory != nullptr;
+    free(memory);
+}
 
-public:
-    // Add a new book to the graph
-    void addBook(const string &title)
+__attribute__((noinline)) void operator delete(void *memory, align_val_t) noexcept
+{
+    threadFrees += memory != nullptr;
+    free(memory);
+}
+
+__attribute__((noinline)) void operator delete(void *memory, size_t) noexcept
+{
+    threadFrees += memory != nullptr;
+    free(memory);
+}
+
+__attribute__((noinline)) void operator delete(void *memory, size_t, align_val_t) noexcept
+{
+    threadFrees += memory != nullptr;
+    free(memory);
+}
+#endif
+
+// Allocation check of the steady-state query path: after one warm-up pass
+// has grown this thread's scratch, repeating the same kNNRecommendIds and
+// caller-buffer kNNRecommendBooks queries, under every metric, must not
+// touch the heap. The owning kNNRecommendBooks is measured for comparison
+// only: its vector, and titles too long for the small string buffer,
+// allocate by design. Prints JSON lines; returns 1 on any allocation, or
+// when the build does not count allocations.
+int checkAllocations(const SyntheticOptions &library, size_t queries, size_t rounds, ostream &json)
+{
+#ifndef BOOKREC_COUNT_ALLOCATIONS
+    (void)library;
+    (void)queries;
+    (void)rounds;
+    json << "{\"name\": \"allocCheck\", \"passed\": false, \"error\": \"allocations are not counted; "
+            "rebuild with -DBOOKREC_COUNT_ALLOCATIONS\"}" << endl;
+    return 1;
+#else
+    BookRecommendationSystem system;
+    generateSyntheticLibrary(system, library);
+    mt19937_64 rng(library.seed);
+    vector<uint32_t> users;
+    vector<string> names;
+    for (size_t q = 0; q < queries && system.userCount() > 0; ++q)
     {
-        if (books.find(title) == books.end())
-        {
-            books[title] = BookNode{title, {}};
-        }
-        else
-        {
-            cout << "Book already exists." << endl;
-        }
+        users.push_back((uint32_t)(rng() % system.userCount()));
+        names.emplace_back(system.userName(users.back()));
     }
 
-    // Add a new user to the graph
-    void addUser(const string &userName)
+    const int ks[] = {1, 5, 10, 50};
+    const SimilarityMetric metrics[] = {SimilarityMetric::Jaccard, SimilarityMetric::Cosine, SimilarityMetric::Overlap,
+                                        SimilarityMetric::IdfJaccard};
+    vector<string_view> titles;
+    size_t results = 0;
+    auto idQueries = [&](SimilarityMetric metric)
     {
-        if (users.find(userName) == users.end())
+        for (size_t q = 0; q < users.size(); ++q)
         {
-            users[userName] = UserNode{userName, {}};
-            cout << "User added successfully." << endl;
+            results += system.kNNRecommendIds(users[q], ks[q % 4], 10, RecommendEngine::ExactKnn, metric).size();
         }
-        else
+    };
+    auto titleQueries = [&](SimilarityMetric metric)
+    {
+        for (size_t q = 0; q < users.size(); ++q)
         {
-            cout << "User already exists." << endl;
+            system.kNNRecommendBooks(names[q], ks[q % 4], 10, titles, RecommendEngine::ExactKnn, metric);
+            results += titles.size();
         }
+    };
+    for (SimilarityMetric metric : metrics)
+    {
+        idQueries(metric);
+        titleQueries(metric);
     }
 
-    // Record that a user has read a book
-    void addRead(const string &userName, const string &title)
+    bool passed = !users.empty();
+    for (SimilarityMetric metric : metrics)
     {
-        if (users.find(userName) != users.end() && books.find(title) != books.end())
+        size_t freesBefore = threadFrees;
+        size_t before = threadAllocations;
+        for (size_t round = 0; round < rounds; ++round)
         {
-            users[userName].booksRead.insert(title);
-            books[title].readers.insert(userName);
+            idQueries(metric);
         }
-        else
+        size_t idAllocations = threadAllocations - before;
+        before = threadAllocations;
+        for (size_t round = 0; round < rounds; ++round)
         {
-            cout << "User or book not found." << endl;
+            titleQueries(metric);
         }
+        size_t titleAllocations = threadAllocations - before;
+        size_t frees = threadFrees - freesBefore;
+        json << "{\"name\": \"allocCheck\", \"metric\": \"" << kMetricNames[(size_t)metric] << "\", \"queries\": "
+             << users.size() * rounds << ", \"idAllocations\": " << idAllocations
+             << ", \"titleAllocations\": " << titleAllocations << ", \"frees\": " << frees << "}" << endl;
+        passed = passed && idAllocations == 0 && titleAllocations == 0 && frees == 0;
     }
 
-    // k-nearest neighbors (kNN) algorithm to recommend books based on user similarity
-    vector<string> kNNRecommendBooks(const string &userName, int k)
+    size_t before = threadAllocations;
+    for (size_t q = 0; q < names.size(); ++q)
     {
-        vector<string> recommendations;
+        results += system.kNNRecommendBooks(names[q], ks[q % 4], 10).size();
+    }
+    json << "{\"name\": \"allocCheck\", \"owningTitles\": true, \"queries\": " << names.size()
+         << ", \"allocations\": " << threadAllocations - before << ", \"results\": " << results << "}" << endl;
+    return passed ? 0 : 1;
+#endif
+}
 
-        if (users.find(userName) == users.end())
+// Golden check of the similarity metrics on a fixed library small enough
+// to score by hand. "Anna Karenina" has 5 of the 8 readers, so its idf,
+// ln(1 + 8/5), is the lowest; reader-1 and reader-2 each share one book
+// with the target and tie under the unweighted metrics, but IdfJaccard
+// must rank reader-2, who shares the rarer "War and Peace", first. The
+// policies must also score empty sets as 0, not 0 / 0. Prints JSON lines;
+// returns 1 on any score off by more than rounding.
+int checkMetrics(ostream &json)
+{
+    BookRecommendationSystem system;
+    const char *const titles[] = {"Anna Karenina", "War and Peace", "Middlemarch", "Dubliners", "Ulysses"};
+    const vector<vector<uint32_t>> shelves = {
+        {0, 1, 2},    // target
+        {0},          // reader-1
+        {1},          // reader-2
+        {0, 1, 2, 3}, // reader-3
+        {0, 3},       // reader-4
+        {0, 4},       // reader-5
+        {4},          // reader-6, shares nothing with the target
+        {},           // reader-7, has read nothing
+    };
+    for (const char *title : titles)
+    {
+        system.internBook(title);
+    }
+    vector<pair<uint32_t, uint32_t>> edges;
+    for (uint32_t user = 0; user < shelves.size(); ++user)
+    {
+        system.internUser(user == 0 ? string("target") : "reader-" + to_string(user));
+        for (uint32_t book : shelves[user])
         {
-            cout << "User not found." << endl;
-            return recommendations;
+            edges.push_back({user, book});
         }
+    }
+    system.addReadsIds(edges);
 
-        // Calculate Jaccard similarity between users
-        unordered_map<string, double> similarityScores;
-        for (const auto &user : users)
+    // Hand-computed scores of readers 1-5 against the target's 3 books
+    double anna = log(1 + 8.0 / 5);
+    double war = log(1 + 8.0 / 3);
+    double rare = log(1 + 8.0 / 2); // Middlemarch, Dubliners, Ulysses
+    double target = anna + war + rare;
+    const SimilarityMetric metrics[] = {SimilarityMetric::Jaccard, SimilarityMetric::Cosine, SimilarityMetric::Overlap,
+                                        SimilarityMetric::IdfJaccard};
+    const double expected[4][5] = {
+        {1.0 / 3, 1.0 / 3, 3.0 / 4, 1.0 / 4, 1.0 / 4},
+        {1 / sqrt(3.0), 1 / sqrt(3.0), 3 / sqrt(12.0), 1 / sqrt(6.0), 1 / sqrt(6.0)},
+        {1.0, 1.0, 1.0, 1.0 / 2, 1.0 / 2},
+        {anna / target, war / target, target / (target + rare), anna / (target + rare), anna / (target + rare)},
+    };
+
+    bool passed = true;
+    vector<uint32_t> order[4];
+    IdSpan targetBooks = system.snapshot()->booksRead(0);
+    for (size_t m = 0; m < 4; ++m)
+    {
+        double worst = 0;
+        bool complete = true;
+        vector<TopKSelector<double>::Entry> nearest = system.nearestToBooks(targetBooks, 0, 10, metrics[m]);
+        for (const auto &entry : nearest)
         {
-            if (user.first != userName)
+            order[m].push_back(entry.second);
+            complete = complete && entry.second >= 1 && entry.second <= 5;
+            if (complete)
             {
-                double commonBooks = 0;
-                for (const string &book : users[userName].booksRead)
-                {
-                    if (user.second.booksRead.find(book) != user.second.booksRead.end())
-                    {
-                        commonBooks++;
-                    }
-                }
-                double totalBooks = users[userName].booksRead.size() + user.second.booksRead.size() - commonBooks;
-                similarityScores[user.first] = commonBooks / totalBooks;
+                worst = max(worst, fabs(entry.first - expected[m][entry.second - 1]) / expected[m][entry.second - 1]);
             }
         }
+        complete = complete && nearest.size() == 5;
+        json << "{\"name\": \"metricCheck\", \"metric\": \"" << kMetricNames[(size_t)metrics[m]] << "\", \"neighbors\": "
+             << nearest.size() << ", \"maxRelativeError\": " << worst << "}" << endl;
+        passed = passed && complete && worst < 1e-12;
+    }
 
-        // Sort users based on similarity score
-        vector<pair<double, string>> sortedUsers;
-        for (const auto &pair : similarityScores)
-        {
-            sortedUsers.push_back({pair.second, pair.first});
-        }
-        sort(sortedUsers.begin(), sortedUsers.end(), greater<pair<double, string>>());
+    // Ties fall to the lower id unweighted; idf puts the rarer book first
+    auto rank = [&order](size_t m, uint32_t user)
+    {
+        return find(order[m].begin(), order[m].end(), user) - order[m].begin();
+    };
+    bool downWeighted = rank(0, 1) < rank(0, 2) && rank(3, 2) < rank(3, 1);
+    json << "{\"name\": \"metricCheck\", \"case\": \"idfDownWeightsAnnaKarenina\", \"passed\": "
+         << (downWeighted ? "true" : "false") << "}" << endl;
 
-        // Extract top k similar users
-        vector<string> similarUsers;
-        for (int i = 0; i < min(k, (int)sortedUsers.size()); ++i)
-        {
-            similarUsers.push_back(sortedUsers[i].second);
-        }
+    // Empty sets: 0, never NaN, from every policy and end to end
+    const double sizes[][3] = {{0, 0, 0}, {0, 0, 3}, {0, 3, 0}};
+    bool emptyZero = system.kNNRecommendIds(7, 5, 10).size() == 0 &&
+                     system.nearestToBooks(IdSpan{}, kInvalidId, 10, SimilarityMetric::Jaccard).empty();
+    for (const auto &size : sizes)
+    {
+        emptyZero = emptyZero && JaccardSimilarity::score(size[0], size[1], size[2]) == 0 &&
+                    CosineSimilarity::score(size[0], size[1], size[2]) == 0 &&
+                    OverlapSimilarity::score(size[0], size[1], size[2]) == 0 &&
+                    IdfJaccardSimilarity::score(size[0], size[1], size[2]) == 0;
+    }
+    json << "{\"name\": \"metricCheck\", \"case\": \"emptySetScoresZero\", \"passed\": " << (emptyZero ? "true" : "false")
+         << "}" << endl;
+    return passed && downWeighted && emptyZero ? 0 : 1;
+}
 
-        // Recommend books read by similar users but not by the target user
-        unordered_set<string> userBooks = users[userName].booksRead;
-        unordered_map<string, int> bookCounts;
-        for (const string &user : similarUsers)
+// Check of the embedding engine. Every dot product kernel this CPU runs
+// scores random panels of every factor count up to a few vectors wide
+// against the scalar kernel, within float rounding. Then models of a
+// synthetic library are checkpointed: a loaded checkpoint must save back
+// byte for byte, training resumed from a checkpoint after some iterations
+// must end where straight training does, and damaged checkpoints must be
+// refused, as must serving or resuming one on a library with one more
+// read. Prints JSON
+// lines; returns 1 on any failure.
+int checkFactors(const SyntheticOptions &library, size_t iterations, ostream &json)
+{
+    mt19937_64 rng(library.seed);
+    uniform_real_distribution<float> uniform(-1, 1);
+    bool passed = true;
+    for (const auto &kernel : dotPanelsKernels())
+    {
+        double worst = 0;
+        size_t checked = 0;
+        for (size_t factors = 1; factors <= 67; ++factors)
         {
-            for (const string &book : users[user].booksRead)
+            const size_t count = 3;
+            FactorMatrix panels;
+            panels.assign(count, 16 * factors);
+            vector<float> query(factors);
+            for (float &value : query)
+            {
+                value = uniform(rng);
+            }
+            for (size_t i = 0; i < count * factors * 16; ++i)
+            {
+                panels.row(0)[i] = uniform(rng);
+            }
+            vector<float> expected(count * 16);
+            vector<float> scores(count * 16);
+            dotPanelsScalar(query.data(), panels.row(0), count, factors, expected.data());
+            kernel.second(query.data(), panels.row(0), count, factors, scores.data());
+
+            // Rounding error grows with the sum of the absolute products
+            for (size_t lane = 0; lane < count * 16; ++lane)
             {
-                if (userBooks.find(book) == userBooks.end())
+                const float *panel = panels.row(0) + lane / 16 * factors * 16;
+                double magnitude = 0;
+                for (size_t i = 0; i < factors; ++i)
                 {
-                    bookCounts[book]++;
+                    magnitude += fabs(query[i] * panel[i * 16 + lane % 16]);
                 }
+                worst = max(worst, fabs(scores[lane] - expected[lane]) / magnitude);
+                checked++;
             }
         }
+        json << "{\"name\": \"factorKernelCheck\", \"kernel\": \"" << kernel.first << "\", \"scores\": " << checked
+             << ", \"maxRelativeError\": " << worst << "}" << endl;
+        passed = passed && worst < 1e-5;
+    }
+
+    char directory[] = "/tmp/bookrec-factors-XXXXXX";
+    if (!mkdtemp(directory))
+    {
+        cout << "Cannot create a checkpoint directory: " << strerror(errno) << endl;
+        return 1;
+    }
+    string straightPath = string(directory) + "/straight.factors";
+    string resumedPath = string(directory) + "/resumed.factors";
+    string copyPath = string(directory) + "/copy.factors";
+    auto cleanUp = [&]
+    {
+        unlink(straightPath.c_str());
+        unlink(resumedPath.c_str());
+        unlink(copyPath.c_str());
+        rmdir(directory);
+    };
+    auto contents = [](const string &path)
+    {
+        ifstream in(path, ios::binary);
+        return string(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+    };
+    auto write = [](const string &path, const string &bytes)
+    {
+        ofstream out(path, ios::binary | ios::trunc);
+        out << bytes;
+    };
+
+    // Straight training, then half of it resumed by a fresh system from its checkpoint
+    FactorOptions options;
+    options.factors = 8;
+    options.iterations = iterations;
+    string error;
+    BookRecommendationSystem straight;
+    generateSyntheticLibrary(straight, library);
+    options.checkpointPath = straightPath;
+    bool trained = straight.trainFactors(options, error);
+    BookRecommendationSystem first;
+    generateSyntheticLibrary(first, library);
+    options.checkpointPath = resumedPath;
+    options.iterations = iterations / 2;
+    trained = trained && first.trainFactors(options, error);
+    BookRecommendationSystem second;
+    generateSyntheticLibrary(second, library);
+    options.iterations = iterations;
+    trained = trained && second.loadFactors(resumedPath, error) && second.trainFactors(options, error);
+    if (!trained)
+    {
+        cout << error << endl;
+        cleanUp();
+        return 1;
+    }
+    string straightBytes = contents(straightPath);
+    string resumedBytes = contents(resumedPath);
+    double worst = straightBytes.size() == resumedBytes.size() ? 0 : HUGE_VAL;
+    for (size_t at = sizeof(FactorHeader); worst == 0 && at + sizeof(float) <= straightBytes.size(); at += sizeof(float))
+    {
+        float a;
+        float b;
+        memcpy(&a, straightBytes.data() + at, sizeof(float));
+        memcpy(&b, resumedBytes.data() + at, sizeof(float));
+        worst = max(worst, (double)fabs(a - b));
+    }
+    bool resumed = second.factorSettings().iterations == iterations && worst < 1e-5;
+    json << "{\"name\": \"factorCheck\", \"case\": \"resumeMatchesStraight\", \"users\": " << second.userCount()
+         << ", \"books\": " << second.bookCount() << ", \"iterations\": " << second.factorSettings().iterations
+         << ", \"maxDifference\": " << worst << ", \"passed\": " << (resumed ? "true" : "false") << "}" << endl;
 
-        // Sort books based on count
-        vector<pair<int, string>> sortedBooks;
-        for (const auto &pair : bookCounts)
+    // Load and save back unchanged
+    BookRecommendationSystem reloaded;
+    generateSyntheticLibrary(reloaded, library);
+    bool roundTrip = reloaded.loadFactors(straightPath, error) && reloaded.saveFactors(copyPath, error) &&
+                     contents(copyPath) == straightBytes;
+    json << "{\"name\": \"factorCheck\", \"case\": \"checkpointRoundTrip\", \"bytes\": " << straightBytes.size()
+         << ", \"passed\": " << (roundTrip ? "true" : "false") << "}" << endl;
+
+    // A flipped bit in a vector or the header, and a cut-off file
+    string damaged = straightBytes;
+    damaged[damaged.size() - 1] ^= 1;
+    write(copyPath, damaged);
+    bool refused = !reloaded.loadFactors(copyPath, error);
+    damaged = straightBytes;
+    damaged[offsetof(FactorHeader, iterations)] ^= 1;
+    write(copyPath, damaged);
+    refused = refused && !reloaded.loadFactors(copyPath, error);
+    write(copyPath, straightBytes.substr(0, straightBytes.size() - sizeof(float)));
+    refused = refused && !reloaded.loadFactors(copyPath, error);
+    json << "{\"name\": \"factorCheck\", \"case\": \"damagedCheckpointRefused\", \"passed\": "
+         << (refused ? "true" : "false") << "}" << endl;
+
+    // One more read than the checkpoint was trained on: neither served
+    // nor resumed
+    uint32_t book = 0;
+    while (book < reloaded.bookCount() && reloaded.snapshot()->booksRead(0).contains(book))
+    {
+        book++;
+    }
+    vector<pair<uint32_t, uint32_t>> extra = {{0, book}};
+    BookRecommendationSystem changed;
+    generateSyntheticLibrary(changed, library);
+    changed.addReadsIds(extra);
+    bool mismatch = !changed.loadFactors(straightPath, error) && changed.factorSettings().factors == 0;
+    json << "{\"name\": \"factorCheck\", \"case\": \"mismatchedServeRefused\", \"passed\": "
+         << (mismatch ? "true" : "false") << "}" << endl;
+    extra = {{0, book}};
+    options.checkpointPath.clear();
+    bool resumeRefused = reloaded.loadFactors(straightPath, error) && reloaded.addReadsIds(extra) == 1 &&
+                         !reloaded.trainFactors(options, error);
+    options.resume = false;
+    resumeRefused = resumeRefused && reloaded.trainFactors(options, error) &&
+                    reloaded.factorSettings().iterations == iterations;
+    json << "{\"name\": \"factorCheck\", \"case\": \"mismatchedResumeRefused\", \"passed\": "
+         << (resumeRefused ? "true" : "false") << "}" << endl;
+    cleanUp();
+    return passed && resumed && roundTrip && refused && mismatch && resumeRefused ? 0 : 1;
+}
+
+// Check of the event log's failure handling. A log that cannot be
+// created must fail to open without taking the process down. In a forked
+// child, a batch must log only its new reads; then the file size limit is
+// lowered to the log's size, and once the log has failed, batches and
+// rows naming new users must be refused. The library the log then
+// recovers must hold exactly the reads logged before the failure. Prints
+// JSON lines; returns 1 on any failure.
+int checkEventLog(ostream &json)
+{
+    char directory[] = "/tmp/bookrec-log-XXXXXX";
+    if (!mkdtemp(directory))
+    {
+        cout << "Cannot create a log directory: " << strerror(errno) << endl;
+        return 1;
+    }
+    string readsPath = string(directory) + "/reads.tsv";
+    ofstream(readsPath) << "someone new\tb0\n";
+    EventLogOptions options;
+    options.compactBytes = 0;
+
+    // Fork before this process starts any threads; the child reports
+    // through its exit status, one bit per failed case
+    cout.flush();
+    pid_t child = fork();
+    if (child == 0)
+    {
+        BookRecommendationSystem system;
+        RecoveryReport report;
+        string error;
+        if (!system.openDurable(directory, options, report, error))
         {
-            sortedBooks.push_back({pair.second, pair.first});
+            _exit(127);
         }
-        sort(sortedBooks.begin(), sortedBooks.end(), greater<pair<int, string>>());
-
-        // Extract recommended books
-        for (const auto &pair : sortedBooks)
+        for (int i = 0; i < 4; ++i)
+        {
+            system.internUser("u" + to_string(i));
+        }
+        for (int i = 0; i < 6; ++i)
         {
-            recommendations.push_back(pair.second);
+            system.internBook("b" + to_string(i));
         }
+        system.addReadIds(0, 0);
+        system.publish();
+        system.addReadIds(1, 1);
+        system.addReadIds(1, 2);
+        uint64_t before = system.eventLogStats().events;
+        vector<pair<uint32_t, uint32_t>> edges = {{0, 0}, {1, 1}, {1, 2}, {2, 3}, {2, 3}, {3, 4}, {0, 5}};
+        int failed = system.addReadsIds(edges) == 3 && system.eventLogStats().events - before == 3 ? 0 : 1;
 
-        return recommendations;
+        struct stat info;
+        signal(SIGXFSZ, SIG_IGN);
+        if (!system.syncLog(error) || stat((string(directory) + "/events.log").c_str(), &info) != 0)
+        {
+            _exit(127);
+        }
+        rlimit limit{(rlim_t)info.st_size, RLIM_INFINITY};
+        setrlimit(RLIMIT_FSIZE, &limit);
+        system.addReadIds(3, 0);
+        failed |= system.syncLog(error) ? 2 : 0;
+        size_t reads = system.snapshot()->reads();
+        edges = {{3, 1}};
+        failed |= system.addReadsIds(edges) != 0 || system.snapshot()->reads() != reads ? 4 : 0;
+        LoadOptions load;
+        load.createMissing = true;
+        LoadReport loaded = system.loadReads(readsPath, load);
+        failed |= loaded.errors.empty() || loaded.loaded != 0 || system.userId("someone new") != kInvalidId ? 8 : 0;
+        _exit(failed);
     }
+    int status = 0;
+    bool ran = child > 0 && waitpid(child, &status, 0) == child && WIFEXITED(status) && WEXITSTATUS(status) != 127;
+    int failed = ran ? WEXITSTATUS(status) : 15;
+    json << "{\"name\": \"logCheck\", \"case\": \"batchLogsNewReads\", \"passed\": " << (failed & 1 ? "false" : "true")
+         << "}" << endl;
+    json << "{\"name\": \"logCheck\", \"case\": \"writeFailureReported\", \"passed\": "
+         << (failed & 2 ? "false" : "true") << "}" << endl;
+    json << "{\"name\": \"logCheck\", \"case\": \"refusedAfterFailure\", \"passed\": "
+         << (failed & 12 ? "false" : "true") << "}" << endl;
+
+    // Only what reached the log comes back
+    BookRecommendationSystem recovered;
+    RecoveryReport report;
+    string error;
+    bool reopened = recovered.openDurable(directory, options, report, error);
+    bool exact = reopened && recovered.userCount() == 4 && recovered.bookCount() == 6 &&
+                 recovered.snapshot()->reads() == 6;
+    recovered.closeDurable();
+    json << "{\"name\": \"logCheck\", \"case\": \"recoversLoggedReads\", \"events\": " << report.events
+         << ", \"passed\": " << (exact ? "true" : "false") << "}" << endl;
+
+    // /dev/full takes the open but not the header
+    EventLog full;
+    bool refused = !full.open("/dev/full", options, error) && !full.isOpen();
+    json << "{\"name\": \"logCheck\", \"case\": \"failingOpen\", \"error\": \"" << error
+         << "\", \"passed\": " << (refused ? "true" : "false") << "}" << endl;
 
-    // Bipartite graph algorithm to find users who repeatedly read the same books
-    unordered_set<string> bipartiteAlgorithm()
+    for (const char *name : {"/events.log", "/events.log.old", "/snapshot", "/reads.tsv"})
     {
-        unordered_set<string> repeatedReaders;
-        unordered_map<string, int> bookCounts;
+        unlink((string(directory) + name).c_str());
+    }
+    rmdir(directory);
+    return failed == 0 && exact && refused ? 0 : 1;
+}
+
+// Check of the random walk engine against personalized PageRank computed
+// exactly by power iteration on a small synthetic library: the expected
+// visits per walk of every book, over maxSteps steps that each continue
+// with probability 1 - restart. Each book the engine returns at rank i
+// must score within sampling noise, 8 / sqrt(walks) of the best score, of
+// the true rank i book. Prints one JSON line; returns 1 on failure.
+int checkWalks(const SyntheticOptions &library, size_t targets, size_t walksPerQuery, ostream &json)
+{
+    BookRecommendationSystem system;
+    generateSyntheticLibrary(system, library);
+    RandomWalkOptions options;
+    options.walksPerQuery = walksPerQuery;
+    system.enableRandomWalks(options);
+    shared_ptr<const GraphSnapshot> snapshot = system.snapshot();
+    const size_t maxResults = 10;
 
-        // Count the number of times each book is read
-        for (const auto &user : users)
+    double worst = 0;
+    size_t checked = 0;
+    vector<double> at(snapshot->users());
+    vector<double> next(snapshot->users());
+    vector<double> stepBooks(snapshot->books());
+    vector<double> visits(snapshot->books());
+    vector<pair<double, uint32_t>> truth;
+    for (uint32_t target = 0; target < snapshot->users() && checked < targets; ++target)
+    {
+        IdSpan userBooks = snapshot->booksRead(target);
+        if (userBooks.empty())
         {
-            for (const string &book : user.second.booksRead)
-            {
-                bookCounts[book]++;
-            }
+            continue;
         }
-
-        // Identify users who have read the same book more than once
-        for (const auto &user : users)
+        fill(at.begin(), at.end(), 0.0);
+        fill(visits.begin(), visits.end(), 0.0);
+        at[target] = 1;
+        for (size_t step = 0; step < options.maxSteps; ++step)
         {
-            for (const string &book : user.second.booksRead)
+            fill(stepBooks.begin(), stepBooks.end(), 0.0);
+            fill(next.begin(), next.end(), 0.0);
+            for (uint32_t user = 0; user < snapshot->users(); ++user)
+            {
+                IdSpan books = snapshot->booksRead(user);
+                for (uint32_t book : books)
+                {
+                    stepBooks[book] += at[user] / books.size();
+                }
+            }
+            for (uint32_t book = 0; book < snapshot->books(); ++book)
             {
-                if (bookCounts[book] > 1)
+                IdSpan readers = snapshot->readers(book);
+                for (uint32_t reader : readers)
                 {
-                    repeatedReaders.insert(user.first);
-                    break; // Move to the next user
+                    next[reader] += stepBooks[book] * (1 - options.restart) / readers.size();
                 }
+                visits[book] += stepBooks[book];
+            }
+            at.swap(next);
+        }
+        truth.clear();
+        for (uint32_t book = 0; book < snapshot->books(); ++book)
+        {
+            if (!userBooks.contains(book) && visits[book] > 0)
+            {
+                truth.push_back({-visits[book], book});
             }
         }
+        sort(truth.begin(), truth.end());
 
-        return repeatedReaders;
+        IdSpan found = system.kNNRecommendIds(target, 0, maxResults, RecommendEngine::RandomWalk);
+        for (size_t i = 0; i < max(found.size(), min(truth.size(), maxResults)); ++i)
+        {
+            double expected = i < truth.size() ? -truth[i].first : 0;
+            double got = i < found.size() ? visits[found[i]] : 0;
+            worst = max(worst, fabs(got - expected) / -truth[0].first);
+        }
+        checked++;
     }
-};
+    bool passed = checked > 0 && worst < 8 / sqrt((double)max<size_t>(1, walksPerQuery));
+    json << "{\"name\": \"walkCheck\", \"targets\": " << checked << ", \"walks\": " << walksPerQuery
+         << ", \"maxScoreGap\": " << worst << ", \"passed\": " << (passed ? "true" : "false") << "}" << endl;
+    return passed ? 0 : 1;
+}
 
-int main()
+// The sample library used by the interactive demo
+void loadSampleLibrary(BookRecommendationSystem &system)
 {
-    BookRecommendationSystem system;
- 
     // Adding books
     system.addBook("Don Quixote");
     system.addBook("Alice's Adventures in Wonderland");
@@ -515,6 +9903,342 @@ int main()
     system.addRead("Jitmohan Hembram", "Anna Karenina");
     system.addRead("Shankar Kumar Nanda", "White Fang");
     system.addRead("Shankar Kumar Nanda", "20,000 Leagues Under the Sea");
+    system.publish();
+}
+
+// Print a bulk-load summary and the first errors
+void printLoadReport(const string &what, const LoadReport &report)
+{
+    cout << what << ": " << report.loaded << " loaded, " << report.duplicates << " duplicates, "
+         << report.rejected << " rejected of " << report.rows << " rows in " << report.seconds << "s" << endl;
+    for (const LoadError &error : report.errors)
+    {
+        cout << "  line " << error.line << ": " << error.message << endl;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    // Benchmark mode: demo bench-batch [users] [books] [readsPerUser] [maxThreads]
+    if (argc > 1 && string(argv[1]) == "bench-batch")
+    {
+        SyntheticOptions options;
+        options.users = argc > 2 ? stoul(argv[2]) : options.users;
+        options.books = argc > 3 ? stoul(argv[3]) : options.books;
+        options.readsPerUser = argc > 4 ? stoul(argv[4]) : options.readsPerUser;
+        size_t maxThreads = argc > 5 ? stoul(argv[5]) : max(1u, thread::hardware_concurrency());
+        return benchBatch(options, maxThreads);
+    }
+
+    // Benchmark suite: demo bench [users] [books] [readsPerUser] [results.json]
+    if (argc > 1 && string(argv[1]) == "bench")
+    {
+        BenchOptions options;
+        options.library.users = argc > 2 ? stoul(argv[2]) : options.library.users;
+        options.library.books = argc > 3 ? stoul(argv[3]) : options.library.books;
+        options.library.readsPerUser = argc > 4 ? stoul(argv[4]) : options.library.readsPerUser;
+        if (argc > 5)
+        {
+            ofstream output(argv[5]);
+            return runBenchmarks(options, output);
+        }
+        return runBenchmarks(options, cout);
+    }
+
+    // Ingest benchmark: demo bench-ingest [users] [books] [readsPerUser] [readsPerSecond] [seconds]
+    if (argc > 1 && string(argv[1]) == "bench-ingest")
+    {
+        SyntheticOptions options;
+        options.users = argc > 2 ? stoul(argv[2]) : options.users;
+        options.books = argc > 3 ? stoul(argv[3]) : options.books;
+        options.readsPerUser = argc > 4 ? stoul(argv[4]) : options.readsPerUser;
+        return benchIngest(options, argc > 5 ? stoul(argv[5]) : 5000, argc > 6 ? stod(argv[6]) : 5);
+    }
+
+    // Analytics benchmark: demo bench-analytics [users] [books] [readsPerUser] [maxDegree]
+    if (argc > 1 && string(argv[1]) == "bench-analytics")
+    {
+        SyntheticOptions options;
+        options.users = argc > 2 ? stoul(argv[2]) : options.users;
+        options.books = argc > 3 ? stoul(argv[3]) : options.books;
+        options.readsPerUser = argc > 4 ? stoul(argv[4]) : options.readsPerUser;
+        ProjectionOptions projection;
+        projection.maxDegree = argc > 5 ? stoul(argv[5]) : projection.maxDegree;
+        return benchAnalytics(options, projection);
+    }
+
+    // Event log benchmark: demo bench-log <directory> [users] [books] [readsPerUser] [newReads]
+    if (argc > 1 && string(argv[1]) == "bench-log")
+    {
+        if (argc < 3)
+        {
+            cout << "Usage: " << argv[0] << " bench-log <directory> [users] [books] [readsPerUser] [newReads]" << endl;
+            return 1;
+        }
+        SyntheticOptions options;
+        options.users = argc > 3 ? stoul(argv[3]) : options.users;
+        options.books = argc > 4 ? stoul(argv[4]) : options.books;
+        options.readsPerUser = argc > 5 ? stoul(argv[5]) : options.readsPerUser;
+        return benchEventLog(argv[2], options, argc > 6 ? stoul(argv[6]) : 1000000);
+    }
+
+    // Load generator: demo loadgen <socket> [connections] [seconds] [pipeline]
+    if (argc > 1 && string(argv[1]) == "loadgen")
+    {
+        if (argc < 3)
+        {
+            cout << "Usage: " << argv[0] << " loadgen <socket> [connections] [seconds] [pipeline]" << endl;
+            return 1;
+        }
+        LoadGenOptions options;
+        options.socketPath = argv[2];
+        options.connections = argc > 3 ? stoul(argv[3]) : options.connections;
+        options.seconds = argc > 4 ? stod(argv[4]) : options.seconds;
+        options.pipeline = argc > 5 ? stoul(argv[5]) : options.pipeline;
+        return runLoadGenerator(options, cout);
+    }
+
+    // Sharding check: demo shard-check [shards] [users] [books] [readsPerUser] [queries]
+    if (argc > 1 && string(argv[1]) == "shard-check")
+    {
+        SyntheticOptions options;
+        options.users = argc > 3 ? stoul(argv[3]) : options.users;
+        options.books = argc > 4 ? stoul(argv[4]) : options.books;
+        options.readsPerUser = argc > 5 ? stoul(argv[5]) : options.readsPerUser;
+        return checkShards(options, argc > 2 ? stoul(argv[2]) : 4, argc > 6 ? stoul(argv[6]) : 200, cout);
+    }
+
+    // Kernel check: demo kernel-check [users] [books] [readsPerUser] [pairs];
+    // activity is heavy tailed so the library has dense users
+    if (argc > 1 && string(argv[1]) == "kernel-check")
+    {
+        SyntheticOptions options;
+        options.users = argc > 2 ? stoul(argv[2]) : 5000;
+        options.books = argc > 3 ? stoul(argv[3]) : 2000;
+        options.readsPerUser = argc > 4 ? stoul(argv[4]) : options.readsPerUser;
+        options.activityShape = 1.2;
+        return checkKernels(options, argc > 5 ? stoul(argv[5]) : 20000, cout);
+    }
+
+    // Snapshot check: demo snapshot-check [users] [books] [readsPerUser] [queries]
+    if (argc > 1 && string(argv[1]) == "snapshot-check")
+    {
+        SyntheticOptions options;
+        options.users = argc > 2 ? stoul(argv[2]) : 20000;
+        options.books = argc > 3 ? stoul(argv[3]) : 5000;
+        options.readsPerUser = argc > 4 ? stoul(argv[4]) : options.readsPerUser;
+        options.activityShape = 1.2;
+        return checkSnapshot(options, argc > 5 ? stoul(argv[5]) : 500, cout);
+    }
+
+    // Allocation check, in a -DBOOKREC_COUNT_ALLOCATIONS build:
+    // demo alloc-check [users] [books] [readsPerUser] [queries] [rounds]
+    if (argc > 1 && string(argv[1]) == "alloc-check")
+    {
+        SyntheticOptions options;
+        options.users = argc > 2 ? stoul(argv[2]) : 20000;
+        options.books = argc > 3 ? stoul(argv[3]) : 5000;
+        options.readsPerUser = argc > 4 ? stoul(argv[4]) : options.readsPerUser;
+        options.activityShape = 1.2;
+        return checkAllocations(options, argc > 5 ? stoul(argv[5]) : 200, argc > 6 ? stoul(argv[6]) : 5, cout);
+    }
+
+    // Metric check: demo metric-check, golden scores on a fixed library
+    if (argc > 1 && string(argv[1]) == "metric-check")
+    {
+        return checkMetrics(cout);
+    }
+
+    // Factor check: demo factor-check [users] [books] [iterations], SIMD
+    // kernels against scalar and checkpoint round trips and resumes
+    if (argc > 1 && string(argv[1]) == "factor-check")
+    {
+        SyntheticOptions options;
+        options.users = argc > 2 ? stoul(argv[2]) : 2000;
+        options.books = argc > 3 ? stoul(argv[3]) : 500;
+        return checkFactors(options, argc > 4 ? stoul(argv[4]) : 4, cout);
+    }
+
+    // Log check: demo log-check, event log failures are refused and reported
+    if (argc > 1 && string(argv[1]) == "log-check")
+    {
+        return checkEventLog(cout);
+    }
+
+    // Walk check: demo walk-check [users] [books] [targets] [walks], the
+    // random walk engine against power-iteration PageRank
+    if (argc > 1 && string(argv[1]) == "walk-check")
+    {
+        SyntheticOptions options;
+        options.users = argc > 2 ? stoul(argv[2]) : 300;
+        options.books = argc > 3 ? stoul(argv[3]) : 80;
+        return checkWalks(options, argc > 4 ? stoul(argv[4]) : 20, argc > 5 ? stoul(argv[5]) : 100000, cout);
+    }
+
+    BookRecommendationSystem system;
+
+    // Shard mode: demo shard <socket>; serves an empty library that a
+    // ShardedLibrary coordinator fills
+    if (argc > 1 && string(argv[1]) == "shard")
+    {
+        if (argc < 3)
+        {
+            cout << "Usage: " << argv[0] << " shard <socket>" << endl;
+            return 1;
+        }
+        ServerOptions options;
+        options.socketPath = argv[2];
+        string error;
+        QueryServer server(system, options);
+        if (!server.run(error))
+        {
+            cerr << error << endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    // Server mode: demo serve <socket|-> [snapshot [factors] | synthetic [users] [books] [readsPerUser] |
+    // durable <directory>]; "-" answers requests from stdin on stdout, so
+    // progress goes to stderr. A durable server logs every read it takes;
+    // a factor checkpoint from demo train serves the embedding engine.
+    if (argc > 1 && string(argv[1]) == "serve")
+    {
+        if (argc < 3)
+        {
+            cout << "Usage: " << argv[0]
+                 << " serve <socket|-> [snapshot [factors] | synthetic [users] [books] [readsPerUser] | durable <directory>]"
+                 << endl;
+            return 1;
+        }
+        ServerOptions options;
+        options.socketPath = string(argv[2]) == "-" ? string() : argv[2];
+        streambuf *console = cout.rdbuf(cerr.rdbuf());
+        string error;
+        if (argc > 3 && string(argv[3]) == "synthetic")
+        {
+            SyntheticOptions library;
+            library.users = argc > 4 ? stoul(argv[4]) : library.users;
+            library.books = argc > 5 ? stoul(argv[5]) : library.books;
+            library.readsPerUser = argc > 6 ? stoul(argv[6]) : library.readsPerUser;
+            generateSyntheticLibrary(system, library);
+        }
+        else if (argc > 4 && string(argv[3]) == "durable")
+        {
+            RecoveryReport recovery;
+            if (!system.openDurable(argv[4], EventLogOptions(), recovery, error))
+            {
+                cerr << error << endl;
+                return 1;
+            }
+            cerr << "Replayed " << recovery.events << " events in " << recovery.seconds << " s" << endl;
+        }
+        else if (argc > 3 && !system.openSnapshot(argv[3], error))
+        {
+            cerr << error << endl;
+            return 1;
+        }
+        else if (argc == 3)
+        {
+            loadSampleLibrary(system);
+        }
+        else if (argc > 4 && !system.loadFactors(argv[4], error))
+        {
+            cerr << error << endl;
+            return 1;
+        }
+        cout.rdbuf(console);
+        cerr << "Serving " << system.userCount() << " users on " << (options.socketPath.empty() ? "stdin" : options.socketPath)
+             << endl;
+
+        QueryServer server(system, options);
+        if (!server.run(error))
+        {
+            cerr << error << endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    // Offline training: demo train <snapshot> <checkpoint> [factors] [iterations];
+    // resumes from the checkpoint if it exists with as many factors, up to
+    // iterations in all, and refuses one trained on another snapshot
+    if (argc > 1 && string(argv[1]) == "train")
+    {
+        if (argc < 4)
+        {
+            cout << "Usage: " << argv[0] << " train <snapshot> <checkpoint> [factors] [iterations]" << endl;
+            return 1;
+        }
+        FactorOptions options;
+        options.factors = argc > 4 ? stoul(argv[4]) : options.factors;
+        options.iterations = argc > 5 ? stoul(argv[5]) : options.iterations;
+        options.checkpointPath = argv[3];
+        string error;
+        struct stat info;
+        if (!system.openSnapshot(argv[2], error) || (stat(argv[3], &info) == 0 && !system.loadFactors(argv[3], error)))
+        {
+            cout << error << endl;
+            return 1;
+        }
+        FactorOptions loaded = system.factorSettings();
+        auto start = chrono::steady_clock::now();
+        if (!system.trainFactors(options, error))
+        {
+            cout << error << endl;
+            return 1;
+        }
+        FactorOptions trained = system.factorSettings();
+        size_t resumed = loaded.factors == trained.factors ? loaded.iterations : 0;
+        cout << "Trained " << trained.iterations - resumed << " iterations (" << trained.iterations << " in all) of "
+             << trained.factors << " factors in "
+             << chrono::duration<double>(chrono::steady_clock::now() - start).count() << " s into " << argv[3] << endl;
+        return 0;
+    }
+
+    if (argc > 1 && string(argv[1]) == "load")
+    {
+        // Bulk mode: demo load <users.tsv> <books.tsv> <reads.tsv>; reads may
+        // introduce users and books missing from the first two files
+        if (argc != 5 && argc != 6)
+        {
+            cout << "Usage: " << argv[0] << " load <users.tsv> <books.tsv> <reads.tsv> [snapshot]" << endl;
+            return 1;
+        }
+        LoadOptions options;
+        printLoadReport("Users", system.loadUsers(argv[2], options));
+        printLoadReport("Books", system.loadBooks(argv[3], options));
+        options.createMissing = true;
+        printLoadReport("Reads", system.loadReads(argv[4], options));
+    }
+    else if (argc > 1 && string(argv[1]) == "open")
+    {
+        // Snapshot mode: demo open <snapshot> [verify]
+        string error;
+        if (argc < 3 || !system.openSnapshot(argv[2], error, argc > 3 && string(argv[3]) == "verify"))
+        {
+            cout << (argc < 3 ? "Usage: " + string(argv[0]) + " open <snapshot> [verify]" : error) << endl;
+            return 1;
+        }
+    }
+    else
+    {
+        loadSampleLibrary(system);
+    }
+
+    // demo save <snapshot>, or demo load ... <snapshot>: write what was
+    // loaded so later runs can open it instantly
+    if (argc > 2 && (string(argv[1]) == "save" || (string(argv[1]) == "load" && argc > 5)))
+    {
+        string error;
+        if (!system.saveSnapshot(argv[argc - 1], error))
+        {
+            cout << error << endl;
+            return 1;
+        }
+        cout << "Snapshot written to " << argv[argc - 1] << endl;
+        return 0;
+    }
 
     // Using k-nearest neighbors algorithm to recommend books
     string userName;
@@ -522,7 +10246,7 @@ int main()
     getline(cin, userName);
 
     // Using k-nearest neighbors algorithm to recommend books
-    vector<string> kNNRecommendations = system.kNNRecommendBooks(userName, 2);
+    vector<string> kNNRecommendations = system.kNNRecommendBooks(userName, 2, 10);
     cout << "Recommendations using kNN algorithm:" << endl;
     for (const auto &book : kNNRecommendations)
     {
@@ -530,13 +10254,30 @@ int main()
     }
     cout << endl;
 
-    // Using bipartite graph algorithm to find users who repeatedly read the same books
-    unordered_set<string> repeatedReaders = system.bipartiteAlgorithm();
-    // cout << "Users who read the same book repeatedly:" << endl;
-    // for (const auto &user : repeatedReaders)
-    // {
-    //     cout << user << endl;
-    // }
+    // Random walks reach past the two nearest users, which helps readers
+    // of a single rare book
+    system.enableRandomWalks(RandomWalkOptions());
+    vector<string> walkRecommendations = system.kNNRecommendBooks(userName, 2, 10, RecommendEngine::RandomWalk);
+    cout << "Recommendations using personalized PageRank:" << endl;
+    for (const auto &book : walkRecommendations)
+    {
+        cout << book << endl;
+    }
+    cout << endl;
+
+    // Embeddings rank every book, so they fill the list even for users
+    // whose neighbors have read little
+    FactorOptions factorOptions;
+    factorOptions.factors = 8;
+    string error;
+    system.trainFactors(factorOptions, error);
+    vector<string> embeddingRecommendations = system.kNNRecommendBooks(userName, 2, 10, RecommendEngine::Embedding);
+    cout << "Recommendations using matrix factorization:" << endl;
+    for (const auto &book : embeddingRecommendations)
+    {
+        cout << book << endl;
+    }
+    cout << endl;
 
     return 0;
 }